@@ -1,12 +1,23 @@
 #include "Martist.hpp"
 #include "include/ExpressionTree.hpp"
+#include "include/ExpressionKernels.hpp"
+#include "include/RenderCache.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <future>
 #include <time.h>
+#include <vector>
 
 #include <iostream>
 
 // local functions
 
-// Converts from -1,1 range to 0,255 range
+// Converts a span of numbers from -1,1 range to 0,255 range, writing them stride bytes apart
+static void convertFromRange(const double* numbers, std::uint8_t* output, std::size_t count, std::size_t stride);
+
+// The 0,255 range byte a number from the -1,1 range gets, exactly as convertFromRange gives it
 static std::uint8_t convertFromRange(double number);
 
 Martist::Martist(
@@ -15,51 +26,671 @@ Martist::Martist(
   std::size_t height,
   std::size_t redDepth,
   std::size_t greenDepth,
-  std::size_t blueDepth
+  std::size_t blueDepth,
+  std::vector<char> variables
 ) : buffer(buffer) {
+  if (variables.size() < 2 || variables.size() > 3)
+    throw std::invalid_argument("A martist needs two position variables and, optionally, a time variable");
+
   resize(width, height);
-  ExpressionTree::init({ 'x', 'y' });
-  redTree = ExpressionTree(redDepth);
-  greenTree = ExpressionTree(greenDepth);
-  blueTree = ExpressionTree(blueDepth);
+  context = std::make_shared<GenerationContext>(std::move(variables), ::time(NULL));
+  redTree = ExpressionTree(redDepth, context);
+  greenTree = ExpressionTree(greenDepth, context);
+  blueTree = ExpressionTree(blueDepth, context);
 }
 
 void Martist::resize(std::size_t width, std::size_t height) {
   if (width == 0 || height == 0) throw std::domain_error("Width and height must be greater than 0");
+  this->width = width;
+  this->height = height;
   halfUnitX = 1.0 / width;
   halfUnitY = 1.0 / height;
 }
 
-void Martist::paint() {
-  // DEBUG
-  // std::cout << "Building new random trees. . . " << std::flush;
-  // std::cout << "RED TREE" << std::endl;
+void Martist::threadCount(std::size_t count) {
+  if (count == 0) throw std::domain_error("Thread count must be greater than 0");
+  threads = count;
+
+  if (threads > 1) pool = std::make_unique<ThreadPool>(threads);
+  else pool.reset();
+}
+
+void Martist::shareSubexpressions(bool share) {
+  sharing = share;
+
+  // Trees that were already built get merged right away
+  if (redTree.getProgram().size() > 0) prepare();
+}
+
+void Martist::hoistSeparable(bool hoist) {
+  hoisting = hoist;
+
+  // Trees that were already built get analyzed right away
+  if (redTree.getProgram().size() > 0) prepare();
+}
+
+void Martist::precision(Precision precision) {
+  evaluationPrecision = precision;
+
+  // Trees that were already built get their bounds checked right away
+  if (redTree.getProgram().size() > 0) prepare();
+}
+
+void Martist::compileTrees(bool compile, const std::string& cacheDirectory) {
+  if (!compile) compiler.reset();
+  else if (!compiler || !cacheDirectory.empty()) compiler = std::make_unique<ExpressionJit>(cacheDirectory);
+
+  // Trees that were already built get compiled right away
+  if (redTree.getProgram().size() > 0) prepare();
+}
+
+void Martist::prepare() {
+  if (sharing || hoisting)
+    channelGraph.build({ &redTree.getProgram(), &greenTree.getProgram(), &blueTree.getProgram() }, sharing);
+
+  // Channels go to single precision only if their error bound allows it
+  const ExpressionTree* trees[] = { &redTree, &greenTree, &blueTree };
+  for (std::size_t channel = 0; channel < 3; channel++)
+    approximated[channel] = evaluationPrecision == Precision::fast
+      && trees[channel]->getProgram().singlePrecisionError() * 255 <= fastChangedBytes;
+
+  if (fixedKernels) return;
+
+  const ExpressionTree* channels[] = { &redTree, &greenTree, &blueTree };
+  for (std::size_t channel = 0; channel < 3; channel++)
+    kernels[channel] = compiler ? compiler->compile(*channels[channel]) : nullptr;
+}
+
+void Martist::draw() {
+  auto start = std::chrono::steady_clock::now();
+  prepare();
+  auto prepared = std::chrono::steady_clock::now();
+  render();
+  auto rendered = std::chrono::steady_clock::now();
+
+  recordTimes(std::chrono::duration<double>(prepared - start).count(),
+    std::chrono::duration<double>(rendered - prepared).count());
+}
+
+void Martist::build() {
+  auto start = std::chrono::steady_clock::now();
+  if (candidates > 1) search();
+
   redTree.build();
-  // std::cout << "GREEN TREE" << std::endl;
   greenTree.build();
-  // std::cout << "BLUE TREE" << std::endl;
   blueTree.build();
+
+  if (statistics)
+    statistics->record(RenderPhase::build, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+void Martist::search() {
+  // Candidates are the streams of a seed drawn from the engine, so the search only depends on the engine
+  std::uint64_t seed = context->randomEngine();
+
+  // Previews keep the image's proportion
+  std::size_t previewWidth = previewSide, previewHeight = previewSide;
+  if (width >= height) previewHeight = std::max<std::size_t>(1, previewSide * height / width);
+  else previewWidth = std::max<std::size_t>(1, previewSide * width / height);
+
+  scores.assign(candidates, PreviewScore());
+
+  std::vector<ThreadPool::Task> previews;
+  for (std::size_t index = 0; index < candidates; index++)
+    previews.push_back([this, seed, index, previewWidth, previewHeight]() {
+      std::vector<std::uint8_t> pixels(previewWidth * previewHeight * 3);
+      Martist preview(pixels.data(), previewWidth, previewHeight, redDepth(), greenDepth(), blueDepth(),
+        context->variables);
+      preview.evaluationPrecision = evaluationPrecision;
+      preview.nodeBudget(nodeBudget());
+      preview.costBudget(costBudget());
+      preview.moment = moment;
+      preview.paint(seed, index);
+      scores[index] = scorePreview(pixels.data(), previewWidth, previewHeight);
+    });
+
+  if (pool) pool->run(previews);
+  else for (auto& preview : previews) preview();
+
+  // The first of the best scoring candidates wins
+  std::size_t best = 0;
+  for (std::size_t index = 1; index < candidates; index++)
+    if (scores[index].total > scores[best].total) best = index;
+
+  context->randomEngine = SplitMix64::stream(seed, best);
+}
+
+PreviewScore Martist::scorePreview(const std::uint8_t* pixels, std::size_t width, std::size_t height) {
+  PreviewScore score;
+  std::size_t pixelCount = width * height;
+  if (pixelCount == 0) return score;
+
+  // Neighbors whose channels differ by more than this are across an edge
+  constexpr int edgeStep = 24;
+
+  double sums[3] = { 0, 0, 0 }, squares[3] = { 0, 0, 0 };
+  std::vector<std::uint32_t> histogram(4096, 0);
+  std::size_t edgePairs = 0, pairs = 0;
+
+  // Whether two pixels are across an edge
+  auto differ = [](const std::uint8_t* first, const std::uint8_t* second) {
+    for (int channel = 0; channel < 3; channel++)
+      if (std::abs(int(first[channel]) - int(second[channel])) > edgeStep) return true;
+    return false;
+  };
+
+  for (std::size_t row = 0; row < height; row++)
+    for (std::size_t column = 0; column < width; column++) {
+      const std::uint8_t* pixel = pixels + (row * width + column) * 3;
+
+      for (int channel = 0; channel < 3; channel++) {
+        sums[channel] += pixel[channel];
+        squares[channel] += double(pixel[channel]) * pixel[channel];
+      }
+      histogram[(pixel[0] >> 4) << 8 | (pixel[1] >> 4) << 4 | pixel[2] >> 4]++;
+
+      if (column + 1 < width) {
+        edgePairs += differ(pixel, pixel + 3);
+        pairs++;
+      }
+      if (row + 1 < height) {
+        edgePairs += differ(pixel, pixel + width * 3);
+        pairs++;
+      }
+    }
+
+  for (int channel = 0; channel < 3; channel++) {
+    double mean = sums[channel] / pixelCount;
+    score.contrast += std::sqrt(std::max(0.0, squares[channel] / pixelCount - mean * mean)) / 127.5 / 3;
+  }
+
+  for (std::uint32_t count : histogram)
+    if (count) score.entropy -= double(count) / pixelCount * std::log2(double(count) / pixelCount);
+  double mostEntropy = std::log2(double(std::min<std::size_t>(pixelCount, histogram.size())));
+  score.entropy = mostEntropy > 0 ? score.entropy / mostEntropy : 0.0;
+
+  score.edges = pairs ? double(edgePairs) / pairs : 0.0;
+
+  // Edges count the most when about half of the neighbors are across one, as neither flat nor noisy images are
+  score.total = score.contrast * score.entropy * (1.0 + 4.0 * score.edges * (1.0 - score.edges)) / 2.0;
+  return score;
+}
+
+void Martist::recordTimes(double prepareSeconds, double renderSeconds) {
+  lastPrepareSeconds = prepareSeconds;
+  lastRenderSeconds = renderSeconds;
+  if (!statistics) return;
+
+  statistics->record(RenderPhase::prepare, prepareSeconds);
+  statistics->record(RenderPhase::render, renderSeconds);
+  statistics->countNodes(0, redTree.getProgram());
+  statistics->countNodes(1, greenTree.getProgram());
+  statistics->countNodes(2, blueTree.getProgram());
+}
+
+void Martist::paint() {
+  // DEBUG
+  // std::cout << "Building new random trees. . . " << std::flush;
+  build();
   // std::cout << "DONE" << std::endl;
 
+  fixedKernels = false;
+
   // std::cout << "Creating a new piece of art. . . " << std::flush;
-  render();
+  draw();
   // std::cout << "DONE" << std::endl;
 }
 
+void Martist::paint(std::uint64_t seed, std::uint64_t index) {
+  context->randomEngine = SplitMix64::stream(seed, index);
+  paint();
+}
+
+void Martist::paintBatch(std::uint64_t seed, const std::vector<std::uint8_t*>& buffers,
+  std::vector<std::string>* specs) {
+  if (specs) specs->assign(buffers.size(), std::string());
+
+  // Each artwork gets a martist, and so a context, of its own, which leaves the tasks nothing to share
+  std::vector<ThreadPool::Task> artworks;
+  for (std::size_t index = 0; index < buffers.size(); index++)
+    artworks.push_back([this, seed, &buffers, specs, index]() {
+      Martist artist(buffers[index], width, height, redDepth(), greenDepth(), blueDepth(), context->variables);
+      artist.sharing = sharing;
+      artist.hoisting = hoisting;
+      artist.evaluationPrecision = evaluationPrecision;
+      artist.moment = moment;
+      artist.nodeBudget(nodeBudget());
+      artist.costBudget(costBudget());
+      artist.candidates = candidates;
+      artist.previewSide = previewSide;
+      artist.paint(seed, index);
+
+      if (specs) {
+        std::ostringstream spec;
+        spec << artist;
+        (*specs)[index] = spec.str();
+      }
+    });
+
+  if (pool) pool->run(artworks);
+  else for (auto& artwork : artworks) artwork();
+}
+
 void Martist::render() const {
-  auto bufferIterator = buffer;
-
-  // Steps throgh each pixel of the image. Does calculation to have the -1,1 range representation of this pixel's position
-  // First pixel position is halfUnit - 1
-  for (double yPosition = 1 - halfUnitY; yPosition > -1.0; yPosition -= 2 * halfUnitY) {
-    for (double xPosition = halfUnitX - 1; xPosition < 1.0; xPosition += 2 * halfUnitX) {
-      *bufferIterator++ = convertFromRange(redTree.plugVariables({ xPosition, yPosition }));
-      *bufferIterator++ = convertFromRange(greenTree.plugVariables({ xPosition, yPosition }));
-      *bufferIterator++ = convertFromRange(blueTree.plugVariables({ xPosition, yPosition }));
+  if (planeCache) {
+    renderPlanes();
+    return;
+  }
+
+  GridTables tables;
+  renderRows(buffer, 0, height, tabulate(tables) ? &tables : nullptr);
+}
+
+void Martist::renderPlanes() const {
+  std::size_t pixels = width * height;
+
+  // The planes of another size or time hold other values
+  if (width != planeWidth || height != planeHeight || moment != planeMoment) {
+    planeCache->clear();
+    planeWidth = width;
+    planeHeight = height;
+    planeMoment = moment;
+
+    planePositions.resize(3 * pixels);
+    for (std::size_t row = 0; row < height; row++)
+      for (std::size_t column = 0; column < width; column++) {
+        planePositions[row * width + column] = columnPosition(column);
+        planePositions[pixels + row * width + column] = rowPosition(row);
+      }
+    std::fill(planePositions.begin() + 2 * pixels, planePositions.end(), moment);
+  }
+
+  const double* variables[] = { planePositions.data(), planePositions.data() + pixels,
+    planePositions.data() + 2 * pixels };
+  std::vector<double> channelValues(3 * pixels);
+  double* outputs[] = { channelValues.data(), channelValues.data() + pixels, channelValues.data() + 2 * pixels };
+
+  lastEvaluatedNodes = planeCache->run({ &redTree.getProgram(), &greenTree.getProgram(), &blueTree.getProgram() },
+    variables, outputs, pixels, pool.get());
+
+  for (std::size_t channel = 0; channel < 3; channel++) convertFromRange(outputs[channel], buffer + channel, pixels, 3);
+
+  filled = 0;
+  lastApproximated = 0;
+  if (statistics) statistics->addEvaluated(pixels);
+}
+
+void Martist::paint(std::size_t stripRows, const StripSink& sink) {
+  build();
+
+  fixedKernels = false;
+  stream(stripRows, sink);
+}
+
+void Martist::stream(std::size_t stripRows, const StripSink& sink) {
+  if (stripRows == 0) throw std::domain_error("Strips must have at least 1 row");
+  stripRows = std::min(stripRows, height);
+
+  auto start = std::chrono::steady_clock::now();
+  prepare();
+  auto prepared = std::chrono::steady_clock::now();
+
+  GridTables tables;
+  const GridTables* hoisted = tabulate(tables) ? &tables : nullptr;
+
+  // While one strip is handed to the sink, the other one renders
+  std::vector<std::uint8_t> strips[2] = {
+    std::vector<std::uint8_t>(stripRows * width * 3), std::vector<std::uint8_t>(stripRows * width * 3)
+  };
+  std::future<void> handing;
+
+  for (std::size_t firstRow = 0, strip = 0; firstRow < height; firstRow += stripRows, strip ^= 1) {
+    std::size_t lastRow = std::min(firstRow + stripRows, height);
+    renderRows(strips[strip].data(), firstRow, lastRow, hoisted);
+
+    // The strip rendered before this one must be out of the sink before the next render overwrites it
+    if (handing.valid()) handing.get();
+    handing = std::async(std::launch::async, [this, &sink, &strips, strip, firstRow, lastRow]() {
+      auto handed = std::chrono::steady_clock::now();
+      sink(strips[strip].data(), firstRow, lastRow - firstRow);
+
+      if (statistics)
+        statistics->record(RenderPhase::output,
+          std::chrono::duration<double>(std::chrono::steady_clock::now() - handed).count());
+    });
+  }
+  handing.get();
+
+  auto rendered = std::chrono::steady_clock::now();
+  recordTimes(std::chrono::duration<double>(prepared - start).count(),
+    std::chrono::duration<double>(rendered - prepared).count());
+}
+
+bool Martist::tabulate(GridTables& tables) const {
+  if (!hoisting || renderedNatively()) return false;
+
+  // Evaluates the subtrees that do not change per pixel once for the whole image
+  std::vector<double> xPositions(width), yPositions(height);
+  for (std::size_t column = 0; column < width; column++) xPositions[column] = columnPosition(column);
+  for (std::size_t row = 0; row < height; row++) yPositions[row] = rowPosition(row);
+
+  tables = channelGraph.tabulate(xPositions, yPositions, fixedVariables());
+  return true;
+}
+
+void Martist::paintFrames(std::size_t frameCount, const FrameSink& sink) {
+  build();
+
+  fixedKernels = false;
+  renderFrames(frameCount, sink);
+}
+
+void Martist::renderFrames(std::size_t frameCount, const FrameSink& sink) {
+  auto start = std::chrono::steady_clock::now();
+  prepare();
+
+  // Frames always go through the graph, which finds what depends on time
+  if (!sharing && !hoisting)
+    channelGraph.build({ &redTree.getProgram(), &greenTree.getProgram(), &blueTree.getProgram() }, false);
+
+  std::vector<double> xPositions(width), yPositions(height);
+  for (std::size_t column = 0; column < width; column++) xPositions[column] = columnPosition(column);
+  for (std::size_t row = 0; row < height; row++) yPositions[row] = rowPosition(row);
+
+  // The subtrees that do not depend on time are evaluated once, over bands of rows spread over the threads
+  GridTables tables = channelGraph.tabulate(xPositions, yPositions, fixedVariables());
+  GridPlanes planes = channelGraph.planesWithout(2, height, width);
+
+  std::vector<ThreadPool::Task> bands;
+  for (std::size_t firstRow = 0; firstRow < height; firstRow += tileSide)
+    bands.push_back([this, &tables, &planes, firstRow]() {
+      thread_local std::vector<double> workspace;
+      for (std::size_t row = firstRow; row < std::min(firstRow + tileSide, height); row++)
+        channelGraph.cache(tables, planes, row, workspace);
+    });
+
+  if (pool) pool->run(bands);
+  else for (auto& band : bands) band();
+
+  auto prepared = std::chrono::steady_clock::now();
+
+  // Only what depends on time is left to evaluate for each frame
+  staticPlanes = &planes;
+  try {
+    for (std::size_t frame = 0; frame < frameCount; frame++) {
+      moment = frameTime(frame, frameCount);
+      tables = channelGraph.tabulate(xPositions, yPositions, fixedVariables());
+      renderRows(buffer, 0, height, &tables);
+
+      auto handed = std::chrono::steady_clock::now();
+      sink(buffer, frame);
+      if (statistics)
+        statistics->record(RenderPhase::output,
+          std::chrono::duration<double>(std::chrono::steady_clock::now() - handed).count());
+    }
+  }
+  catch (...) {
+    staticPlanes = nullptr;
+    throw;
+  }
+  staticPlanes = nullptr;
+
+  auto rendered = std::chrono::steady_clock::now();
+  recordTimes(std::chrono::duration<double>(prepared - start).count(),
+    std::chrono::duration<double>(rendered - prepared).count());
+}
+
+void Martist::renderRows(std::uint8_t* pixels, std::size_t firstRow, std::size_t lastRow,
+  const GridTables* tables) const {
+  if (firstRow == 0) {
+    filled = 0;
+    lastApproximated = evaluatesAlone(tables) ? approximated[0] + approximated[1] + approximated[2] : 0;
+  }
+
+  // Serially, whole rows make the longest spans, unless tiles are to be culled
+  if (!pool && !culling) {
+    renderTile(pixels, firstRow, firstRow, lastRow, 0, width, tables);
+    return;
+  }
+
+  // Splits the rows into tiles, which threads pick up and steal from each other as they finish. Culled tiles take
+  // whole rows, so that what is left of them to evaluate makes runs as long as possible
+  std::size_t tileWidth = culling ? width : tileSide;
+  std::vector<ThreadPool::Task> tiles;
+  for (std::size_t row = firstRow; row < lastRow; row += tileSide)
+    for (std::size_t column = 0; column < width; column += tileWidth)
+      tiles.push_back([this, pixels, firstRow, lastRow, row, column, tileWidth, tables]() {
+        std::size_t tileLastRow = std::min(row + tileSide, lastRow), tileLastColumn = std::min(column + tileWidth, width);
+
+        if (culling) renderAdaptive(pixels, firstRow, row, tileLastRow, column, tileLastColumn, tables);
+        else renderTile(pixels, firstRow, row, tileLastRow, column, tileLastColumn, tables);
+      });
+
+  if (pool) pool->run(tiles);
+  else for (auto& tile : tiles) tile();
+}
+
+void Martist::renderAdaptive(std::uint8_t* pixels, std::size_t origin, std::size_t firstRow, std::size_t lastRow,
+  std::size_t firstColumn, std::size_t lastColumn, const GridTables* tables) const {
+  // Which cells of the tile, smallestCulledTile pixels a side, are left to evaluate
+  std::size_t across = (lastColumn - firstColumn + smallestCulledTile - 1) / smallestCulledTile;
+  std::size_t down = (lastRow - firstRow + smallestCulledTile - 1) / smallestCulledTile;
+  thread_local std::vector<char> evaluated;
+  evaluated.assign(across * down, false);
+
+  cull(pixels, origin, firstRow, lastRow, firstColumn, lastColumn, firstRow, firstColumn, evaluated.data(), across);
+
+  // The cells left are evaluated in runs as long as each row of cells allows, since short spans are slow to
+  // evaluate. Runs only a few filled cells apart are evaluated as one, refilling those cells with the same colors
+  for (std::size_t cellRow = 0; cellRow < down; cellRow++) {
+    const char* cells = evaluated.data() + cellRow * across;
+    std::size_t row = firstRow + cellRow * smallestCulledTile;
+
+    for (std::size_t cell = 0; cell < across;) {
+      if (!cells[cell]) {
+        cell++;
+        continue;
+      }
+
+      std::size_t run = cell, end = cell;
+      while (run < across && run - end <= smallestCulledGap) {
+        if (cells[run]) end = run + 1;
+        run++;
+      }
+
+      renderTile(pixels, origin, row, std::min(row + smallestCulledTile, lastRow), firstColumn + cell * smallestCulledTile,
+        std::min(firstColumn + end * smallestCulledTile, lastColumn), tables);
+      cell = end;
     }
   }
 }
 
+void Martist::cull(std::uint8_t* pixels, std::size_t origin, std::size_t firstRow, std::size_t lastRow,
+  std::size_t firstColumn, std::size_t lastColumn, std::size_t tileRow, std::size_t tileColumn, char* evaluated,
+  std::size_t across) const {
+  // Positions grow with columns and shrink with rows
+  Interval positions[] = {
+    { columnPosition(firstColumn), columnPosition(lastColumn - 1) }, { rowPosition(lastRow - 1), rowPosition(firstRow) },
+    { moment, moment }
+  };
+
+  // The region is flat if, for each channel, both ends of its bounds convert to the same byte. Conversion never
+  // decreases, so then so does every value between them
+  const ExpressionTree* channels[] = { &redTree, &greenTree, &blueTree };
+  std::size_t rows = lastRow - firstRow, columns = lastColumn - firstColumn;
+  std::uint8_t color[3];
+  std::size_t spread = 0;
+  for (std::size_t channel = 0; channel < 3; channel++) {
+    Interval bounds = channels[channel]->bound(positions);
+    color[channel] = convertFromRange(bounds.lower);
+    spread = std::max(spread, std::size_t(convertFromRange(bounds.upper) - color[channel]));
+
+    if (hopeless(rows, columns, spread)) break;
+  }
+
+  if (spread == 0) {
+    for (std::size_t row = firstRow; row < lastRow; row++) {
+      std::uint8_t* pixel = pixels + ((row - origin) * width + firstColumn) * 3;
+      for (std::size_t column = firstColumn; column < lastColumn; column++, pixel += 3)
+        std::copy(color, color + 3, pixel);
+    }
+
+    filled += (lastRow - firstRow) * (lastColumn - firstColumn);
+    if (statistics) statistics->addFilled((lastRow - firstRow) * (lastColumn - firstColumn));
+    return;
+  }
+
+  if ((rows <= smallestCulledTile && columns <= smallestCulledTile) || hopeless(rows, columns, spread)) {
+    for (std::size_t row = firstRow; row < lastRow; row += smallestCulledTile)
+      for (std::size_t column = firstColumn; column < lastColumn; column += smallestCulledTile)
+        evaluated[(row - tileRow) / smallestCulledTile * across + (column - tileColumn) / smallestCulledTile] = true;
+    return;
+  }
+
+  // Splits the region in half, on cell boundaries, along each side longer than a cell
+  std::size_t middleRow = firstRow + (rows + smallestCulledTile - 1) / smallestCulledTile / 2 * smallestCulledTile;
+  std::size_t middleColumn = firstColumn + (columns + smallestCulledTile - 1) / smallestCulledTile / 2 * smallestCulledTile;
+  if (middleRow == firstRow) middleRow = lastRow;
+  if (middleColumn == firstColumn) middleColumn = lastColumn;
+
+  std::size_t halves[][2] = { { firstRow, middleRow }, { middleRow, lastRow } };
+  std::size_t sides[][2] = { { firstColumn, middleColumn }, { middleColumn, lastColumn } };
+  for (auto& half : halves)
+    for (auto& side : sides)
+      if (half[0] < half[1] && side[0] < side[1])
+        cull(pixels, origin, half[0], half[1], side[0], side[1], tileRow, tileColumn, evaluated, across);
+}
+
+void Martist::renderTile(std::uint8_t* pixels, std::size_t origin, std::size_t firstRow, std::size_t lastRow,
+  std::size_t firstColumn, std::size_t lastColumn, const GridTables* tables) const {
+  std::size_t columns = lastColumn - firstColumn;
+
+  // Each thread keeps its scratch memory between tiles, which may be only a few pixels wide when culling
+  // The -1,1 range representation of each column's position, of the current row's position and of the time
+  thread_local std::vector<double> xPositions, yPositions, times;
+  xPositions.resize(columns);
+  yPositions.resize(columns);
+  times.assign(columns, moment);
+  const double* variables[] = { xPositions.data(), yPositions.data(), times.data() };
+
+  // The same positions and values in single precision, for approximated channels
+  thread_local std::vector<float> floatVariables, floatValues, floatWorkspace;
+  bool approximating = evaluatesAlone(tables) && (approximated[0] || approximated[1] || approximated[2]);
+  const float* floatSpans[] = { nullptr, nullptr, nullptr };
+  if (approximating) {
+    floatVariables.resize(columns * 3);
+    floatValues.resize(columns);
+    for (std::size_t variable = 0; variable < 3; variable++) floatSpans[variable] = floatVariables.data() + variable * columns;
+    for (std::size_t column = 0; column < columns; column++) {
+      floatVariables[column] = float(columnPosition(firstColumn + column));
+      floatVariables[2 * columns + column] = float(moment);
+    }
+  }
+
+  // Holds a row's values for each channel
+  thread_local std::vector<double> values;
+  values.resize(columns * 3);
+  double* channelValues[] = { values.data(), values.data() + columns, values.data() + 2 * columns };
+  // Scratch memory for the trees' evaluation
+  thread_local std::vector<double> workspace;
+
+  const ExpressionTree* channels[] = { &redTree, &greenTree, &blueTree };
+
+  // Positions come from the pixel indices, so that any tile yields the same values as the whole image
+  for (std::size_t column = 0; column < columns; column++) xPositions[column] = columnPosition(firstColumn + column);
+
+  if (statistics) statistics->addEvaluated((lastRow - firstRow) * columns);
+
+  // Steps through each row of the tile, evaluating all of its pixels at once for each channel
+  for (std::size_t row = firstRow; row < lastRow; row++) {
+    std::fill(yPositions.begin(), yPositions.begin() + columns, rowPosition(row));
+
+    // A sample of the rows is evaluated instruction by instruction, which gives the same values, to profile them
+    if (statistics && !approximating && row % RenderStats::sampledRowInterval == 0) {
+      thread_local OperatorProfile profiles[256];
+      std::fill(profiles, profiles + 256, OperatorProfile());
+      for (std::size_t channel = 0; channel < 3; channel++)
+        channels[channel]->getProgram().profile(variables, channelValues[channel], columns, workspace, profiles);
+      statistics->addProfile(profiles);
+    }
+    else if (staticPlanes) channelGraph.run(*tables, *staticPlanes, row, firstColumn, channelValues, columns, workspace);
+    else if (renderedNatively())
+      for (std::size_t channel = 0; channel < 3; channel++) kernels[channel](variables, channelValues[channel], columns);
+    else if (tables) channelGraph.run(*tables, row, firstColumn, channelValues, columns, workspace);
+    else if (sharing) channelGraph.run(variables, channelValues, columns, workspace);
+    else
+      for (std::size_t channel = 0; channel < 3; channel++) {
+        if (!approximating || !approximated[channel]) {
+          channels[channel]->plugVariables(variables, channelValues[channel], columns, workspace);
+          continue;
+        }
+
+        std::fill(floatVariables.begin() + columns, floatVariables.begin() + 2 * columns, float(rowPosition(row)));
+        channels[channel]->getProgram().run(floatSpans, floatValues.data(), columns, floatWorkspace);
+        std::copy(floatValues.begin(), floatValues.begin() + columns, channelValues[channel]);
+      }
+
+    for (std::size_t channel = 0; channel < 3; channel++)
+      convertFromRange(channelValues[channel], pixels + ((row - origin) * width + firstColumn) * 3 + channel, columns, 3);
+  }
+}
+
+void Martist::paint(SpecRecord& record) {
+  std::swap(redTree, record.red);
+  std::swap(greenTree, record.green);
+  std::swap(blueTree, record.blue);
+
+  // The record's trees were read with a context of their own
+  redTree.setContext(context);
+  greenTree.setContext(context);
+  blueTree.setContext(context);
+
+  fixedKernels = false;
+  draw();
+}
+
+bool Martist::paint(const std::string& spec, RenderCache& cache) {
+  std::istringstream specStream(spec);
+
+  // What the image depends on besides its spec and size, written exactly
+  std::string variant;
+  if (animated()) {
+    char time[32];
+    std::snprintf(time, sizeof(time), "t=%a", moment);
+    variant = time;
+  }
+  if (evaluationPrecision == Precision::fast) variant += variant.empty() ? "fast" : " fast";
+
+  auto start = std::chrono::steady_clock::now();
+  if (cache.find(spec, width, height, buffer, variant, context->variables)) {
+    auto parsed = std::chrono::steady_clock::now();
+    specStream >> redTree >> greenTree >> blueTree;
+    fixedKernels = false;
+
+    // Nothing about the image was rendered, but the graph describes the new trees
+    for (auto& kernel : kernels) kernel = nullptr;
+    filled = 0;
+    lastApproximated = 0;
+    lastPrepareSeconds = lastRenderSeconds = 0.0;
+    if (sharing || hoisting)
+      channelGraph.build({ &redTree.getProgram(), &greenTree.getProgram(), &blueTree.getProgram() }, sharing);
+
+    if (statistics) {
+      auto now = std::chrono::steady_clock::now();
+      statistics->record(RenderPhase::cached, std::chrono::duration<double>(parsed - start).count());
+      statistics->record(RenderPhase::parse, std::chrono::duration<double>(now - parsed).count());
+      statistics->countNodes(0, redTree.getProgram());
+      statistics->countNodes(1, greenTree.getProgram());
+      statistics->countNodes(2, blueTree.getProgram());
+    }
+    return true;
+  }
+
+  specStream >> *this;
+  cache.insert(spec, width, height, buffer, variant, context->variables);
+  return false;
+}
+
 std::ostream& operator<<(std::ostream& out, const Martist& martist) {
   out << martist.redTree << '\n' << martist.greenTree << '\n' << martist.blueTree << '\n';
 
@@ -67,13 +698,32 @@ std::ostream& operator<<(std::ostream& out, const Martist& martist) {
 }
 
 std::istream& operator>>(std::istream& in, Martist& martist) {
+  auto start = std::chrono::steady_clock::now();
   in >> martist.redTree >> martist.greenTree >> martist.blueTree;
 
-  martist.render();
+  if (martist.statistics)
+    martist.statistics->record(RenderPhase::parse,
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+  martist.fixedKernels = false;
+  martist.draw();
 
   return in;
 }
 
+static void convertFromRange(const double* numbers, std::uint8_t* output, std::size_t count, std::size_t stride) {
+  std::size_t index = 0;
+
+  for (; index + WidestLane::width <= count; index += WidestLane::width)
+    WidestLane::storeBytes(output + index * stride, stride,
+      ExpressionKernels<WidestLane>::quantize(WidestLane::load(numbers + index)));
+
+  for (; index < count; index++)
+    ScalarLane::storeBytes(output + index * stride, stride, ExpressionKernels<ScalarLane>::quantize(numbers[index]));
+}
+
 static std::uint8_t convertFromRange(double number) {
-  return (std::uint8_t)((number + 1.0) * 127.5);
+  std::uint8_t byte;
+  ScalarLane::storeBytes(&byte, 1, ExpressionKernels<ScalarLane>::quantize(number));
+  return byte;
 }
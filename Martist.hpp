@@ -1,18 +1,65 @@
 #ifndef __MARTIST__
 #define __MARTIST__
 
+#include "include/ExpressionGraph.hpp"
+#include "include/ExpressionJit.hpp"
 #include "include/ExpressionTree.hpp"
+#include "include/ImageWriter.hpp"
+#include "include/PlaneCache.hpp"
+#include "include/RenderStats.hpp"
+#include "include/SpecCorpus.hpp"
+#include "include/StaticExpression.hpp"
+#include "include/ThreadPool.hpp"
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <sstream>
 #include <stdexcept>
+#include <vector>
+
+// Keeps painted images, which martists can paint specs through
+class RenderCache;
+
+// How closely images are evaluated
+enum class Precision : std::uint8_t {
+  // In double precision, which every evaluation path gives the exact same image with
+  exact,
+  // In single precision, with trigonometric polynomials half as long, for each channel whose error bound is within
+  // Martist::fastChangedBytes. Bytes change by at most 1
+  fast
+};
+
+// How interesting a small render of an artwork looks, from statistics cheap enough to take over many of them
+struct PreviewScore {
+  // Standard deviation of each channel, averaged and scaled to [0, 1]
+  double contrast = 0.0;
+  // Entropy of the histogram of colors, at 4 bits per channel, scaled to [0, 1] by the most the preview could have
+  double entropy = 0.0;
+  // Share of neighboring pixels that differ sharply in some channel
+  double edges = 0.0;
+  // The three together, which is 0 for images of a single color and also favors edges neither absent nor everywhere
+  double total = 0.0;
+};
 
 class Martist {
 public:
+  // Receives rows [firstRow, firstRow + rows) of an image, 3 bytes per pixel, which are only valid during the call
+  typedef std::function<void(const std::uint8_t* pixels, std::size_t firstRow, std::size_t rows)> StripSink;
+
+  // Receives frame number frame of an animation, 3 bytes per pixel, which is only valid during the call
+  typedef std::function<void(const std::uint8_t* pixels, std::size_t frame)> FrameSink;
+
   friend std::ostream& operator<<(std::ostream& out, const Martist& martist);
   friend std::istream& operator>>(std::istream& out, Martist& martist);
 
+  // The trees are built from the given variables. The first one runs along columns and the second along rows.
+  // A third one, if any, is time, which makes the trees animated. Throws std::invalid_argument for any other count
   Martist(std::uint8_t* buffer, std::size_t width,
     std::size_t height, std::size_t redDepth,
-    std::size_t greenDepth, std::size_t blueDepth);
+    std::size_t greenDepth, std::size_t blueDepth,
+    std::vector<char> variables = { 'x', 'y' });
 
   // Change the buffer and update the image's sizes
   void changeBuffer(std::uint8_t* buffer, std::size_t width, std::size_t height) {
@@ -35,16 +82,233 @@ public:
   // Blue tree depth getter
   std::size_t blueDepth() const { return blueTree.getDepth(); }
 
+  // Sets the most nodes each channel tree may be built with, so that deep trees stay a manageable size
+  void nodeBudget(std::size_t budget) {
+    for (auto* tree : { &redTree, &greenTree, &blueTree }) tree->setNodeBudget(budget);
+  }
+  // Node budget getter
+  std::size_t nodeBudget() const { return redTree.getNodeBudget(); }
+
+  // Sets the most nanoseconds per pixel the three channel trees together may be estimated to take. Each tree gets
+  // a third of it, so that new images are estimated to take the budget times their pixel count at most, whatever
+  // their trees draw. Throws std::domain_error if it is not greater than 0
+  void costBudget(double nanoseconds) {
+    for (auto* tree : { &redTree, &greenTree, &blueTree }) tree->setCostBudget(nanoseconds / 3);
+    pixelCostBudget = nanoseconds;
+  }
+  // Cost budget getter
+  double costBudget() const { return pixelCostBudget; }
+
+  // Estimated nanoseconds evaluating the channel trees takes per pixel, from the costs of their expressions. Those
+  // are only as close as the costs are to this machine's, see ExpressionFactory::populateExpressions
+  double estimatedCost() const { return redTree.cost() + greenTree.cost() + blueTree.cost(); }
+
+  // Estimated seconds rendering the current trees takes on a single thread, with no other rendering option
+  double estimatedSeconds() const { return estimatedCost() * width * height * 1e-9; }
+
   // Sets the seed for all the color channel trees
-  void seed(unsigned int seed) {
-    redTree.setSeed(seed);
-    greenTree.setSeed(seed);
-    blueTree.setSeed(seed);
+  void seed(std::uint64_t seed) { context->randomEngine.seed(seed); }
+
+  // Sets the time at which images are painted, in the -1,1 range like positions are. Only animated trees use it
+  void time(double moment) { this->moment = moment; }
+  // Time getter
+  double time() const { return moment; }
+
+  // Whether the trees depend on time as well as on positions
+  bool animated() const { return context->variables.size() > 2; }
+
+  // The time of frame number frame out of frameCount. Frames go from -1 up to, but not including, 1, so that
+  // a looping animation does not show the same instant twice
+  static double frameTime(std::size_t frame, std::size_t frameCount) { return 2.0 * frame / frameCount - 1; }
+
+  // Sets how many threads render the image. 1 renders it serially on the calling thread
+  void threadCount(std::size_t count);
+  // Thread count getter
+  std::size_t threadCount() const { return threads; }
+
+  // Sets the side, in pixels, of the square tiles the image is split into when rendering in parallel
+  void tileSize(std::size_t size) {
+    if (size == 0) throw std::domain_error("Tile size must be greater than 0");
+    tileSide = size;
+  }
+  // Tile size getter
+  std::size_t tileSize() const { return tileSide; }
+
+  // Sets whether subexpressions shared within and between the channel trees are evaluated only once per pixel
+  void shareSubexpressions(bool share);
+  // Subexpression sharing getter
+  bool shareSubexpressions() const { return sharing; }
+
+  // How many of the channel trees' nodes are merged into others when sharing subexpressions
+  std::size_t deduplicatedNodes() const { return sharing ? channelGraph.deduplicatedNodes() : 0; }
+
+  // Sets whether subtrees that depend only on x or only on y are evaluated once per column or row instead
+  // of once per pixel, and constant subtrees only once
+  void hoistSeparable(bool hoist);
+  // Separable hoisting getter
+  bool hoistSeparable() const { return hoisting; }
+
+  // Sets whether tiles are first bounded over their whole range of positions, so that those whose every pixel
+  // would get the same color are filled without evaluating them. Other tiles are split and tried again, down to
+  // a few pixels a side. The image is the same either way
+  void cullFlatTiles(bool cull) { culling = cull; }
+  // Flat tile culling getter
+  bool cullFlatTiles() const { return culling; }
+
+  // How many pixels of the last image were filled from their tile's bounds rather than evaluated
+  std::size_t filledPixels() const { return filled; }
+
+  // Sets how closely images are evaluated. Fast precision only applies to channels evaluated on their own, so not
+  // when sharing subexpressions, hoisting separable subtrees, compiling trees, caching node planes or rendering frames
+  void precision(Precision precision);
+  // Precision getter
+  Precision precision() const { return evaluationPrecision; }
+
+  // Largest share of the -1,1 range within which fast precision may change a channel's byte. A byte only changes,
+  // and by 1 at most, when its value lies within the error bound of one of the 255 steps between bytes, which
+  // covers 255 times the bound's share of the range. Channels whose bound covers more are evaluated exactly. How
+  // many bytes change depends on where the values lie: values spread over the range change about this share of
+  // them, but a flat channel that happens to lie near a step may change most of its bytes
+  static constexpr double fastChangedBytes = 0.01;
+
+  // How many channels of the last image were evaluated in single precision, which is none unless they were
+  // evaluated each on its own
+  std::size_t approximatedChannels() const { return lastApproximated; }
+
+  // Sets whether the channel trees are compiled to native code before rendering. If any of them cannot be
+  // compiled, the trees are interpreted as usual. Libraries are cached in cacheDirectory if one is given, or
+  // else in ExpressionJit::defaultDirectory
+  void compileTrees(bool compile, const std::string& cacheDirectory = "");
+  // Native compilation getter
+  bool compileTrees() const { return compiler != nullptr; }
+
+  // Whether the last image was rendered with natively compiled or static trees
+  bool renderedNatively() const { return kernels[0] && kernels[1] && kernels[2]; }
+
+  // Seconds it took to get the last image's trees ready for rendering, which includes compiling them
+  double prepareSeconds() const { return lastPrepareSeconds; }
+
+  // Seconds it took to render the last image
+  double renderSeconds() const { return lastRenderSeconds; }
+
+  // Sets whether the martist records what it does in a stats object: how long building, parsing, preparing,
+  // rendering and handing over images took, what its trees are made of and, from a sample of the rows, what each
+  // kind of expression costs. Turning it on starts from empty stats, and turning it off costs nothing more than a
+  // few checks per image and row
+  void collectStats(bool collect) { statistics.reset(collect ? new RenderStats() : nullptr); }
+  // Stats collection getter
+  bool collectStats() const { return statistics != nullptr; }
+
+  // The stats recorded so far, or nullptr when not collecting them. Callers may record phases of their own,
+  // such as writing images out
+  RenderStats* stats() { return statistics.get(); }
+  const RenderStats* stats() const { return statistics.get(); }
+
+  // Sets how many candidate artworks are generated each time new trees are painted. With more than 1, each
+  // candidate is rendered at preview size, in parallel over the martist's threads, and only the best scoring one
+  // is painted at full size. The candidates only depend on the random engine, not on the thread count
+  void searchCandidates(std::size_t count) {
+    if (count == 0) throw std::domain_error("There must be at least 1 candidate");
+    candidates = count;
+  }
+  // Search candidates getter
+  std::size_t searchCandidates() const { return candidates; }
+
+  // Sets the side, in pixels, of the longer dimension of candidate previews. The other keeps the image's proportion
+  void previewSize(std::size_t side) {
+    if (side < 2) throw std::domain_error("Previews must be at least 2 pixels a side");
+    previewSide = side;
+  }
+  // Preview size getter
+  std::size_t previewSize() const { return previewSide; }
+
+  // Scores of the candidates of the last search, in the order they were generated
+  const std::vector<PreviewScore>& candidateScores() const { return scores; }
+
+  // Scores an image of 3 bytes per pixel
+  static PreviewScore scorePreview(const std::uint8_t* pixels, std::size_t width, std::size_t height);
+
+  // Sets how many bytes the values of the channel trees' nodes over the last image may take, one plane of 8 bytes
+  // per pixel for each node, so that rendering again after editing a tree only evaluates the nodes that changed
+  // and those on the path from them to the head. Nodes past the budget are evaluated again every time. When on,
+  // caching takes over rendering from every other option but threads, which split each node's plane between them.
+  // 0 turns it off
+  void cacheNodePlanes(std::size_t byteBudget) { planeCache.reset(byteBudget ? new PlaneCache(byteBudget) : nullptr); }
+  // Node plane budget getter
+  std::size_t cacheNodePlanes() const { return planeCache ? planeCache->byteBudget() : 0; }
+
+  // How many nodes the last render evaluated, when caching node planes
+  std::size_t evaluatedNodes() const { return lastEvaluatedNodes; }
+
+  // The tree of channel 0, 1 or 2, to be edited before redrawing. Throws std::domain_error for any other channel
+  ExpressionTree& channelTree(std::size_t channel) {
+    if (channel > 2) throw std::domain_error("There are only 3 channels");
+    return channel == 0 ? redTree : channel == 1 ? greenTree : blueTree;
+  }
+
+  // Paints the current trees again, after they were edited
+  void redraw() {
+    fixedKernels = false;
+    draw();
   }
 
   // Generates new image and paints it to the buffer
   void paint();
 
+  // Generates artwork number index of the given seed and paints it to the buffer. The trees only depend on
+  // the seed and index, and not on anything painted before
+  void paint(std::uint64_t seed, std::uint64_t index);
+
+  // Paints artworks 0 to buffers.size() - 1 of the given seed, one into each buffer, building and rendering
+  // them in parallel over the martist's threads. The buffers must fit an image of the martist's size. If
+  // specs is given, it receives each artwork's spec
+  void paintBatch(std::uint64_t seed, const std::vector<std::uint8_t*>& buffers,
+    std::vector<std::string>* specs = nullptr);
+
+  // Paints an already parsed record. Its trees are swapped with the martist's, so that reading the next
+  // record reuses the memory of the last one
+  void paint(SpecRecord& record);
+
+  // Paints a spec, as reading it does, unless the cache already holds its image at the martist's size, in which
+  // case the image is copied into the buffer and the spec is only read into the trees. Images painted are added
+  // to the cache. Returns whether the image came from the cache. Images are keyed by the time they are painted at
+  // when the martist is animated, and by their precision when it is fast, so no other time or precision gets them.
+  // An image from the cache is its own phase in the stats, and leaves what is measured of the last image at none:
+  // it was not rendered natively, approximated or filled, and took no time to prepare or render
+  bool paint(const std::string& spec, RenderCache& cache);
+
+  // Generates new trees and streams them, as stream does
+  void paint(std::size_t stripRows, const StripSink& sink);
+
+  // Renders the current trees in strips of stripRows rows, top to bottom, handing each finished strip to the sink
+  // while the next one renders. Only two strips are held at a time, so memory does not grow with the image's
+  // height, and the buffer is not used at all
+  void stream(std::size_t stripRows, const StripSink& sink);
+
+  // Generates new trees and renders frameCount frames of them, as renderFrames does
+  void paintFrames(std::size_t frameCount, const FrameSink& sink);
+
+  // Renders frameCount frames of the current trees into the buffer, each at its frameTime, handing each one to the
+  // sink as it is done. Subtrees that do not depend on time are evaluated only once for all frames: every pixel's
+  // value of those that time dependent ones read is kept, which takes 8 bytes per pixel for each of them. Frames
+  // are the same as painting each time on its own
+  void renderFrames(std::size_t frameCount, const FrameSink& sink);
+
+  // Paints specs known at compile time, declared with STATIC_SPEC, evaluating them with no dispatch at all.
+  // The specs are read into the channel trees as well, so the martist can be written out as usual
+  template <class RedSpec, class GreenSpec, class BlueSpec> void paintStatic() {
+    std::istringstream specs(std::string(RedSpec::value) + "\n" + std::string(GreenSpec::value) + "\n"
+      + std::string(BlueSpec::value));
+    specs >> redTree >> greenTree >> blueTree;
+
+    kernels[0] = &StaticExpression<RedSpec>::run;
+    kernels[1] = &StaticExpression<GreenSpec>::run;
+    kernels[2] = &StaticExpression<BlueSpec>::run;
+    fixedKernels = true;
+
+    draw();
+  }
+
   //////////////////// TEST METHODS
 
   // Returns the unit sizes as a string
@@ -53,26 +317,179 @@ public:
   }
 
 private:
+  // Gets the freshly built or read trees ready for rendering
+  void prepare();
+
+  // Prepares the trees and renders them, timing both
+  void draw();
+
+  // Builds new random trees, or the best of the candidates when searching, timing it
+  void build();
+
+  // Previews every candidate and sets the random engine to build the best scoring one
+  void search();
+
+  // Keeps how long the last image took to prepare and render, and records it if collecting stats
+  void recordTimes(double prepareSeconds, double renderSeconds);
+
   // Renders the image
   void render() const;
 
+  // Renders the image from the node planes, evaluating only the nodes that are not cached
+  void renderPlanes() const;
+
+  // Evaluates the subtrees that do not change per pixel, if hoisting them. Returns whether it did
+  bool tabulate(GridTables& tables) const;
+
+  // Renders rows [firstRow, lastRow) into pixels, which holds them and nothing before them.
+  // The grid tables are used when hoisting separable subtrees
+  void renderRows(std::uint8_t* pixels, std::size_t firstRow, std::size_t lastRow, const GridTables* tables) const;
+
+  // Renders the tile in rows [firstRow, lastRow) and columns [firstColumn, lastColumn) like renderTile does,
+  // but first fills its flat regions and then evaluates only the rest
+  void renderAdaptive(std::uint8_t* pixels, std::size_t origin, std::size_t firstRow, std::size_t lastRow,
+    std::size_t firstColumn, std::size_t lastColumn, const GridTables* tables) const;
+
+  // Fills a region of the tile starting at tileRow and tileColumn if its bounds allow, or else tries its quarters
+  // the same way, until they are single cells. Cells that could not be filled are marked in evaluated, which
+  // holds across cells per row of cells
+  void cull(std::uint8_t* pixels, std::size_t origin, std::size_t firstRow, std::size_t lastRow,
+    std::size_t firstColumn, std::size_t lastColumn, std::size_t tileRow, std::size_t tileColumn, char* evaluated,
+    std::size_t across) const;
+
+  // Whether a region of a few cells a side, whose bounds span spread bytes, is too steep for any of its cells to
+  // be flat. Within so few cells bounds shrink about as fast as the region does
+  bool hopeless(std::size_t rows, std::size_t columns, std::size_t spread) const {
+    std::size_t side = std::max(rows, columns);
+    return side <= 8 * smallestCulledTile && spread * smallestCulledTile > side;
+  }
+
+  // Whether rendering with the grid tables evaluates each channel on its own, the only way fast precision applies
+  bool evaluatesAlone(const GridTables* tables) const { return !renderedNatively() && !tables && !sharing; }
+
+  // Renders the pixels in rows [firstRow, lastRow) and columns [firstColumn, lastColumn) into pixels, which
+  // starts at row origin. The grid tables are used when hoisting separable subtrees or rendering frames
+  void renderTile(std::uint8_t* pixels, std::size_t origin, std::size_t firstRow, std::size_t lastRow,
+    std::size_t firstColumn, std::size_t lastColumn, const GridTables* tables) const;
+
+  // The values the fixed variables take over the image: none for the positions, and then the time
+  std::vector<double> fixedVariables() const { return { 0.0, 0.0, moment }; }
+
+  // The -1,1 range representation of a column's position. First pixel position is halfUnit - 1
+  double columnPosition(std::size_t column) const { return (2 * column + 1) * halfUnitX - 1; }
+  // The -1,1 range representation of a row's position. First pixel position is 1 - halfUnit
+  double rowPosition(std::size_t row) const { return 1 - (2 * row + 1) * halfUnitY; }
+
   // Sets halfUnitX and halfUnitY in respect to the provided width and height
   void resize(std::size_t width, std::size_t height);
 
   // The image's buffer
   std::uint8_t* buffer;
 
+  // The image's width, in pixels
+  std::size_t width;
+  // The image's height, in pixels
+  std::size_t height;
+
   // The first value of X in the image array
   double halfUnitX;
   // The first value of Y in the image array
   double halfUnitY;
 
+  // Variables, expressions and random engine of the channel trees, which no other martist shares
+  std::shared_ptr<GenerationContext> context;
+
   // The red channel expression tree
   ExpressionTree redTree;
   // The green channel expression tree
   ExpressionTree greenTree;
   // The blue channel expression tree
   ExpressionTree blueTree;
+
+  // Most nanoseconds per pixel the channel trees may cost together
+  double pixelCostBudget = std::numeric_limits<double>::infinity();
+
+  // How many threads render the image
+  std::size_t threads = 1;
+
+  // Side of the tiles rendered by each parallel task
+  std::size_t tileSide = 64;
+
+  // The threads that render tiles, when there is more than one
+  std::unique_ptr<ThreadPool> pool;
+
+  // The time images are painted at
+  double moment = 0.0;
+
+  // Values of the subtrees that do not depend on time, while rendering frames
+  const GridPlanes* staticPlanes = nullptr;
+
+  // How many candidates are tried whenever new trees are generated
+  std::size_t candidates = 1;
+
+  // Longer side of candidate previews
+  std::size_t previewSide = 32;
+
+  // Scores of the last search's candidates
+  std::vector<PreviewScore> scores;
+
+  // Whether the channels are evaluated through a graph that shares their subexpressions
+  bool sharing = false;
+
+  // How closely images are evaluated
+  Precision evaluationPrecision = Precision::exact;
+
+  // Which channels are evaluated in single precision whenever they are evaluated on their own
+  bool approximated[3] = { false, false, false };
+
+  // How many channels the last image evaluated in single precision
+  mutable std::size_t lastApproximated = 0;
+
+  // Whether subtrees that do not change per pixel are evaluated ahead of the pixels
+  bool hoisting = false;
+
+  // Whether tiles whose bounds fit a single color are filled without evaluating their pixels
+  bool culling = false;
+
+  // Side of the smallest regions that are bounded, under which pixels are evaluated
+  static constexpr std::size_t smallestCulledTile = 16;
+
+  // Most filled cells in a row that a run of evaluated cells goes through, rather than being split at them
+  static constexpr std::size_t smallestCulledGap = 4;
+
+  // Pixels of the last image filled from bounds
+  mutable std::atomic<std::size_t> filled{ 0 };
+
+  // The three channel trees as one graph, when sharing subexpressions or hoisting separable subtrees
+  ExpressionGraph channelGraph;
+
+  // Compiles the trees to native code, when enabled
+  std::unique_ptr<ExpressionJit> compiler;
+
+  // Native code of each channel tree, if compiled
+  ChannelKernel kernels[3] = { nullptr, nullptr, nullptr };
+
+  // Whether the kernels were given along with the trees, rather than compiled from them
+  bool fixedKernels = false;
+
+  // Values of the channel trees' nodes over the last image, when caching them
+  std::unique_ptr<PlaneCache> planeCache;
+
+  // Each pixel's variables for the cached planes, and the size and time they hold
+  mutable std::vector<double> planePositions;
+  mutable std::size_t planeWidth = 0;
+  mutable std::size_t planeHeight = 0;
+  mutable double planeMoment = 0.0;
+
+  // Nodes evaluated by the last render from node planes
+  mutable std::size_t lastEvaluatedNodes = 0;
+
+  // What the martist has been doing, when collecting stats
+  std::unique_ptr<RenderStats> statistics;
+
+  // How long the last image took to prepare and to render
+  double lastPrepareSeconds = 0.0;
+  double lastRenderSeconds = 0.0;
 };
 
 
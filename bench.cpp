@@ -0,0 +1,264 @@
+#include "Martist.hpp"
+#include "include/SpecArchive.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Benchmarks building, parsing, rendering and writing images. Everything is generated from fixed seeds, so runs on
+// the same code are comparable, and results are written to the standard output as JSON. Each measurement is the
+// fastest of a few repeats, which is the least disturbed by whatever else the machine is doing
+
+// How many times each measurement is repeated
+static constexpr int repeats = 3;
+
+// Seed of the trees built, and of the spec corpus
+static constexpr std::uint64_t benchSeed = 2024;
+
+// How many specs the corpus has, and the depth of their trees
+static constexpr std::size_t corpusSize = 64;
+static constexpr std::size_t corpusDepth = 12;
+
+// Depth of the trees rendered
+static constexpr std::size_t renderDepth = 10;
+
+// Nodes built at each depth, which takes a measurable time whatever size trees of that depth come out
+static constexpr std::size_t buildNodes = std::size_t(1) << 20;
+
+// A new empty file in /tmp with the given suffix, whose name no other run of the benchmarks takes
+static std::string temporaryPath(const std::string& suffix) {
+  std::string path = "/tmp/martist-bench-XXXXXX" + suffix;
+  int file = mkstemps(&path[0], int(suffix.size()));
+  if (file < 0) throw std::runtime_error("Cannot create a temporary file in /tmp");
+
+  close(file);
+  return path;
+}
+
+// Seconds the fastest of the repeats of a task took
+template <class Task> static double fastest(Task task) {
+  double best = 1e300;
+
+  for (int repeat = 0; repeat < repeats; repeat++) {
+    auto start = std::chrono::steady_clock::now();
+    task();
+    best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+
+  return best;
+}
+
+// Gathers results as JSON objects
+class Report {
+public:
+  // Starts a result of the given benchmark
+  Report& begin(const std::string& name) {
+    results.push_back("{ \"name\": \"" + name + "\"");
+    return *this;
+  }
+
+  // Adds a field to the current result
+  template <class Value> Report& field(const std::string& key, const Value& value) {
+    std::ostringstream text;
+    text.precision(6);
+    text << ", \"" << key << "\": " << value;
+    results.back() += text.str();
+    return *this;
+  }
+
+  Report& field(const std::string& key, const std::string& value) {
+    results.back() += ", \"" + key + "\": \"" + value + "\"";
+    return *this;
+  }
+
+  void write(std::ostream& out) const {
+    out << "{\n  \"repeats\": " << repeats << ",\n  \"results\": [\n";
+    for (std::size_t index = 0; index < results.size(); index++)
+      out << "    " << results[index] << " }" << (index + 1 < results.size() ? "," : "") << "\n";
+    out << "  ]\n}\n";
+  }
+
+private:
+  std::vector<std::string> results;
+};
+
+// Times building trees of several depths
+static void benchBuild(Report& report) {
+  for (std::size_t depth : { 4, 8, 12, 16 }) {
+    auto context = std::make_shared<GenerationContext>(std::vector<char>{ 'x', 'y' }, benchSeed);
+    ExpressionTree tree(depth, context);
+
+    // Trees do not double with depth, so as many are built as it takes to reach the node count
+    std::size_t trees = 0, nodes = 0;
+    double seconds = fastest([&]() {
+      context->randomEngine.seed(benchSeed);
+      trees = nodes = 0;
+      while (nodes < buildNodes) {
+        tree.build();
+        nodes += tree.getProgram().size();
+        trees++;
+      }
+    });
+
+    report.begin("build").field("depth", depth).field("trees", trees).field("nodes", nodes)
+      .field("seconds", seconds).field("nodesPerSecond", nodes / seconds);
+  }
+}
+
+// The specs of the corpus, three channel lines each
+static std::vector<std::string> makeCorpus() {
+  auto context = std::make_shared<GenerationContext>(std::vector<char>{ 'x', 'y' }, benchSeed);
+  ExpressionTree tree(corpusDepth, context);
+  std::vector<std::string> corpus;
+
+  for (std::size_t index = 0; index < corpusSize; index++) {
+    context->randomEngine = SplitMix64::stream(benchSeed, index);
+    std::ostringstream spec;
+    for (int channel = 0; channel < 3; channel++) {
+      tree.build();
+      spec << tree << '\n';
+    }
+    corpus.push_back(spec.str());
+  }
+
+  return corpus;
+}
+
+// Times reading the corpus' specs into trees
+static void benchParse(Report& report, const std::vector<std::string>& corpus) {
+  std::size_t bytes = 0;
+  for (const auto& spec : corpus) bytes += spec.size();
+
+  ExpressionTree trees[3];
+  std::size_t nodes = 0;
+  double seconds = fastest([&]() {
+    nodes = 0;
+    for (const auto& spec : corpus) {
+      std::istringstream in(spec);
+      for (auto& tree : trees) {
+        in >> tree;
+        nodes += tree.getProgram().size();
+      }
+    }
+  });
+
+  report.begin("parse").field("specs", corpus.size()).field("bytes", bytes).field("nodes", nodes)
+    .field("seconds", seconds).field("nodesPerSecond", nodes / seconds)
+    .field("bytesPerSecond", bytes / seconds);
+}
+
+// Times reading the corpus' records from a binary archive
+static void benchArchive(Report& report, const std::vector<std::string>& corpus) {
+  const std::string path = temporaryPath(".mspb");
+  std::string text;
+  for (const auto& spec : corpus) text += spec;
+  std::istringstream in(text);
+  SpecArchive::write(path, in);
+
+  std::size_t nodes = 0;
+  double seconds;
+  {
+    SpecArchive archive(path);
+    SpecRecord record;
+    seconds = fastest([&]() {
+      nodes = 0;
+      archive.rewind();
+      while (archive.next(record))
+        nodes += record.red.size() + record.green.size() + record.blue.size();
+    });
+  }
+  std::remove(path.c_str());
+
+  report.begin("archive").field("specs", corpus.size()).field("nodes", nodes).field("seconds", seconds)
+    .field("nodesPerSecond", nodes / seconds);
+}
+
+// Times rendering a spec at several sizes, thread counts and evaluation modes
+static void benchRender(Report& report, const std::string& spec) {
+  const char* modes[] = { "interpreted", "shared", "hoisted" };
+
+  for (std::size_t side : { 256, 1024 })
+    for (std::size_t threads : { 1, 2, 4 })
+      for (int mode = 0; mode < 3; mode++) {
+        std::vector<std::uint8_t> pixels(side * side * 3);
+        Martist martist(pixels.data(), side, side, renderDepth, renderDepth, renderDepth);
+        martist.threadCount(threads);
+        martist.shareSubexpressions(mode >= 1);
+        martist.hoistSeparable(mode >= 2);
+
+        // Only the render itself is timed, not reading and preparing the trees
+        double seconds = 1e300;
+        for (int repeat = 0; repeat < repeats; repeat++) {
+          std::istringstream in(spec);
+          in >> martist;
+          seconds = std::min(seconds, martist.renderSeconds());
+        }
+
+        report.begin("render").field("width", side).field("height", side).field("threads", threads)
+          .field("mode", std::string(modes[mode])).field("seconds", seconds)
+          .field("nsPerPixel", seconds * 1e9 / (side * side))
+          .field("estimatedNsPerPixel", martist.estimatedCost());
+      }
+}
+
+// Times writing a rendered image in each format
+static void benchWrite(Report& report, const std::string& spec) {
+  constexpr std::size_t side = 1024;
+  std::vector<std::uint8_t> pixels(side * side * 3);
+  Martist martist(pixels.data(), side, side, renderDepth, renderDepth, renderDepth);
+  std::istringstream in(spec);
+  in >> martist;
+
+  auto record = [&](const std::string& format, double seconds, std::size_t bytes) {
+    report.begin("write").field("format", format).field("width", side).field("height", side)
+      .field("bytes", bytes).field("seconds", seconds).field("nsPerPixel", seconds * 1e9 / (side * side));
+  };
+
+  const std::string path = temporaryPath(".ppm");
+  double seconds = fastest([&]() { writePPM(path, pixels.data(), side, side); });
+  record("ppm", seconds, side * side * 3);
+  std::remove(path.c_str());
+
+  std::size_t bytes = 0;
+  PngEncoder encoder;
+  seconds = fastest([&]() {
+    std::ostringstream out;
+    encoder.write(out, pixels.data(), side, side);
+    bytes = out.str().size();
+  });
+  record("png", seconds, bytes);
+
+  seconds = fastest([&]() {
+    std::ostringstream out;
+    StreamedY4M video(out, side, side);
+    video.append(pixels.data());
+    bytes = out.str().size();
+  });
+  record("y4m", seconds, bytes);
+}
+
+int main() {
+  Report report;
+  auto corpus = makeCorpus();
+
+  // A spec of the depth rendered, the same on every run
+  std::uint8_t pixel[3];
+  Martist painter(pixel, 1, 1, renderDepth, renderDepth, renderDepth);
+  painter.paint(benchSeed, 0);
+  std::ostringstream spec;
+  spec << painter;
+
+  benchBuild(report);
+  benchParse(report, corpus);
+  benchArchive(report, corpus);
+  benchRender(report, spec.str());
+  benchWrite(report, spec.str());
+
+  report.write(std::cout);
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include "Martist.hpp"
+#include "include/RenderServer.hpp"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Asks a render daemon for images or for its metrics:
+//
+//   ./client SOCKET metrics
+//   ./client SOCKET OUTPUT [width=W] [height=H] [format=ppm|png|y4m] [depth=D] [seed=S] [index=I] [spec=FILE]
+//
+// The image is written to OUTPUT, or to the standard output if it is -, and the spec painted to the standard error
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " SOCKET metrics | SOCKET OUTPUT [FIELD=VALUE]..." << std::endl;
+    return 2;
+  }
+
+  try {
+    RenderClient client(argv[1]);
+
+    if (std::string(argv[2]) == "metrics") {
+      std::cout << client.metrics();
+      return 0;
+    }
+
+    // Fields are given as they are sent, except for the spec, which is read from its file
+    std::string line = "render", spec;
+    for (int index = 3; index < argc; index++) {
+      std::string field = argv[index];
+
+      if (field.compare(0, 5, "spec=") == 0) {
+        std::ifstream file(field.substr(5));
+        if (!file) throw std::runtime_error("Cannot read spec " + field.substr(5));
+        std::ostringstream text;
+        text << file.rdbuf();
+        spec = text.str();
+        continue;
+      }
+
+      line += " " + field;
+    }
+
+    std::size_t specLength;
+    RenderRequest request = RenderRequest::fromLine(line, specLength);
+    request.spec = spec;
+
+    std::string output = argv[2];
+    std::ofstream file;
+    if (output != "-") {
+      file.open(output, std::ios::binary);
+      if (!file) throw std::runtime_error("Cannot write " + output);
+    }
+
+    std::cerr << client.render(request, output == "-" ? std::cout : file);
+  }
+  catch (const std::exception& error) {
+    std::cerr << "ERROR: " << error.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
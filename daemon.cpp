@@ -0,0 +1,50 @@
+#include "Martist.hpp"
+#include "include/RenderServer.hpp"
+#include <algorithm>
+#include <csignal>
+#include <iostream>
+#include <pthread.h>
+#include <string>
+#include <thread>
+
+// Paints images for render clients until interrupted or terminated:
+//
+//   ./daemon SOCKET [THREADS] [BATCH]
+//
+// Metrics are written to the standard output when it stops
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " SOCKET [THREADS] [BATCH]" << std::endl;
+    return 2;
+  }
+
+  std::size_t threads = argc > 2 ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+  std::size_t batch = argc > 3 ? std::stoul(argv[3]) : 8;
+
+  // Signals are only taken by the waiting thread, so that the server's threads are never interrupted by them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  try {
+    RenderServer server(argv[1], std::max<std::size_t>(threads, 1), batch);
+    std::thread serving(&RenderServer::serve, &server);
+    std::cerr << "Listening at " << argv[1] << std::endl;
+
+    int signal;
+    sigwait(&signals, &signal);
+    server.stop();
+    serving.join();
+
+    std::cout << server.metrics();
+  }
+  catch (const std::exception& error) {
+    std::cerr << "ERROR: " << error.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
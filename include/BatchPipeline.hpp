@@ -0,0 +1,128 @@
+#ifndef __BATCH_PIPELINE__
+#define __BATCH_PIPELINE__
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "./ImageWriter.hpp"
+#include "./SpecArchive.hpp"
+#include "./SpecCorpus.hpp"
+
+// A queue of limited capacity between threads. Pushing to a full queue waits for room, which holds a fast
+// producer back to the pace of its consumers, and popping from an empty one waits for an item
+template <class Item> class BoundedQueue {
+public:
+  BoundedQueue(std::size_t capacity) : capacity(capacity) {}
+
+  // Adds an item, waiting for room. Returns false, dropping it, if the queue was closed
+  bool push(Item item) {
+    std::unique_lock<std::mutex> guard(lock);
+    roomLeft.wait(guard, [this]() { return closed || items.size() < capacity; });
+    if (closed) return false;
+
+    items.push_back(std::move(item));
+    itemLeft.notify_one();
+    return true;
+  }
+
+  // Takes the oldest item, waiting for one. Returns false once the queue is closed and empty
+  bool pop(Item& item) {
+    std::unique_lock<std::mutex> guard(lock);
+    itemLeft.wait(guard, [this]() { return closed || !items.empty(); });
+    if (items.empty()) return false;
+
+    item = std::move(items.front());
+    items.pop_front();
+    roomLeft.notify_one();
+    return true;
+  }
+
+  // Wakes everyone waiting. Items left can still be popped, but no more are pushed
+  void close() {
+    std::lock_guard<std::mutex> guard(lock);
+    closed = true;
+    roomLeft.notify_all();
+    itemLeft.notify_all();
+  }
+
+private:
+  std::size_t capacity;
+  std::deque<Item> items;
+  bool closed = false;
+  std::mutex lock;
+  std::condition_variable roomLeft;
+  std::condition_variable itemLeft;
+};
+
+// How long each stage of a pipeline run was busy, added over its threads, and how long the run took
+struct PipelineStats {
+  // Generating or reading trees
+  double buildSeconds = 0.0;
+  // Rendering them
+  double renderSeconds = 0.0;
+  // Encoding and writing images
+  double encodeSeconds = 0.0;
+  // From start to end
+  double wallSeconds = 0.0;
+  std::size_t images = 0;
+};
+
+// Paints many images into files in three stages, each over threads of its own: building or reading trees,
+// rendering them and encoding the images. Stages hand their work over through bounded queues, so that every
+// stage keeps busy while the others are and none runs far ahead. Trees and pixel buffers go round from one image
+// to the next, and each thread keeps its martist or encoder, so no image allocates anything once the pipeline is
+// full. Images are the same as a martist painting them one after the other
+class BatchPipeline {
+public:
+  // Names the file image number index is written to
+  typedef std::function<std::string(std::size_t index)> PathMaker;
+
+  // Images are width by height pixels, written in the given format to the files path names. Generated trees are
+  // depth deep
+  BatchPipeline(std::size_t width, std::size_t height, std::size_t depth, ImageFormat format, PathMaker path);
+
+  // Sets how many threads each stage runs on. Throws std::domain_error if any count is 0
+  void stageThreads(std::size_t builders, std::size_t renderers, std::size_t encoders);
+
+  // Sets how many images may wait between two stages. Throws std::domain_error if it is 0
+  void queueCapacity(std::size_t capacity);
+  // Queue capacity getter
+  std::size_t queueCapacity() const { return capacity; }
+
+  // Paints artworks 0 to count - 1 of the seed, as Martist::paint(seed, index) would
+  PipelineStats run(std::uint64_t seed, std::size_t count);
+
+  // Paints specs, three channel lines each. Throws std::invalid_argument if any is malformed
+  PipelineStats run(const std::vector<std::string>& specs);
+
+  // Paints every record of an archive
+  PipelineStats run(const SpecArchive& archive);
+
+  // Any error in any stage stops the whole run and is rethrown once its threads are done
+
+private:
+  // Fills a record with the trees of image number index
+  typedef std::function<void(std::size_t index, SpecRecord& record)> TreeMaker;
+
+  // Runs the stages over count images, whose trees are made by make
+  PipelineStats run(std::size_t count, const TreeMaker& make);
+
+  std::size_t width;
+  std::size_t height;
+  std::size_t depth;
+  ImageFormat format;
+  PathMaker path;
+
+  std::size_t builders = 1;
+  std::size_t renderers = 1;
+  std::size_t encoders = 1;
+  std::size_t capacity = 4;
+};
+
+#endif
@@ -1,13 +1,34 @@
 #ifndef __EXPRESSION_FUNCTION__
 #define __EXPRESSION_FUNCTION__
 
+#include <cstddef>
 #include <vector>
 
+// A range of values, both ends included
+struct Interval {
+  double lower;
+  double upper;
+};
+
 // Types of functions used in the expressions
 // Functions that take only one parameter
 typedef double (*SingleExpressionFunction)(double);
 // Functions that take two parameters
 typedef double (*DoubleExpressionFunction)(double, double);
+// Functions that apply a single parameter expression to a whole span of values
+typedef void (*SingleBatchFunction)(const double*, double*, std::size_t);
+// Functions that apply a two parameter expression to two whole spans of values
+typedef void (*DoubleBatchFunction)(const double*, const double*, double*, std::size_t);
+// Functions that apply a single parameter expression to a whole span of floats, as fast as single precision allows
+typedef void (*SingleFloatBatchFunction)(const float*, float*, std::size_t);
+// Functions that apply a two parameter expression to two whole spans of floats, as fast as single precision allows
+typedef void (*DoubleFloatBatchFunction)(const float*, const float*, float*, std::size_t);
+// Functions that bound a single parameter expression over a range of values
+typedef Interval (*SingleIntervalFunction)(Interval);
+// Functions that bound a two parameter expression over two ranges of values
+typedef Interval (*DoubleIntervalFunction)(Interval, Interval);
+// Functions that evaluate a whole channel over spans of values, one span per variable
+typedef void (*ChannelKernel)(const double* const*, double*, std::size_t);
 
 
 struct Expression {
@@ -22,17 +43,64 @@ struct Expression {
     // For expressions that have two children
     DoubleExpressionFunction doubleFunction;
   };
+  // The space where we store this expression's function over spans of values
+  union {
+    // For expressions that have one child
+    SingleBatchFunction singleBatchFunction;
+    // For expressions that have two children
+    DoubleBatchFunction doubleBatchFunction;
+  };
+  // The space where we store this expression's function over spans of floats
+  union {
+    // For expressions that have one child
+    SingleFloatBatchFunction singleFloatBatchFunction;
+    // For expressions that have two children
+    DoubleFloatBatchFunction doubleFloatBatchFunction;
+  };
+  // The space where we store this expression's bounds over ranges of values
+  union {
+    // For expressions that have one child
+    SingleIntervalFunction singleIntervalFunction;
+    // For expressions that have two children
+    DoubleIntervalFunction doubleIntervalFunction;
+  };
+  // Name of the ExpressionKernels function behind this expression, for generated code
+  const char* kernelName = nullptr;
+  // How much an error in its operands, which are within -1,1, can grow through this expression
+  double errorGain = 0.0;
+  // Largest error the float function adds to the expression's value, besides what comes from its operands
+  double floatError = 0.0;
+  // Nanoseconds the batch function takes per value
+  double cost = 0.0;
 
   Expression() = default;
 
-  Expression(char representation, SingleExpressionFunction operation)
+  Expression(char representation, SingleExpressionFunction operation, SingleBatchFunction batchOperation,
+    SingleFloatBatchFunction floatBatchOperation, SingleIntervalFunction intervalOperation, double gain,
+    double addedError, double valueCost, const char* kernel)
     : characterRepresentation(representation)
-    , singleFunction(operation) {
+    , singleFunction(operation)
+    , singleBatchFunction(batchOperation)
+    , singleFloatBatchFunction(floatBatchOperation)
+    , singleIntervalFunction(intervalOperation)
+    , kernelName(kernel)
+    , errorGain(gain)
+    , floatError(addedError)
+    , cost(valueCost) {
   }
 
-  Expression(char representation, DoubleExpressionFunction operation)
+  Expression(char representation, DoubleExpressionFunction operation, DoubleBatchFunction batchOperation,
+    DoubleFloatBatchFunction floatBatchOperation, DoubleIntervalFunction intervalOperation, double gain,
+    double addedError, double valueCost, const char* kernel)
     : characterRepresentation(representation)
-    , doubleFunction(operation) {
+    , doubleFunction(operation)
+    , doubleBatchFunction(batchOperation)
+    , doubleFloatBatchFunction(floatBatchOperation)
+    , doubleIntervalFunction(intervalOperation)
+    , kernelName(kernel)
+    , errorGain(gain)
+    , floatError(addedError)
+    , cost(valueCost) {
   }
 
   Expression(char representation, int variableIndex)
@@ -45,19 +113,62 @@ struct Expression {
 class ExpressionFactory {
 public:
   static void populateExpressions(std::vector<Expression>& singleExpressions, std::vector<Expression>& doubleExpressions) {
-    singleExpressions = { Expression('s', &sin), Expression('c',&cosin) };
-    doubleExpressions = { Expression('*', &product), Expression('a', &mean) };
+    // Trigonometric expressions are as steep as PI. Products of values within -1,1 pass on the errors of both
+    // operands, and means half of them. Floats round products and means by half a unit in the last place.
+    // Costs were measured with measureCosts on an AVX-512 Xeon, where the trigonometric kernels are 7 times
+    // as slow as the others. They are kept the same everywhere, so that trees built within a cost budget are the
+    // same on every machine, but estimates made with them can be off by a third or more elsewhere. Contexts that
+    // need this machine's costs measure them
+    singleExpressions = {
+      Expression('s', &sin, &sinBatch, &sinFloatBatch, &sinInterval, trigGain, trigFloatError, 0.95, "sin"),
+      Expression('c', &cosin, &cosinBatch, &cosinFloatBatch, &cosinInterval, trigGain, trigFloatError, 0.95, "cosin")
+    };
+    doubleExpressions = {
+      Expression('*', &product, &productBatch, &productFloatBatch, &productInterval, 1.0, floatRounding, 0.13,
+        "product"),
+      Expression('a', &mean, &meanBatch, &meanFloatBatch, &meanInterval, 0.5, floatRounding, 0.13, "mean")
+    };
   }
 
+  // Replaces the costs of the expressions with how long their batch functions take on this machine, timed over
+  // spans of values within -1,1. Takes a few milliseconds
+  static void measureCosts(std::vector<Expression>& singleExpressions, std::vector<Expression>& doubleExpressions);
+
   // Uninstantiatable
   ExpressionFactory() = delete;
 
+  // Largest relative error of rounding to float
+  static constexpr double floatRounding = 0x1.0p-24;
+
 private:
+  // The error bounds of the trigonometric expressions, defined with the kernels
+  static const double trigGain;
+  static const double trigFloatError;
+
   /////////////////////// EXPRESSION FUNCTIONS
   static double sin(double);
   static double cosin(double);
   static double product(double, double);
   static double mean(double, double);
+
+  /////////////////////// BATCH EXPRESSION FUNCTIONS
+  static void sinBatch(const double*, double*, std::size_t);
+  static void cosinBatch(const double*, double*, std::size_t);
+  static void productBatch(const double*, const double*, double*, std::size_t);
+  static void meanBatch(const double*, const double*, double*, std::size_t);
+
+  /////////////////////// FLOAT BATCH EXPRESSION FUNCTIONS
+  static void sinFloatBatch(const float*, float*, std::size_t);
+  static void cosinFloatBatch(const float*, float*, std::size_t);
+  static void productFloatBatch(const float*, const float*, float*, std::size_t);
+  static void meanFloatBatch(const float*, const float*, float*, std::size_t);
+
+  /////////////////////// INTERVAL EXPRESSION FUNCTIONS
+  // Each one bounds every value its expression function can give for inputs within the ranges
+  static Interval sinInterval(Interval);
+  static Interval cosinInterval(Interval);
+  static Interval productInterval(Interval, Interval);
+  static Interval meanInterval(Interval, Interval);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,166 @@
+#ifndef __EXPRESSION_GRAPH__
+#define __EXPRESSION_GRAPH__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "./ExpressionProgram.hpp"
+
+// A distinct subexpression of the graph
+struct GraphNode {
+  // What this node computes, as in the instruction it came from
+  OpCode code;
+  // The expression carried out by this node
+  Expression expression;
+  // The value of constant nodes
+  double constant;
+  // Indices of the nodes whose values this node takes as operands
+  std::size_t operands[2];
+  // Which variables the node's value depends on, one bit per variable index
+  std::uint32_t dependencies;
+};
+
+// Identifies a subexpression by its operation and its operands
+struct NodeKey {
+  OpCode code;
+  char representation;
+  // The variable index or the constant's bits
+  std::uint64_t value;
+  std::size_t operands[2];
+
+  bool operator==(const NodeKey& other) const {
+    return code == other.code && representation == other.representation && value == other.value
+      && operands[0] == other.operands[0] && operands[1] == other.operands[1];
+  }
+};
+
+// Hashes the key of a subexpression
+struct NodeKeyHash {
+  std::size_t operator()(const NodeKey& key) const {
+    std::size_t hash = std::size_t(key.code) * 31 + std::size_t(key.representation);
+    hash = hash * 1000003 ^ std::hash<std::uint64_t>()(key.value);
+    hash = hash * 1000003 ^ key.operands[0];
+    return hash * 1000003 ^ key.operands[1];
+  }
+};
+
+// How a node's value changes over an image grid, whose columns follow the first variable and rows the second
+enum class Variation : std::uint8_t {
+  // Same value for the whole grid
+  constant,
+  // Changes only from column to column
+  perColumn,
+  // Changes only from row to row
+  perRow,
+  // Changes from pixel to pixel
+  perPixel
+};
+
+// The values of the nodes that do not change per pixel, worked out for one image grid
+struct GridTables {
+  // Per column nodes hold one value per column, per row nodes one per row. Constant nodes hold
+  // their value repeated over a whole batch, so that they can be read as a span
+  std::vector<std::vector<double>> values;
+};
+
+// The values over a whole grid of the per pixel nodes that do not depend on one of the fixed variables, worked out
+// once so that the grid can be evaluated again for other values of that variable. Only the nodes that something
+// depending on the variable reads, or that are outputs, are kept
+struct GridPlanes {
+  // Kept nodes hold one value per pixel, row after row. The rest hold nothing
+  std::vector<std::vector<double>> values;
+  // The bit of the variable the kept nodes do not depend on
+  std::uint32_t variable = 0;
+  // How many values each row of the grid has
+  std::size_t columns = 0;
+};
+
+// Several expression programs merged into one directed acyclic graph in which every distinct
+// subexpression, whether repeated within a program or shared between programs, appears only once
+class ExpressionGraph {
+public:
+  // Turns the programs into the graph, replacing whatever it held. Each program becomes one output.
+  // When merging, repeated subexpressions become a single node
+  void build(const std::vector<const ExpressionProgram*>& programs, bool merge = true);
+
+  // Evaluates every output over whole spans of values. variables holds one span of count values per variable,
+  // outputs one destination of count values per program. The workspace is scratch memory to be reused across calls
+  void run(const double* const* variables, double* const* outputs, std::size_t count,
+    std::vector<double>& workspace) const;
+
+  // Works out, for a grid, the value of every node that does not change per pixel. columnValues and rowValues are
+  // the values the first two variables take over the grid, fixedVariables the value of any further variable
+  GridTables tabulate(const std::vector<double>& columnValues, const std::vector<double>& rowValues,
+    const std::vector<double>& fixedVariables = {}) const;
+
+  // Evaluates every output over count pixels of a grid row, starting at firstColumn, evaluating only the nodes
+  // that change per pixel. outputs holds one destination of count values per program
+  void run(const GridTables& tables, std::size_t row, std::size_t firstColumn, double* const* outputs,
+    std::size_t count, std::vector<double>& workspace) const;
+
+  // Sets up planes for the nodes of a grid of the given size that do not depend on the given variable and that
+  // evaluating the grid for each of its values would read. They are then filled row by row with cache
+  GridPlanes planesWithout(std::size_t variable, std::size_t rows, std::size_t columns) const;
+
+  // Evaluates a row of the planes' nodes, with the tables worked out for the grid at any value of their variable
+  void cache(const GridTables& tables, GridPlanes& planes, std::size_t row, std::vector<double>& workspace) const;
+
+  // Evaluates every output like the grid run above, reading the nodes the planes hold from them instead of
+  // evaluating them and whatever only they depend on. The tables are worked out for the current value of the
+  // planes' variable
+  void run(const GridTables& tables, const GridPlanes& planes, std::size_t row, std::size_t firstColumn,
+    double* const* outputs, std::size_t count, std::vector<double>& workspace) const;
+
+  // Number of distinct subexpressions
+  std::size_t size() const { return nodes.size(); }
+
+  // Number of programs merged in
+  std::size_t outputCount() const { return outputs.size(); }
+
+  // How many of the programs' instructions were merged into nodes that already existed
+  std::size_t deduplicatedNodes() const { return instructionCount - nodes.size(); }
+
+  // How many nodes change from pixel to pixel over a grid
+  std::size_t perPixelNodes() const;
+
+private:
+  // Assigns a workspace plane to each node that needs one, reusing the planes of nodes whose value is no longer
+  // needed. Returns how many planes are used at once
+  template <class NeedsPlane> std::size_t assignPlanes(std::vector<std::size_t>& planes, NeedsPlane needsPlane) const;
+
+  // Works out how each node changes over a grid, and which of them a grid evaluation keeps in planes
+  void classify();
+
+  // Evaluates the per pixel nodes over count pixels of a grid row, writing the outputs if given. With planes, the
+  // nodes they hold are read from them and those that only they depend on are skipped. With filling planes, only the
+  // nodes that do not depend on their variable are evaluated instead, and those they hold are stored in them
+  void runGrid(const GridTables& tables, const GridPlanes* planes, GridPlanes* filling, std::size_t row,
+    std::size_t firstColumn, double* const* outputs, std::size_t count, std::vector<double>& workspace) const;
+
+  // The nodes, each listed after its operands
+  std::vector<GraphNode> nodes;
+
+  // The node holding each program's result
+  std::vector<std::size_t> outputs;
+
+  // The workspace plane each node writes its values to. Variable nodes have none
+  std::vector<std::size_t> planes;
+
+  // How many planes evaluation needs at once
+  std::size_t planeCount = 0;
+
+  // How each node changes over a grid
+  std::vector<Variation> variations;
+
+  // The workspace plane each node writes its values to when evaluating over a grid
+  std::vector<std::size_t> gridPlanes;
+
+  // How many planes grid evaluation needs at once
+  std::size_t gridPlaneCount = 0;
+
+  // How many instructions the merged programs had in total
+  std::size_t instructionCount = 0;
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef __EXPRESSION_JIT__
+#define __EXPRESSION_JIT__
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include "./ExpressionTree.hpp"
+
+// Directory holding the headers generated kernels include. The makefile points it at this repository's include
+#ifndef MARTIST_INCLUDE_DIR
+#define MARTIST_INCLUDE_DIR "include"
+#endif
+
+// Compiles expression trees into native channel kernels. Each tree's spec is turned into C++, built into a
+// shared library with the local compiler and loaded with dlopen. Libraries are cached on disk, keyed by spec and
+// by the kernel header they were built against, so that a spec is only ever compiled once per version of the
+// kernels. Loading a library runs its code, so the cache directory must be the user's own: it is created private,
+// and refused if it belongs to someone else or others may write to it, in which case nothing is compiled
+class ExpressionJit {
+public:
+  // Keeps libraries in cacheDirectory, or by default in martist-jit under $XDG_CACHE_HOME or $HOME/.cache
+  ExpressionJit(std::string cacheDirectory = "", std::string compiler = "g++");
+
+  ~ExpressionJit();
+
+  ExpressionJit(const ExpressionJit&) = delete;
+  ExpressionJit& operator=(const ExpressionJit&) = delete;
+
+  // Returns the native kernel for the tree, compiling it if it is not cached yet.
+  // Returns nullptr when it cannot be compiled or loaded, in which case the tree should be interpreted
+  ChannelKernel compile(const ExpressionTree& tree);
+
+  // Seconds the last compile call took, whether it hit the cache or not
+  double lastCompileSeconds() const { return lastSeconds; }
+
+  // Whether the last compile call found its kernel already built
+  bool lastCompileCached() const { return lastCached; }
+
+  // What went wrong with the last compile call that returned nullptr, such as the compiler's errors
+  const std::string& lastCompileError() const { return lastError; }
+
+  // The cache directory used when none is given
+  static std::string defaultDirectory();
+
+  // Writes the C++ source of the tree's kernel
+  static std::string generateSource(const ExpressionTree& tree, const std::string& spec);
+
+private:
+  // Loads a built library, checking that it belongs to the spec. Returns nullptr if it does not
+  void* load(const std::string& path, const std::string& spec);
+
+  // Where built libraries are kept
+  std::string directory;
+
+  // Why the directory cannot be used, if it cannot
+  std::string directoryError;
+
+  // Hash of the kernel header the libraries include, which is part of their cache key
+  std::uint64_t kernelHash = 0;
+
+  // Command that compiles the generated source
+  std::string compilerCommand;
+
+  // Libraries already loaded, by spec
+  std::map<std::string, void*> libraries;
+
+  double lastSeconds = 0.0;
+  bool lastCached = false;
+  std::string lastError;
+};
+
+#endif
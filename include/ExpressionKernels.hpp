@@ -0,0 +1,317 @@
+#ifndef __EXPRESSION_KERNELS__
+#define __EXPRESSION_KERNELS__
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#ifdef __AVX512F__
+// GCC reports the undefined pass-through operands inside its own AVX-512 intrinsics as uninitialized
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// Lanes wrap the arithmetic of one register width, so that each kernel is written once and yields
+// bit-identical results whether it runs on a single value or on a whole vector of them
+
+// A lane over a single double
+struct ScalarLane {
+  typedef double Value;
+  static constexpr std::size_t width = 1;
+
+  static Value load(const double* source) { return *source; }
+  static void store(double* destination, Value value) { *destination = value; }
+  static Value broadcast(double value) { return value; }
+
+  static Value add(Value a, Value b) { return a + b; }
+  static Value subtract(Value a, Value b) { return a - b; }
+  static Value multiply(Value a, Value b) { return a * b; }
+  static Value minimum(Value a, Value b) { return a < b ? a : b; }
+  static Value maximum(Value a, Value b) { return a > b ? a : b; }
+
+  // Rounds to the nearest integer, ties to even
+  static Value round(Value a) { return std::nearbyint(a); }
+  static Value floor(Value a) { return std::floor(a); }
+
+  // Truncates the value into a byte. The value must already be in the 0,255 range
+  static void storeBytes(std::uint8_t* destination, std::size_t, Value value) { *destination = std::uint8_t(value); }
+};
+
+#ifdef __AVX2__
+// A lane over four doubles
+struct Avx2Lane {
+  typedef __m256d Value;
+  static constexpr std::size_t width = 4;
+
+  static Value load(const double* source) { return _mm256_loadu_pd(source); }
+  static void store(double* destination, Value value) { _mm256_storeu_pd(destination, value); }
+  static Value broadcast(double value) { return _mm256_set1_pd(value); }
+
+  static Value add(Value a, Value b) { return _mm256_add_pd(a, b); }
+  static Value subtract(Value a, Value b) { return _mm256_sub_pd(a, b); }
+  static Value multiply(Value a, Value b) { return _mm256_mul_pd(a, b); }
+  static Value minimum(Value a, Value b) { return _mm256_min_pd(a, b); }
+  static Value maximum(Value a, Value b) { return _mm256_max_pd(a, b); }
+
+  static Value round(Value a) { return _mm256_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+  static Value floor(Value a) { return _mm256_floor_pd(a); }
+
+  static void storeBytes(std::uint8_t* destination, std::size_t stride, Value value) {
+    alignas(16) std::int32_t integers[width];
+    _mm_store_si128((__m128i*)integers, _mm256_cvttpd_epi32(value));
+    for (std::size_t index = 0; index < width; index++) destination[index * stride] = std::uint8_t(integers[index]);
+  }
+};
+#endif
+
+#ifdef __AVX512F__
+// A lane over eight doubles
+struct Avx512Lane {
+  typedef __m512d Value;
+  static constexpr std::size_t width = 8;
+
+  static Value load(const double* source) { return _mm512_loadu_pd(source); }
+  static void store(double* destination, Value value) { _mm512_storeu_pd(destination, value); }
+  static Value broadcast(double value) { return _mm512_set1_pd(value); }
+
+  static Value add(Value a, Value b) { return _mm512_add_pd(a, b); }
+  static Value subtract(Value a, Value b) { return _mm512_sub_pd(a, b); }
+  static Value multiply(Value a, Value b) { return _mm512_mul_pd(a, b); }
+  static Value minimum(Value a, Value b) { return _mm512_min_pd(a, b); }
+  static Value maximum(Value a, Value b) { return _mm512_max_pd(a, b); }
+
+  static Value round(Value a) { return _mm512_roundscale_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+  static Value floor(Value a) { return _mm512_roundscale_pd(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+
+  static void storeBytes(std::uint8_t* destination, std::size_t stride, Value value) {
+    alignas(32) std::int32_t integers[width];
+    _mm256_store_si256((__m256i*)integers, _mm512_cvttpd_epi32(value));
+    for (std::size_t index = 0; index < width; index++) destination[index * stride] = std::uint8_t(integers[index]);
+  }
+};
+#endif
+
+// Widest lane this build can use
+#if defined(__AVX512F__)
+typedef Avx512Lane WidestLane;
+#elif defined(__AVX2__)
+typedef Avx2Lane WidestLane;
+#else
+typedef ScalarLane WidestLane;
+#endif
+
+// Lanes over floats, for evaluating in single precision. Constants are broadcast as the nearest float
+
+// A lane over a single float
+struct ScalarFloatLane {
+  typedef float Value;
+  static constexpr std::size_t width = 1;
+
+  static Value load(const float* source) { return *source; }
+  static void store(float* destination, Value value) { *destination = value; }
+  static Value broadcast(double value) { return float(value); }
+
+  static Value add(Value a, Value b) { return a + b; }
+  static Value subtract(Value a, Value b) { return a - b; }
+  static Value multiply(Value a, Value b) { return a * b; }
+  static Value minimum(Value a, Value b) { return a < b ? a : b; }
+  static Value maximum(Value a, Value b) { return a > b ? a : b; }
+
+  static Value round(Value a) { return std::nearbyint(a); }
+  static Value floor(Value a) { return std::floor(a); }
+};
+
+#ifdef __AVX2__
+// A lane over eight floats
+struct Avx2FloatLane {
+  typedef __m256 Value;
+  static constexpr std::size_t width = 8;
+
+  static Value load(const float* source) { return _mm256_loadu_ps(source); }
+  static void store(float* destination, Value value) { _mm256_storeu_ps(destination, value); }
+  static Value broadcast(double value) { return _mm256_set1_ps(float(value)); }
+
+  static Value add(Value a, Value b) { return _mm256_add_ps(a, b); }
+  static Value subtract(Value a, Value b) { return _mm256_sub_ps(a, b); }
+  static Value multiply(Value a, Value b) { return _mm256_mul_ps(a, b); }
+  static Value minimum(Value a, Value b) { return _mm256_min_ps(a, b); }
+  static Value maximum(Value a, Value b) { return _mm256_max_ps(a, b); }
+
+  static Value round(Value a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+  static Value floor(Value a) { return _mm256_floor_ps(a); }
+};
+#endif
+
+#ifdef __AVX512F__
+// A lane over sixteen floats
+struct Avx512FloatLane {
+  typedef __m512 Value;
+  static constexpr std::size_t width = 16;
+
+  static Value load(const float* source) { return _mm512_loadu_ps(source); }
+  static void store(float* destination, Value value) { _mm512_storeu_ps(destination, value); }
+  static Value broadcast(double value) { return _mm512_set1_ps(float(value)); }
+
+  static Value add(Value a, Value b) { return _mm512_add_ps(a, b); }
+  static Value subtract(Value a, Value b) { return _mm512_sub_ps(a, b); }
+  static Value multiply(Value a, Value b) { return _mm512_mul_ps(a, b); }
+  static Value minimum(Value a, Value b) { return _mm512_min_ps(a, b); }
+  static Value maximum(Value a, Value b) { return _mm512_max_ps(a, b); }
+
+  static Value round(Value a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+  static Value floor(Value a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+};
+#endif
+
+// Widest float lane this build can use
+#if defined(__AVX512F__)
+typedef Avx512FloatLane WidestFloatLane;
+#elif defined(__AVX2__)
+typedef Avx2FloatLane WidestFloatLane;
+#else
+typedef ScalarFloatLane WidestFloatLane;
+#endif
+
+// The widest lane and the single value lane over a number type
+template <class Number> struct LanesOf;
+
+template <> struct LanesOf<double> {
+  typedef WidestLane Widest;
+  typedef ScalarLane Single;
+};
+
+template <> struct LanesOf<float> {
+  typedef WidestFloatLane Widest;
+  typedef ScalarFloatLane Single;
+};
+
+// The math behind every expression, written over a lane type
+template <class Lane> struct ExpressionKernels {
+  typedef typename Lane::Value Value;
+
+  // Trigonometric expressions take their input in half turns, scaled by this factor
+  static constexpr double PI = 3.14159265;
+
+  // sin(PI * input)
+  static Value sin(Value input) {
+    Value r, parity;
+    reduce(input, r, parity);
+
+    Value r2 = Lane::multiply(r, r);
+    Value polynomial = Lane::broadcast(1.9572941063391263e-20);
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-8.22063524662433e-18));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(2.8114572543455206e-15));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-7.647163731819816e-13));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(1.6059043836821613e-10));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-2.505210838544172e-08));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(2.7557319223985893e-06));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-0.0001984126984126984));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(0.008333333333333333));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-0.16666666666666666));
+    Value result = Lane::add(r, Lane::multiply(Lane::multiply(r, r2), polynomial));
+
+    return Lane::multiply(result, parity);
+  }
+
+  // cos(PI * input)
+  static Value cosin(Value input) {
+    Value r, parity;
+    reduce(input, r, parity);
+
+    Value r2 = Lane::multiply(r, r);
+    Value polynomial = Lane::broadcast(-8.896791392450574e-22);
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(4.110317623312165e-19));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-1.5619206968586225e-16));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(4.779477332387385e-14));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-1.1470745597729725e-11));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(2.08767569878681e-09));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-2.755731922398589e-07));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(2.48015873015873e-05));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-0.001388888888888889));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(0.041666666666666664));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-0.5));
+    Value result = Lane::add(Lane::broadcast(1.0), Lane::multiply(r2, polynomial));
+
+    return Lane::multiply(result, parity);
+  }
+
+  // Largest error of fastSin and fastCosin evaluated over floats, for inputs within -1,1. The polynomials are off
+  // by less than 6e-8 over the reduced range, the reduction and the polynomials' rounding add less than 3e-7, and
+  // the rest is margin
+  static constexpr double fastTrigError = 5e-7;
+
+  // sin(PI * input) to about single precision, with half the terms of sin
+  static Value fastSin(Value input) {
+    Value r, parity;
+    fastReduce(input, r, parity);
+
+    Value r2 = Lane::multiply(r, r);
+    Value polynomial = Lane::broadcast(-2.505210838544172e-08);
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(2.7557319223985893e-06));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-0.0001984126984126984));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(0.008333333333333333));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-0.16666666666666666));
+    Value result = Lane::add(r, Lane::multiply(Lane::multiply(r, r2), polynomial));
+
+    return Lane::multiply(result, parity);
+  }
+
+  // cos(PI * input) to about single precision, with half the terms of cosin
+  static Value fastCosin(Value input) {
+    Value r, parity;
+    fastReduce(input, r, parity);
+
+    Value r2 = Lane::multiply(r, r);
+    Value polynomial = Lane::broadcast(2.08767569878681e-09);
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-2.755731922398589e-07));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(2.48015873015873e-05));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-0.001388888888888889));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(0.041666666666666664));
+    polynomial = Lane::add(Lane::multiply(polynomial, r2), Lane::broadcast(-0.5));
+    Value result = Lane::add(Lane::broadcast(1.0), Lane::multiply(r2, polynomial));
+
+    return Lane::multiply(result, parity);
+  }
+
+  static Value product(Value a, Value b) { return Lane::multiply(a, b); }
+
+  static Value mean(Value a, Value b) { return Lane::multiply(Lane::add(a, b), Lane::broadcast(0.5)); }
+
+  // Maps the -1,1 range to the 0,255 range, clamping anything outside of it
+  static Value quantize(Value number) {
+    Value scaled = Lane::multiply(Lane::add(number, Lane::broadcast(1.0)), Lane::broadcast(127.5));
+    return Lane::minimum(Lane::maximum(scaled, Lane::broadcast(0.0)), Lane::broadcast(255.0));
+  }
+
+private:
+  // Reduces PI * input to r in [-pi/2, pi/2] plus k half turns, and gives (-1)^k as the parity
+  static void reduce(Value input, Value& r, Value& parity) {
+    Value angle = Lane::multiply(input, Lane::broadcast(PI));
+    Value halfTurns = Lane::round(Lane::multiply(angle, Lane::broadcast(0.3183098861837907)));
+
+    // Subtracts the half turns in two steps so that the reduction keeps full precision
+    r = Lane::subtract(angle, Lane::multiply(halfTurns, Lane::broadcast(3.141592653589793)));
+    r = Lane::subtract(r, Lane::multiply(halfTurns, Lane::broadcast(1.2246467991473532e-16)));
+
+    // 1 when the half turns are even, -1 when odd
+    Value odd = Lane::subtract(halfTurns, Lane::multiply(Lane::floor(Lane::multiply(halfTurns, Lane::broadcast(0.5))), Lane::broadcast(2.0)));
+    parity = Lane::subtract(Lane::broadcast(1.0), Lane::multiply(odd, Lane::broadcast(2.0)));
+  }
+
+  // Reduces the input to a fraction of a half turn before scaling it, which keeps single precision reductions
+  // exact. PI is split in the float nearest to it and the rest, so that floats lose nothing of it either
+  static void fastReduce(Value input, Value& r, Value& parity) {
+    Value halfTurns = Lane::round(input);
+    Value fraction = Lane::subtract(input, halfTurns);
+    r = Lane::add(Lane::multiply(fraction, Lane::broadcast(3.1415927410125732)),
+      Lane::multiply(fraction, Lane::broadcast(PI - 3.1415927410125732)));
+
+    Value odd = Lane::subtract(halfTurns, Lane::multiply(Lane::floor(Lane::multiply(halfTurns, Lane::broadcast(0.5))), Lane::broadcast(2.0)));
+    parity = Lane::subtract(Lane::broadcast(1.0), Lane::multiply(odd, Lane::broadcast(2.0)));
+  }
+};
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef __EXPRESSION_PROGRAM__
+#define __EXPRESSION_PROGRAM__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "./ExpressionFactory.hpp"
+
+// What an instruction does to the value stack
+enum class OpCode : std::uint8_t {
+  // Pushes one of the variables
+  pushVariable,
+  // Pushes a constant value
+  pushConstant,
+  // Replaces the top value with the result of a single expression over it
+  applySingle,
+  // Replaces the two top values with the result of a double expression over them
+  applyDouble
+};
+
+struct Instruction {
+  // What this instruction does
+  OpCode code;
+  // The expression carried out by this instruction
+  Expression expression;
+  // The value pushed by constant instructions
+  double constant;
+
+  Instruction(OpCode code, Expression expression, double constant = 0.0)
+    : code(code), expression(expression), constant(constant) {
+  }
+};
+
+// How much evaluating one kind of instruction took
+struct OperatorProfile {
+  // Values computed
+  std::uint64_t values = 0;
+  // Seconds spent computing them
+  double seconds = 0.0;
+};
+
+// An expression tree flattened into reverse polish notation, evaluated on a fixed size value stack
+class ExpressionProgram {
+public:
+  // Largest value stack kept on the call stack while evaluating. Programs that need more use one on the heap
+  static constexpr std::size_t maxStackSize = 128;
+
+  // How many values of a span are evaluated together, small enough for the span stack to stay in cache
+  static constexpr std::size_t batchSize = 256;
+
+  // Removes all instructions
+  void clear() { code.clear(); stackHeight = 0; requiredStack = 0; }
+
+  /////////// INSTRUCTION EMITTERS
+
+  // Appends an instruction that pushes the variable of the provided leaf expression
+  void emitVariable(const Expression& expression) { emit(Instruction(OpCode::pushVariable, expression), 1); }
+
+  // Appends an instruction that pushes a constant
+  void emitConstant(double value) { emit(Instruction(OpCode::pushConstant, Expression(), value), 1); }
+
+  // Appends an instruction that applies a single expression to the top of the stack
+  void emitSingle(const Expression& expression) { emit(Instruction(OpCode::applySingle, expression), 0); }
+
+  // Appends an instruction that applies a double expression to the two top values of the stack
+  void emitDouble(const Expression& expression) { emit(Instruction(OpCode::applyDouble, expression), -1); }
+
+  /////////// EVALUATION
+
+  // Runs the program over the provided variables and returns the value left on the stack
+  double run(const double* variables) const;
+
+  // Runs the program over whole spans of values. variables holds one span of count values per variable.
+  // The workspace is scratch memory that callers should reuse across calls
+  void run(const double* const* variables, double* output, std::size_t count, std::vector<double>& workspace) const;
+
+  // Runs the program over whole spans of floats, with the expressions' float functions. Values are off from those
+  // run gives by at most singlePrecisionError
+  void run(const float* const* variables, float* output, std::size_t count, std::vector<float>& workspace) const;
+
+  // Largest difference between the values running over floats and over doubles give, for variables within -1,1.
+  // Every expression keeps such values within -1,1, so the bound follows from each one's steepness over that range
+  // and the error its float function adds
+  double singlePrecisionError() const;
+
+  // Runs the program over whole spans of values like run does, timing every instruction. The time and values of
+  // each instruction are added to the profile of its expression's character representation, of which profiles
+  // holds 256. Timing costs about as much as a cheap instruction, so it is best kept to a sample of the spans
+  void profile(const double* const* variables, double* output, std::size_t count, std::vector<double>& workspace,
+    OperatorProfile* profiles) const;
+
+  // Bounds every value the program can give for variables within the provided ranges, one per variable
+  Interval bound(const Interval* variables) const;
+
+  // Nanoseconds per value every instruction takes besides its expression's cost, from handing spans around
+  static constexpr double instructionCost = 0.1;
+
+  // Nanoseconds per value filling a constant's plane takes
+  static constexpr double constantCost = 0.1;
+
+  // Estimated nanoseconds an instruction takes per value
+  static double cost(const Instruction& instruction) {
+    return instructionCost + (instruction.code == OpCode::pushConstant ? constantCost
+      : instruction.code == OpCode::pushVariable ? 0.0 : instruction.expression.cost);
+  }
+
+  // Estimated nanoseconds running the program over spans takes per value, from the cost of its instructions, so
+  // it is only as close as their expressions' costs are to this machine's. Natively compiled programs take less,
+  // and hoisted, culled or cached ones may take much less
+  double cost() const;
+
+  /////////// INSPECTION
+
+  // Number of instructions in the program
+  std::size_t size() const { return code.size(); }
+
+  // Largest stack height the program reaches
+  std::size_t stackSize() const { return requiredStack; }
+
+  // The program's instructions, in execution order
+  const std::vector<Instruction>& instructions() const { return code; }
+
+private:
+  // Runs the program over whole spans of doubles or floats. Timed runs add the time and values of each instruction
+  // to profiles, while the others leave no trace of timing in the loop
+  template <class Number, bool timed = false> void runSpans(const Number* const* variables, Number* output,
+    std::size_t count, std::vector<Number>& workspace, OperatorProfile* profiles = nullptr) const;
+
+  // The evaluation stack: local, which holds maxStackSize values, if the program fits in it, or else heap, grown
+  // to the program's needs
+  template <class Value> Value* stackFor(Value* local, std::vector<Value>& heap) const {
+    if (requiredStack <= maxStackSize) return local;
+    heap.resize(requiredStack);
+    return heap.data();
+  }
+
+  // Appends an instruction and tracks the stack height it leaves behind
+  void emit(Instruction instruction, int stackEffect);
+
+  // The instructions, in reverse polish order
+  std::vector<Instruction> code;
+
+  // Stack height after the last emitted instruction
+  std::size_t stackHeight = 0;
+
+  // Largest stack height reached so far
+  std::size_t requiredStack = 0;
+};
+
+#endif
@@ -4,87 +4,93 @@
 #include <cstdint>
 #include <time.h>
 #include <algorithm>
-#include <random>
 #include <memory>
 #include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
 #include "./ExpressionFactory.hpp"
+#include "./GenerationContext.hpp"
+#include "./ExpressionProgram.hpp"
+#include "./NodeArena.hpp"
 // #include "./SpecReader.hpp"
 
 #include <iostream>
 
+// Nodes only know about themselves and their children. Walking a tree, whether to compile, measure or write it,
+// is done by the tree over an explicit stack, so that no depth can overflow the call stack
 struct ExpressionNode {
   // The expression to which this node corresponds
   Expression expression;
 
   ExpressionNode() = default;
 
-  // Returns the result of evaluating this expression over the provided variables
-  virtual double evaluate(std::vector<double>& variables) const = 0;
+  // Appends this node's own instruction to the program. Those of its children go before it
+  virtual void emit(ExpressionProgram& program) const = 0;
 
-  // Returns this node's expression written in reverse polish notation
-  virtual std::string toString() = 0;
+  // How many children this node has
+  virtual std::size_t childCount() const { return 0; }
 
-  // Returns the depth from this node down
-  virtual std::size_t currentDepth() = 0;
+  // The child at the index, first to last
+  virtual ExpressionNode* childAt(std::size_t) const { return nullptr; }
+
+  // Replaces the child at the index
+  virtual void setChild(std::size_t, ExpressionNode*) {}
 };
 
 struct NullNode : ExpressionNode {
-  virtual double evaluate(std::vector<double>&) const { return -1; }
-
-  virtual std::string toString() { return "0"; }
-
-  virtual std::size_t currentDepth() { return 0; }
+  // Evaluates to -1, written as 0
+  virtual void emit(ExpressionProgram& program) const { program.emitConstant(-1); }
 };
 
 struct LeafNode : ExpressionNode {
-  LeafNode(std::vector<char>& variableRepresentations, std::default_random_engine& engine);
+  LeafNode(std::vector<char>& variableRepresentations, SplitMix64& engine);
 
   // Used when reading a spec
   LeafNode(int index, char representation) { expression.variableIndex = index; expression.characterRepresentation = representation; }
 
-  virtual double evaluate(std::vector<double>& variables) const { return variables[expression.variableIndex]; }
-
-  virtual std::string toString() { return std::string({ expression.characterRepresentation }); }
-
-  virtual std::size_t currentDepth() { return 1; }
+  virtual void emit(ExpressionProgram& program) const { program.emitVariable(expression); }
 };
 
+// Nodes live in their tree's arena, so they point to their children without owning them
 struct SingleNode : ExpressionNode {
-  std::unique_ptr<ExpressionNode> child;
+  ExpressionNode* child;
 
-  SingleNode(std::vector<Expression>& availableExpressions, std::default_random_engine& engine,
-    std::unique_ptr<ExpressionNode> child);
+  SingleNode(std::vector<Expression>& availableExpressions, SplitMix64& engine,
+    ExpressionNode* child);
 
   // Used when reading a spec
-  SingleNode(Expression _expression, std::unique_ptr<ExpressionNode> child) : child(child.release()) { expression = _expression; }
+  SingleNode(Expression _expression, ExpressionNode* child) : child(child) { expression = _expression; }
+
+  virtual void emit(ExpressionProgram& program) const { program.emitSingle(expression); }
 
-  virtual double evaluate(std::vector<double>& variables) const { return expression.singleFunction(child->evaluate(variables)); }
+  virtual std::size_t childCount() const { return 1; }
 
-  virtual std::string toString() { return child->toString() + expression.characterRepresentation; }
+  virtual ExpressionNode* childAt(std::size_t) const { return child; }
 
-  virtual std::size_t currentDepth() { return 1 + child->currentDepth(); }
+  virtual void setChild(std::size_t, ExpressionNode* newChild) { child = newChild; }
 };
 
 struct DoubleNode : ExpressionNode {
-  std::unique_ptr<ExpressionNode> child1;
-  std::unique_ptr<ExpressionNode> child2;
+  ExpressionNode* child1;
+  ExpressionNode* child2;
 
-  DoubleNode(std::vector<Expression>& availableExpressions, std::default_random_engine& engine,
-    std::unique_ptr<ExpressionNode> child1, std::unique_ptr<ExpressionNode> child2);
+  DoubleNode(std::vector<Expression>& availableExpressions, SplitMix64& engine,
+    ExpressionNode* child1, ExpressionNode* child2);
 
   // Used when reading a spec
-  DoubleNode(Expression _expression, std::unique_ptr<ExpressionNode> child1, std::unique_ptr<ExpressionNode> child2)
-    : child1(child1.release()), child2(child2.release()) {
+  DoubleNode(Expression _expression, ExpressionNode* child1, ExpressionNode* child2)
+    : child1(child1), child2(child2) {
     expression = _expression;
   }
 
-  virtual double evaluate(std::vector<double>& variables) const {
-    return expression.doubleFunction(child1->evaluate(variables), child2->evaluate(variables));
-  }
+  virtual void emit(ExpressionProgram& program) const { program.emitDouble(expression); }
+
+  virtual std::size_t childCount() const { return 2; }
 
-  virtual std::string toString() { return child1->toString() + child2->toString() + expression.characterRepresentation; }
+  virtual ExpressionNode* childAt(std::size_t index) const { return index == 0 ? child1 : child2; }
 
-  virtual std::size_t currentDepth() { return 1 + std::max(child1->currentDepth(), child2->currentDepth()); }
+  virtual void setChild(std::size_t index, ExpressionNode* child) { (index == 0 ? child1 : child2) = child; }
 };
 
 class ExpressionTree {
@@ -94,8 +100,10 @@ public:
   friend class SpecReader;
 
   ExpressionTree() = default;
-  ExpressionTree(std::size_t depth) : depth(depth) {}
+  ExpressionTree(std::size_t depth, std::shared_ptr<GenerationContext> context = GenerationContext::standard())
+    : depth(depth), context(std::move(context)) {}
 
+  // Sets up the standard context, used by trees not given one of their own
   static void init(std::vector<char> variables, unsigned int seed = time(NULL));
 
   // Get the tree's depth
@@ -104,44 +112,143 @@ public:
   // Overwrite the tree's depth. It returns the new depth.
   std::size_t setDepth(std::size_t newDepth) { return depth = newDepth; }
 
-  // Set the seed for all trees.
-  static void setSeed(unsigned int seed) { randomEngine.seed(seed); }
+  // Sets the most nodes a built tree may have. Once growing a node's children could go over it, nodes are made
+  // with fewer children instead, so that deep trees cannot grow exponentially. Trees within it are built the same
+  void setNodeBudget(std::size_t budget) {
+    if (budget == 0) throw std::domain_error("Node budget must be greater than 0");
+    nodeBudget = budget;
+  }
+  // Node budget getter
+  std::size_t getNodeBudget() const { return nodeBudget; }
+
+  // Sets the most nanoseconds per pixel a built tree may be estimated to take, by the costs of its expressions.
+  // Nodes are grown as the node budget has them, counting the dearest expression of their kind until it is drawn,
+  // so that a built tree never costs more, unless a single leaf does. Trees within it are built the same.
+  // Throws std::domain_error if it is not greater than 0
+  void setCostBudget(double budget) {
+    if (!(budget > 0)) throw std::domain_error("Cost budget must be greater than 0");
+    costBudget = budget;
+  }
+  // Cost budget getter
+  double getCostBudget() const { return costBudget; }
+
+  // Estimated nanoseconds evaluating the tree takes per pixel
+  double cost() const { return program.cost(); }
+
+  // How many nodes the tree is made of
+  std::size_t size() const { return nodeCount; }
 
-  // Set the variable representations to be used by all trees
-  static void setVariables(std::vector<char>& newVariables) { variables = newVariables; }
+  // How deep the tree actually is, which may be less than the depth it was built with
+  std::size_t currentDepth() const { return treeDepth; }
+
+  // Set the seed for all trees sharing this tree's context
+  void setSeed(std::uint64_t seed) { context->randomEngine.seed(seed); }
+
+  // Set the variable representations to be used by all trees sharing this tree's context
+  void setVariables(std::vector<char>& newVariables) { context->variables = newVariables; }
+
+  // Shares another context's variables, expressions and random engine
+  void setContext(std::shared_ptr<GenerationContext> newContext) { context = std::move(newContext); }
+
+  // The context the tree is generated and read with
+  const std::shared_ptr<GenerationContext>& getContext() const { return context; }
 
   // Builds a randomly generated tree
   void build();
 
+  // Reads a spec held in memory. If it is malformed, returns false, leaves an empty tree behind and
+  // tells the position of the offending character and what is wrong with it
+  bool read(const char* spec, std::size_t length, std::size_t& errorPosition, const char*& error);
+
+  // Appends the tree to code as one byte per node, in program order: the node's opcode in the top two bits and, in
+  // the others, the index of its variable or expression within the context. Throws std::length_error if the
+  // context has more than 64 of a kind
+  void encode(std::string& code) const;
+
+  // Loads a tree encode wrote with the same context, looking each node up in the context's tables instead of
+  // parsing it. The tree's nodes are only made once it is edited. Returns false, leaving an empty tree behind, if
+  // the bytes do not make a tree of the context
+  bool decode(const unsigned char* code, std::size_t count);
+
+  /////////// EDITING
+
+  // Nodes are numbered as they come in the program, children before their parent, so the head is node size() - 1.
+  // Every edit renumbers them. Nodes an edit leaves behind stay in the arena until they outnumber the tree's, when
+  // the tree's nodes are made anew from its program. Decoded trees make their nodes on their first edit
+
+  // Replaces the subtree of a node with a copy of the subtree of donorNode in donor, which may be this tree.
+  // Returns the number of the copy's root. Throws std::domain_error if either node does not exist
+  std::size_t replace(std::size_t node, const ExpressionTree& donor, std::size_t donorNode);
+
+  // Grows the subtree of a node anew, as building the tree would at the node's level, within the budgets.
+  // Returns the number of the new subtree's root. Throws std::domain_error if the node does not exist
+  std::size_t mutate(std::size_t node);
+
+  // Grows the subtree of a random node anew. Returns the number of the new subtree's root.
+  // Throws std::domain_error if the tree is empty
+  std::size_t mutate();
+
+  // Replaces the subtree of a random node with a copy of a random subtree of donor. Returns the number of the
+  // copy's root. Throws std::domain_error if either tree is empty
+  std::size_t crossover(const ExpressionTree& donor);
+
+  // How many nodes the arena holds, those of the tree and those edits left behind
+  std::size_t heldNodes() const { return arena.size(); }
+
+  // How many nodes the subtree of a node has, itself included
+  std::size_t subtreeSize(std::size_t node) const { return subtreeSizes[node]; }
+
+  // How many nodes lie between a node and the head. The head is on level 0
+  std::size_t level(std::size_t node) const { return levels[node]; }
+
   // Performs the tree's expressions on the provided variables
   double plugVariables(std::vector<double> variables) const;
 
+  // Performs the tree's expressions on the provided variables, without copying them
+  double plugVariables(const double* variables) const { return program.run(variables); }
+
+  // Performs the tree's expressions over whole spans of variable values, one span per variable
+  void plugVariables(const double* const* variables, double* output, std::size_t count,
+    std::vector<double>& workspace) const {
+    program.run(variables, output, count, workspace);
+  }
+
+  // Bounds every value the tree can give for variables within the provided ranges, one per variable
+  Interval bound(const Interval* variables) const { return program.bound(variables); }
+
+  // The tree compiled to reverse polish notation
+  const ExpressionProgram& getProgram() const { return program; }
+
+  ////////////////// TYPES
+
+  // The kinds of node a tree is grown from
+  enum class NodeKind { leaf, singleBranch, doubleBranch };
+
 private:
-  // Recursively builds a node and its children
-  std::unique_ptr<ExpressionNode> grow(std::size_t remainingDepth);
+  // Builds a node and all of its descendants, depth first over an explicit stack. Random choices are drawn in
+  // the order a recursive build would draw them: a node's kind, then its children, then its expression. Nodes the
+  // tree keeps besides the new ones count against the node and cost budgets
+  ExpressionNode* grow(std::size_t remainingDepth, std::size_t keptNodes = 0, double keptCost = 0.0);
+
+  // Puts a subtree in place of the subtree of a node and compiles the tree. Returns the number of its root
+  std::size_t graft(std::size_t node, ExpressionNode* subtree);
 
   // Adjusts depth attribute to current tree depth
-  void adjustDepth() { setDepth(head->currentDepth()); }
+  void adjustDepth() { setDepth(treeDepth); }
 
-  /////////// NODE MAKERS
+  // Lowers the node graph into the program that is actually evaluated, walking it in post order over an
+  // explicit stack, and measures the tree's size and depth along the way
+  void compile();
 
-  // Makes a leaf node expression
-  std::unique_ptr<ExpressionNode> makeLeafExpression(std::size_t) {
-    // std::cout << "-> makeLeafExpression" << std::endl;
-    return std::make_unique<LeafNode>(variables, randomEngine);
-  }
+  // Works out the size, depth and the numbered nodes' parents, subtree sizes and levels from the program
+  void measure();
 
-  // Makes a single branch node expression
-  std::unique_ptr<ExpressionNode> makeSingleExpression(std::size_t remainingDepth) {
-    // std::cout << "-> makeSingleExpression" << std::endl;
-    return std::make_unique<SingleNode>(singleExpressions, randomEngine, grow(remainingDepth - 1));
-  }
+  // Makes nodes for the instructions of a program from first to last, which must be a whole subtree, and returns
+  // the root
+  ExpressionNode* makeNodes(const ExpressionProgram& source, std::size_t first, std::size_t last);
 
-  // Makes a double branch node expression
-  std::unique_ptr<ExpressionNode> makeDoubleExpression(std::size_t remainingDepth) {
-    // std::cout << "-> makeDoubleExpression" << std::endl;
-    return std::make_unique<DoubleNode>(doubleExpressions, randomEngine, grow(remainingDepth - 1), grow(remainingDepth - 1));
-  }
+  // Makes the nodes of a decoded tree out of its program, if it has none yet
+  void materialize();
 
   /////////// PROBABILITY CALCULATORS
 
@@ -153,23 +260,37 @@ private:
 
   ////////// ATTRIBUTES
 
-  // The root node
-  std::unique_ptr<ExpressionNode> head;
+  // The root node, or none if the tree was decoded and has not been edited since
+  ExpressionNode* head = nullptr;
+
+  // Holds all of the tree's nodes, which are released together whenever the tree is rebuilt
+  NodeArena arena;
+
+  // The nodes flattened into a program, rebuilt whenever head changes, or decoded without any
+  ExpressionProgram program;
 
   // The tree's depth
   std::size_t depth;
 
-  // All the trees' variable representations
-  inline static std::vector<char> variables;
+  // Most nodes a built tree may have
+  std::size_t nodeBudget = std::size_t(1) << 16;
+
+  // Most nanoseconds per pixel a built tree may cost
+  double costBudget = std::numeric_limits<double>::infinity();
 
-  // All the trees' random engine
-  inline static std::default_random_engine randomEngine;
+  // The size and depth of the current nodes, worked out whenever they are compiled
+  std::size_t nodeCount = 0;
+  std::size_t treeDepth = 0;
 
-  // List of possible single expressions
-  inline static std::vector<Expression> singleExpressions;
+  // Each node, by its number, along with its parent's number, the size of its subtree and its level.
+  // The head's parent is its own number
+  std::vector<ExpressionNode*> nodes;
+  std::vector<std::size_t> parents;
+  std::vector<std::size_t> subtreeSizes;
+  std::vector<std::size_t> levels;
 
-  // List of possible double expressions
-  inline static std::vector<Expression> doubleExpressions;
+  // Variables, expressions and random engine, possibly shared with other trees
+  std::shared_ptr<GenerationContext> context = GenerationContext::standard();
 
   //////////////////////////////// PROBABILITY CONFIGURATION
 
@@ -181,10 +302,6 @@ private:
 
   // Chance upon construction of each node to be a double branch node
   double doubleBranchLikelihood(std::size_t remainingDepth) { return 1.0 - progress(remainingDepth); }
-
-  ////////////////// TYPES
-public:
-  typedef decltype(&ExpressionTree::makeLeafExpression) nodeMaker;
 };
 
 // Write currently built spec to a stream. Writing before building is undefined.
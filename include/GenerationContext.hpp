@@ -0,0 +1,80 @@
+#ifndef __GENERATION_CONTEXT__
+#define __GENERATION_CONTEXT__
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "./ExpressionFactory.hpp"
+
+// A small and fast random engine whose state is a single counter. Any number of independent engines can be
+// split off of one seed, which lets each artwork of a batch be generated on its own
+class SplitMix64 {
+public:
+  typedef std::uint64_t result_type;
+
+  SplitMix64(std::uint64_t seed = 0) : state(seed) {}
+
+  // An engine for the given stream of a seed. Different streams of the same seed do not overlap in practice
+  static SplitMix64 stream(std::uint64_t seed, std::uint64_t stream) { return SplitMix64(mix(mix(seed) + stream)); }
+
+  // Restarts the engine from a seed
+  void seed(std::uint64_t seed) { state = seed; }
+
+  // Next random 64 bits
+  result_type operator()() { return mix(state += increment); }
+
+  // A random double in [0, 1)
+  double uniform() { return ((*this)() >> 11) * 0x1.0p-53; }
+
+  // A random index in [0, count)
+  std::size_t index(std::size_t count) { return std::size_t(uniform() * count); }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT64_MAX; }
+
+private:
+  // The golden ratio scaled to 64 bits, by which the state advances
+  static constexpr std::uint64_t increment = 0x9E3779B97F4A7C15;
+
+  // Scrambles the bits of a value, mapping distinct values to distinct results
+  static std::uint64_t mix(std::uint64_t value) {
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EB;
+    return value ^ (value >> 31);
+  }
+
+  std::uint64_t state;
+};
+
+// Everything trees need to be generated and read: the variables and expressions they are made of and the
+// random engine that picks among them. Trees that share a context draw from the same engine, while trees on
+// different contexts can be built on different threads
+struct GenerationContext {
+  // The variable representations, in the order their values are given
+  std::vector<char> variables;
+
+  // List of possible single expressions
+  std::vector<Expression> singleExpressions;
+
+  // List of possible double expressions
+  std::vector<Expression> doubleExpressions;
+
+  // Picks node kinds and expressions while building trees
+  SplitMix64 randomEngine;
+
+  GenerationContext(std::vector<char> variables, std::uint64_t seed) : variables(variables), randomEngine(seed) {
+    ExpressionFactory::populateExpressions(singleExpressions, doubleExpressions);
+  }
+
+  // Replaces the costs the expressions came with by measures taken on this machine, for trees built afterwards
+  void measureCosts() { ExpressionFactory::measureCosts(singleExpressions, doubleExpressions); }
+
+  // The context of trees not given one, made of the variables x and y
+  static const std::shared_ptr<GenerationContext>& standard() {
+    static const std::shared_ptr<GenerationContext> context =
+      std::make_shared<GenerationContext>(std::vector<char>{ 'x', 'y' }, 0);
+    return context;
+  }
+};
+
+#endif
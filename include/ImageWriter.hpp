@@ -0,0 +1,211 @@
+#ifndef __IMAGE_WRITER__
+#define __IMAGE_WRITER__
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "./ThreadPool.hpp"
+
+// Formats images are written in
+enum class ImageFormat : std::uint8_t { ppm, png, y4m };
+
+// Writes an RGB image as a binary PPM, handing the header and the pixels to the system in a single call.
+// Throws std::runtime_error if the file cannot be written
+void writePPM(const std::string& path, const std::uint8_t* pixels, std::size_t width, std::size_t height);
+
+// A binary PPM file written a few rows at a time, so the image never has to be held whole
+class StreamedPPM {
+public:
+  // Creates the file and writes the header for an image of the given size. Throws std::runtime_error if it cannot
+  StreamedPPM(const std::string& path, std::size_t width, std::size_t height);
+
+  // Writes the next rows of the image, 3 bytes per pixel. Throws std::runtime_error if they cannot be written,
+  // or std::length_error if there are more rows than the image has
+  void append(const std::uint8_t* pixels, std::size_t rows);
+
+private:
+  std::ofstream file;
+
+  std::size_t columns;
+  // Rows not yet written
+  std::size_t remaining;
+};
+
+// A binary PPM file mapped into memory, whose pixels can be used as a martist's buffer, so that rendering
+// writes the image straight into the file's pages with no copy or encoding step
+class MappedPPM {
+public:
+  // Creates the file, sized and headed for an image of the given size, and maps it.
+  // Throws std::runtime_error if it cannot
+  MappedPPM(const std::string& path, std::size_t width, std::size_t height);
+
+  ~MappedPPM();
+
+  MappedPPM(const MappedPPM&) = delete;
+  MappedPPM& operator=(const MappedPPM&) = delete;
+
+  // The image's pixels, 3 bytes each, row after row
+  std::uint8_t* pixels() { return data + headerSize; }
+
+  // The image's width, in pixels
+  std::size_t width() const { return columns; }
+  // The image's height, in pixels
+  std::size_t height() const { return rows; }
+
+  // Blocks until the pixels written so far reach the file. Unmapping writes them out eventually anyway
+  void flush();
+
+private:
+  // The mapped file
+  std::uint8_t* data = nullptr;
+  std::size_t size = 0;
+
+  // Bytes taken by the header, which the pixels follow
+  std::size_t headerSize = 0;
+
+  std::size_t columns;
+  std::size_t rows;
+};
+
+// A raw YUV4MPEG2 video, written a frame at a time in full resolution 4:4:4 color, which video tools take as is
+class StreamedY4M {
+public:
+  // Writes the header for frames of the given size to the stream, which must outlive the video
+  StreamedY4M(std::ostream& out, std::size_t width, std::size_t height, std::size_t framesPerSecond = 30);
+
+  // Creates the file and writes the header. Throws std::runtime_error if it cannot
+  StreamedY4M(const std::string& path, std::size_t width, std::size_t height, std::size_t framesPerSecond = 30);
+
+  // Converts an RGB frame, 3 bytes per pixel, and writes it. Throws std::runtime_error if it cannot be written
+  void append(const std::uint8_t* pixels);
+
+  // How many frames were written so far
+  std::size_t frames() const { return frameCount; }
+
+private:
+  // Writes the stream's header
+  void begin(std::size_t framesPerSecond);
+
+  // Where the video goes, and the file it was opened on, if any
+  std::ostream* out;
+  std::ofstream file;
+
+  // The frames' size, in pixels
+  std::size_t columns;
+  std::size_t rows;
+
+  // The last frame's luma plane followed by its two chroma planes
+  std::vector<std::uint8_t> planes;
+
+  std::size_t frameCount = 0;
+};
+
+// Encodes RGB images as PNG, a few rows at a time if need be. The image is split into blocks of rows, each
+// filtered and deflated on its own, so that blocks can be encoded in parallel. Every block is primed with the end
+// of the one before it, which keeps the compression close to deflating the image as a whole, and the file is the
+// same whatever the thread count or the way rows are handed over. Only a block per thread is ever held
+class PngEncoder {
+public:
+  // The level goes from 0, only storing, to 9, smallest. 1 is the fastest that compresses. Blocks are encoded
+  // over threadCount threads
+  PngEncoder(int level = 1, std::size_t threadCount = 1);
+
+  // Sets how many threads encode blocks
+  void threadCount(std::size_t count);
+  // Thread count getter
+  std::size_t threadCount() const { return pool ? pool->size() : 1; }
+
+  // Starts an image of the given size on the stream. Its rows are then given in order with append
+  void begin(std::ostream& out, std::size_t width, std::size_t height);
+
+  // Starts an image of the given size on a file. Throws std::runtime_error if it cannot be opened
+  void begin(const std::string& path, std::size_t width, std::size_t height);
+
+  // Encodes the next rows of the image, 3 bytes per pixel. The image is finished along with its last row.
+  // Throws std::runtime_error if they cannot be compressed or written, or std::length_error if there are
+  // more rows than the image has
+  void append(const std::uint8_t* pixels, std::size_t rows);
+
+  // Writes a whole image to a stream
+  void write(std::ostream& out, const std::uint8_t* pixels, std::size_t width, std::size_t height) {
+    begin(out, width, height);
+    append(pixels, height);
+  }
+
+  // Writes a whole image to a file
+  void write(const std::string& path, const std::uint8_t* pixels, std::size_t width, std::size_t height) {
+    begin(path, width, height);
+    append(pixels, height);
+  }
+
+private:
+  // A block of rows going through the encoder
+  struct Block {
+    // The block's rows, each one prefixed by its filter type
+    std::vector<std::uint8_t> filtered;
+    // The rows deflated, ending on a byte boundary so blocks can be joined
+    std::vector<std::uint8_t> compressed;
+    // Checksum of the filtered rows
+    unsigned long checksum;
+  };
+
+  // Encodes the next rows, a block per thread at most, writing them out
+  void encode(const std::uint8_t* pixels, std::size_t rows);
+
+  // Filters rows of pixels into filtered, each one prefixed by its filter type. above is the row before the
+  // first one, or null if the first one starts the image
+  static void filterRows(const std::uint8_t* pixels, const std::uint8_t* above, std::size_t width, std::size_t rows,
+    std::uint8_t* filtered);
+
+  // Deflates a block's filtered rows, primed with the bytes that come right before them
+  void compressBlock(Block& block, const std::uint8_t* dictionary, std::size_t dictionarySize, bool last) const;
+
+  // Runs the tasks on the pool, if there is one
+  void run(std::vector<ThreadPool::Task>& tasks);
+
+  // How many rows make up a block
+  static constexpr std::size_t blockRows = 128;
+
+  // Most bytes deflate can look back at
+  static constexpr std::size_t windowSize = 1 << 15;
+
+  // Deflate level
+  int level;
+
+  // The threads that encode blocks, when there is more than one
+  std::unique_ptr<ThreadPool> pool;
+
+  // Where the image goes, and the file it was opened on, if any
+  std::ostream* out = nullptr;
+  std::ofstream file;
+
+  // The image's size, in pixels
+  std::size_t columns = 0;
+  std::size_t rows = 0;
+
+  // Rows given so far, and how many of them were encoded
+  std::size_t rowsGiven = 0;
+  std::size_t rowsEncoded = 0;
+
+  // Rows given that do not fill the blocks of all threads yet
+  std::vector<std::uint8_t> pending;
+  std::size_t pendingRows = 0;
+
+  // The last row encoded, which the next one is filtered against
+  std::vector<std::uint8_t> lastRow;
+
+  // The blocks encoded at the same time, one per thread
+  std::vector<Block> blocks;
+
+  // End of the last block written, which primes the next one
+  std::vector<std::uint8_t> dictionary;
+
+  // Checksum of all the filtered rows so far
+  unsigned long checksum = 0;
+};
+
+#endif
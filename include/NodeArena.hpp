@@ -0,0 +1,73 @@
+#ifndef __NODE_ARENA__
+#define __NODE_ARENA__
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator for expression nodes. Nodes are laid out one after the other in large blocks and are all
+// released at once, without running destructors, so only trivially destructible types may be stored
+class NodeArena {
+public:
+  NodeArena() = default;
+
+  NodeArena(NodeArena&&) = default;
+  NodeArena& operator=(NodeArena&&) = default;
+
+  // Creates a node in the arena
+  template <class Node, class... Arguments> Node* make(Arguments&&... arguments) {
+    static_assert(std::is_trivially_destructible<Node>::value, "Arena nodes are never destroyed");
+    made++;
+    return new (allocate(sizeof(Node), alignof(Node))) Node(std::forward<Arguments>(arguments)...);
+  }
+
+  // Releases every node at once. The memory is kept to hold the next nodes
+  void clear() { currentBlock = 0; offset = 0; made = 0; }
+
+  // Nodes made since the arena was last cleared
+  std::size_t size() const { return made; }
+
+  // Bytes held by the arena
+  std::size_t capacity() const;
+
+private:
+  // Returns memory for an object, moving on to the next block if the current one is full
+  void* allocate(std::size_t size, std::size_t alignment) {
+    std::size_t start = (offset + alignment - 1) & ~(alignment - 1);
+
+    if (currentBlock < blocks.size() && start + size <= blocks[currentBlock].size) {
+      offset = start + size;
+      return blocks[currentBlock].memory.get() + start;
+    }
+
+    return allocateInNextBlock(size);
+  }
+
+  // Moves on to the next block, creating it if needed, and returns memory from its start
+  void* allocateInNextBlock(std::size_t size);
+
+  struct Block {
+    std::unique_ptr<char[]> memory;
+    std::size_t size;
+  };
+
+  // Size of the first block. Each new block doubles the last one
+  static constexpr std::size_t firstBlockSize = 16 * 1024;
+
+  // The memory blocks, in the order they are filled
+  std::vector<Block> blocks;
+
+  // Block being filled
+  std::size_t currentBlock = 0;
+
+  // Position of the first free byte in the current block
+  std::size_t offset = 0;
+
+  // Nodes made since the last clear
+  std::size_t made = 0;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef __PLANE_CACHE__
+#define __PLANE_CACHE__
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+#include "./ExpressionGraph.hpp"
+#include "./ThreadPool.hpp"
+
+// Keeps the values every node of some programs took over a whole image, one plane per node, so that running
+// programs that changed since evaluates only what changed. Nodes are keyed by what they compute and by the keys of
+// their operands, as graph nodes are, so a node is found again wherever it moves within or between programs, and a
+// subtree that is the same is never evaluated again. After replacing a subtree, only the new nodes and the nodes on
+// the path from them to the head are evaluated. Planes are kept up to a byte budget, past which nodes are evaluated
+// into scratch planes that are not kept. Values are the same as running the programs span by span
+class PlaneCache {
+public:
+  // Keeps up to byteBudget bytes of planes
+  PlaneCache(std::size_t byteBudget) : budget(byteBudget) {}
+
+  // Runs each program over count values of the variables, writing its values to the output of the same index. Nodes
+  // of planes kept from the last run are not evaluated again, and planes of nodes none of the programs has are
+  // dropped. Different counts are different images, so a count unlike the last one drops every plane. Planes are
+  // split over the pool, if any. Returns how many nodes were evaluated
+  std::size_t run(const std::vector<const ExpressionProgram*>& programs, const double* const* variables,
+    double* const* outputs, std::size_t count, ThreadPool* pool = nullptr);
+
+  // Drops every plane
+  void clear();
+
+  // Number of planes kept
+  std::size_t planeCount() const { return planes; }
+
+  // Bytes the planes kept take
+  std::size_t bytes() const { return planes * values * sizeof(double); }
+
+  // Byte budget getter
+  std::size_t byteBudget() const { return budget; }
+
+private:
+  // A node met in some program
+  struct Entry {
+    // Stands for the node in the keys of the nodes it is an operand of
+    std::size_t id;
+    // The node's values, or none if it is over the budget
+    std::vector<double> values;
+    // Whether a program of the current run has the node
+    bool used;
+  };
+
+  // Ids of the variables, which are the variable indices, are below this one
+  static constexpr std::size_t firstNodeId = 8;
+
+  // Values of each plane split over the pool
+  static constexpr std::size_t chunkSize = 1 << 14;
+
+  // Fills the entries of a program's instructions, creating those of nodes not met yet. Variables have none
+  void identify(const ExpressionProgram& program, std::vector<Entry*>& entries);
+
+  // Runs an instruction over whole planes, in chunks over the pool if there is one
+  void apply(const Instruction& instruction, const double* first, const double* second, double* output,
+    ThreadPool* pool) const;
+
+  std::size_t budget;
+
+  std::unordered_map<NodeKey, Entry, NodeKeyHash> nodes;
+
+  // Id the next new node gets
+  std::size_t nextId = firstNodeId;
+
+  // Values per plane, which is the count of the last run
+  std::size_t values = 0;
+
+  // Planes kept
+  std::size_t planes = 0;
+
+  // Planes of nodes that are not kept, one per stack position
+  std::vector<double> scratch;
+};
+
+#endif
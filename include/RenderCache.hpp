@@ -0,0 +1,112 @@
+#ifndef __RENDER_CACHE__
+#define __RENDER_CACHE__
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// How a render cache has done so far
+struct RenderCacheStats {
+  // Lookups found in memory
+  std::size_t hits = 0;
+  // Lookups found on disk, after missing memory
+  std::size_t diskHits = 0;
+  // Lookups found nowhere
+  std::size_t misses = 0;
+  // Images dropped from memory to stay within the budget
+  std::size_t evictions = 0;
+  // Images held in memory, and the bytes they take
+  std::size_t entries = 0;
+  std::size_t bytes = 0;
+};
+
+// Keeps rendered images by their spec, the three channel lines a martist writes out, and their size. Specs that
+// only differ in the order of the operands of commutative expressions paint the same image, so they are keyed by a
+// canonical form in which those operands are sorted. The most recently used images are held in memory, up to a
+// byte budget, and every image can also be kept on disk, where it outlives the cache. Safe to use from any thread
+class RenderCache {
+public:
+  // Holds up to byteBudget bytes of images in memory. If directory is not empty, images are also stored there
+  RenderCache(std::size_t byteBudget, std::string directory = "");
+
+  // Copies the image of the spec at the given size into pixels, 3 bytes per pixel, if it is cached. Images found
+  // only on disk are brought back into memory. Returns whether it was found. Images of the same spec and size that
+  // were painted differently, such as at another time or precision, are told apart by their variant, and those of
+  // martists whose variables come in another order by their variables. Throws std::invalid_argument if the spec is
+  // malformed or is made of other variables
+  bool find(const std::string& spec, std::size_t width, std::size_t height, std::uint8_t* pixels,
+    const std::string& variant = "", const std::vector<char>& variables = { 'x', 'y' });
+
+  // Stores the image of the spec at the given size, variant and variables, replacing any held for it.
+  // Throws std::invalid_argument if the spec is malformed or is made of other variables
+  void insert(const std::string& spec, std::size_t width, std::size_t height, const std::uint8_t* pixels,
+    const std::string& variant = "", const std::vector<char>& variables = { 'x', 'y' });
+
+  // Drops every image held in memory. Images on disk are kept
+  void clear();
+
+  // Sets how many bytes of images may be held in memory, dropping the least recently used ones that no longer fit
+  void byteBudget(std::size_t budget);
+  // Byte budget getter
+  std::size_t byteBudget() const { return budget; }
+
+  // How the cache has done so far
+  RenderCacheStats stats() const;
+
+  // The spec with the operands of every commutative expression in order, one line per channel. Any two specs
+  // that differ only in that order have the same canonical form. Throws std::invalid_argument if it is malformed
+  // or holds a character that is neither an expression nor one of the variables
+  static std::string canonicalSpec(const std::string& spec, const std::vector<char>& variables = { 'x', 'y' });
+
+private:
+  // A cached image
+  struct Entry {
+    // The canonical spec, size and variant, which tells apart keys whose hashes collide
+    std::string key;
+    std::vector<std::uint8_t> pixels;
+  };
+
+  // The canonical spec followed by the size, the variables and the variant
+  static std::string makeKey(const std::string& spec, std::size_t width, std::size_t height,
+    const std::string& variant, const std::vector<char>& variables);
+
+  // Puts an entry at the front of memory, evicting whatever no longer fits. Expects the lock to be held
+  void store(std::uint64_t hash, Entry entry);
+
+  // Drops least recently used entries until what is held fits the budget. Expects the lock to be held
+  void evict();
+
+  // The file the image with the given key hash is stored in
+  std::string path(std::uint64_t hash) const;
+
+  // Reads an image from disk into entry, if one is stored for its key at the given size
+  bool load(std::uint64_t hash, Entry& entry, std::size_t width, std::size_t height) const;
+
+  // Writes an image to disk, under a temporary name first so that other processes never read it half written
+  void save(std::uint64_t hash, const Entry& entry, std::size_t width, std::size_t height) const;
+
+  // Bytes an entry takes
+  static std::size_t entrySize(const Entry& entry) { return entry.key.size() + entry.pixels.size(); }
+
+  // Most bytes held in memory
+  std::size_t budget;
+
+  // Where images are stored on disk, if anywhere
+  std::string directory;
+
+  // Entries from most to least recently used
+  std::list<Entry> entries;
+
+  // Entries by the hash of their key
+  std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index;
+
+  RenderCacheStats counters;
+
+  mutable std::mutex lock;
+};
+
+#endif
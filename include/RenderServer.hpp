@@ -0,0 +1,185 @@
+#ifndef __RENDER_SERVER__
+#define __RENDER_SERVER__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include "./ImageWriter.hpp"
+#include "./ThreadPool.hpp"
+
+// The conversation between render clients and servers. Each request is a line, and each response starts with one:
+//
+//   render width=W height=H format=ppm|png|y4m depth=D seed=S index=I\n
+//   render width=W height=H format=ppm|png|y4m spec=N\n followed by the N bytes of a spec's three lines
+//   metrics\n
+//
+// Fields left out keep their defaults. A request is answered either by "ERROR <what went wrong>\n" or by
+// "OK <N>\n" followed by the N bytes of the spec painted, if any, and then by the image or the metrics in chunks,
+// each one its length in hexadecimal and a newline followed by that many bytes, ending with an empty chunk. The
+// image is sent as it is encoded, so its size need not be known beforehand. A connection can carry any number of
+// requests, each answered before the next one is read
+
+// What to paint: a spec, or an artwork of a seed grown to the given depth, at the given size and format
+struct RenderRequest {
+  std::size_t width = 256;
+  std::size_t height = 256;
+  ImageFormat format = ImageFormat::png;
+
+  // The three channel lines to paint. When empty, artwork index of seed is generated instead
+  std::string spec;
+  std::uint64_t seed = 0;
+  std::uint64_t index = 0;
+  std::size_t depth = 10;
+
+  // The request line for it, which announces the spec's length but does not hold it
+  std::string toLine() const;
+
+  // Reads a request line, telling how many bytes of spec follow it. Throws std::invalid_argument if it is malformed
+  // or announces a spec longer than RenderServer::longestSpec
+  static RenderRequest fromLine(const std::string& line, std::size_t& specLength);
+};
+
+// Paints requests from clients that connect to a Unix domain socket, so that many images are painted by a single
+// process. Requests from all connections are queued together and taken in batches, whose images are painted in
+// parallel over a pool of threads that each keep their martist and buffers from one request to the next
+class RenderServer {
+public:
+  // Widest and tallest image painted
+  static constexpr std::size_t largestSide = 8192;
+
+  // Deepest trees generated
+  static constexpr std::size_t deepestTree = 32;
+
+  // Longest spec a request may carry, in bytes
+  static constexpr std::size_t longestSpec = std::size_t(4) << 20;
+
+  // Seconds sending to a client may block before its connection is given up, so that a client that does not read
+  // its responses cannot stall the batch it is in
+  static constexpr int sendTimeout = 30;
+
+  // Starts listening at socketPath, replacing any socket left there. Images are painted over threadCount threads,
+  // up to batchSize at a time. Throws std::runtime_error if it cannot listen there, or if something other than a
+  // socket is there
+  RenderServer(const std::string& socketPath, std::size_t threadCount = 1, std::size_t batchSize = 8);
+
+  // Removes the socket. Serving must be over
+  ~RenderServer();
+
+  RenderServer(const RenderServer&) = delete;
+  RenderServer& operator=(const RenderServer&) = delete;
+
+  // Accepts connections and paints their requests until stopped. Serves only once
+  void serve();
+
+  // Makes serve return once the requests being painted are answered, or their clients timed out. Safe from any
+  // thread
+  void stop();
+
+  // How many requests wait to be painted
+  std::size_t queueDepth() const;
+
+  // Everything measured so far, in the Prometheus text exposition format, with every metric prefixed by martist_
+  std::string metrics() const;
+
+private:
+  // A request waiting for a worker
+  struct Job {
+    RenderRequest request;
+    // Where the response goes, which the connection leaves alone until the job is done
+    std::ostream* out;
+    std::chrono::steady_clock::time_point queued;
+    std::promise<void> done;
+  };
+
+  // Reads a connection's requests and answers them, one after the other
+  void converse(int connection);
+
+  // Takes queued jobs a batch at a time and paints them over the pool
+  void dispatch();
+
+  // Paints a job's request and writes the response
+  void paint(Job& job);
+
+  // Keeps how long a request took, from being read to being answered
+  void recordLatency(double seconds, bool failed);
+
+  std::string socketPath;
+  int listener = -1;
+
+  std::size_t batchSize;
+  ThreadPool pool;
+
+  // Jobs waiting for a worker
+  std::deque<Job*> queue;
+  mutable std::mutex queueLock;
+  std::condition_variable queued;
+
+  std::atomic<bool> stopping{ false };
+
+  // Set once no conversation is left to queue jobs, which lets the dispatcher finish
+  bool drained = false;
+
+  // Connections open, which are shut down when stopping
+  std::set<int> connections;
+  std::vector<std::thread> conversations;
+  // Conversations that are over, which are joined when the next connection is accepted
+  std::vector<std::thread::id> finished;
+  std::mutex connectionLock;
+
+  // Upper bounds of the latency histogram's buckets, in seconds
+  static constexpr double latencyBuckets[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5 };
+  static constexpr std::size_t latencyBucketCount = sizeof(latencyBuckets) / sizeof(double);
+
+  // Requests answered, with an image or an error, and how long they took
+  std::size_t answered = 0;
+  std::size_t failed = 0;
+  std::size_t batches = 0;
+  double latencySum = 0.0;
+  std::size_t latencyCounts[latencyBucketCount] = {};
+  mutable std::mutex metricLock;
+};
+
+// Sends requests to a render server over its socket
+class RenderClient {
+public:
+  // Connects to the server listening at socketPath. Throws std::runtime_error if it cannot
+  RenderClient(const std::string& socketPath);
+
+  ~RenderClient();
+
+  RenderClient(const RenderClient&) = delete;
+  RenderClient& operator=(const RenderClient&) = delete;
+
+  // Has the request painted, writing the image to out as it arrives, and returns the spec painted.
+  // Throws std::runtime_error with the server's message if it could not be painted, or if the connection failed
+  std::string render(const RenderRequest& request, std::ostream& out);
+
+  // The server's metrics. Throws std::runtime_error if the connection failed
+  std::string metrics();
+
+private:
+  // Reads a response after its request was sent, writing its chunks to out and returning what came before them
+  std::string receive(std::ostream& out);
+
+  int connection = -1;
+  std::unique_ptr<std::streambuf> socket;
+
+  // What the server answers, and what is sent to it
+  std::istream responses;
+  std::ostream requests;
+};
+
+#endif
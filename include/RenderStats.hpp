@@ -0,0 +1,109 @@
+#ifndef __RENDER_STATS__
+#define __RENDER_STATS__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include "./ExpressionProgram.hpp"
+
+// The stages an image goes through
+enum class RenderPhase : std::uint8_t {
+  // Generating random trees
+  build,
+  // Reading trees from specs
+  parse,
+  // Getting trees ready for rendering: merging, analyzing and compiling them
+  prepare,
+  // Evaluating the trees over the pixels
+  render,
+  // Handing rendered pixels over to be written out
+  output,
+  // Copying images the render cache held instead of rendering them
+  cached
+};
+
+// What a martist has been doing: how long each phase took, what its trees were made of, how many pixels were
+// evaluated and, from a sample of the rows, what each kind of expression costs. Phases, pixels and operators add
+// up over every image since the last reset, while node counts are those of the last trees rendered
+class RenderStats {
+public:
+  // How many phases there are
+  static constexpr std::size_t phaseCount = 6;
+
+  // One in how many rows is evaluated instruction by instruction, timing each one
+  static constexpr std::size_t sampledRowInterval = 64;
+
+  // How many nodes of each kind a tree has
+  struct NodeCounts {
+    // Variables and constants
+    std::size_t leaves = 0;
+    // Expressions of one operand
+    std::size_t singles = 0;
+    // Expressions of two operands
+    std::size_t doubles = 0;
+  };
+
+  // Adds the seconds a phase took
+  void record(RenderPhase phase, double seconds);
+
+  // Sets the node counts of a channel's tree from its program
+  void countNodes(std::size_t channel, const ExpressionProgram& program);
+
+  // Adds pixels that were evaluated, or that were filled without evaluating them
+  void addEvaluated(std::size_t pixels) { evaluated += pixels; }
+  void addFilled(std::size_t pixels) { filled += pixels; }
+
+  // Adds the profile of a sampled row, which holds one entry per character representation. Safe from any thread
+  void addProfile(const OperatorProfile* profiles);
+
+  // Forgets everything recorded
+  void reset();
+
+  // Total seconds spent in a phase, and how many times it was gone through
+  double phaseSeconds(RenderPhase phase) const { return phases[std::size_t(phase)].seconds; }
+  std::size_t phaseCalls(RenderPhase phase) const { return phases[std::size_t(phase)].calls; }
+
+  // The node counts of a channel's tree
+  const NodeCounts& nodes(std::size_t channel) const { return channels[channel]; }
+
+  // Pixels evaluated, and pixels filled from bounds
+  std::size_t evaluatedPixels() const { return evaluated; }
+  std::size_t filledPixels() const { return filled; }
+
+  // The sampled profile of the expression a character represents
+  OperatorProfile operatorProfile(char representation) const;
+
+  // Everything recorded, as a JSON object
+  std::string toJson() const;
+
+  // Everything recorded, in the Prometheus text exposition format, with every metric prefixed by martist_
+  std::string toPrometheus() const;
+
+  // The name of a phase
+  static const char* phaseName(RenderPhase phase);
+
+private:
+  // The name of the expression a character represents, as its kernel is called, or of a variable or constant
+  static std::string operatorName(char representation);
+
+  struct PhaseTime {
+    double seconds = 0.0;
+    std::size_t calls = 0;
+  };
+
+  PhaseTime phases[phaseCount];
+
+  // Node counts of the red, green and blue trees
+  NodeCounts channels[3];
+
+  std::atomic<std::size_t> evaluated{ 0 };
+  std::atomic<std::size_t> filled{ 0 };
+
+  // Sampled profiles, by character representation
+  OperatorProfile operators[256];
+  mutable std::mutex operatorLock;
+};
+
+#endif
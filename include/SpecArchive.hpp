@@ -0,0 +1,96 @@
+#ifndef __SPEC_ARCHIVE__
+#define __SPEC_ARCHIVE__
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "./GenerationContext.hpp"
+#include "./SpecCorpus.hpp"
+
+// The fixed size start of a spec archive. Numbers are stored in the host's byte order
+struct SpecArchiveHeader {
+  // Always "MSPB"
+  char magic[4];
+  // Version of the layout
+  std::uint16_t version;
+  // How many variables the trees are made of, and their representations
+  std::uint16_t variableCount;
+  char variables[4];
+  // Fingerprint of the expressions the specs were written with
+  std::uint32_t operatorTable;
+  // How many records follow
+  std::uint64_t recordCount;
+  // FNV-1a hash of everything after the header
+  std::uint64_t checksum;
+};
+
+// A corpus of specs stored in binary, mapped into memory and checked once when opened. After the header comes
+// the offset of each record, and each record is the node count of its red, green and blue trees followed by their
+// nodes, one byte each as ExpressionTree::encode writes them. Trees are loaded by looking their nodes up in the
+// expression tables, without parsing, and a record is reached without scanning the ones before it
+class SpecArchive {
+public:
+  // Version of the layout written
+  static constexpr std::uint16_t formatVersion = 2;
+
+  // Maps the archive into memory. Throws std::runtime_error if it cannot, if it is not a spec archive, or if it was
+  // written with another layout or other expressions, or has been corrupted since
+  SpecArchive(const std::string& path);
+
+  ~SpecArchive();
+
+  SpecArchive(const SpecArchive&) = delete;
+  SpecArchive& operator=(const SpecArchive&) = delete;
+
+  // How many records the archive holds
+  std::size_t size() const { return records; }
+
+  // The variables of the archive's trees
+  const std::vector<char>& variables() const { return context->variables; }
+
+  // The encoded nodes of one channel of a record, straight from the mapping. Record must be below size()
+  const unsigned char* channel(std::size_t record, std::size_t channel, std::size_t& length) const;
+
+  // Reads a record into the provided one, reusing its trees' memory. Record must be below size(). Throws
+  // std::runtime_error if it does not hold trees of the archive's variables and expressions
+  void read(std::size_t record, SpecRecord& into) const;
+
+  // Reads the next record into the provided one. Returns false once the archive is over
+  bool next(SpecRecord& record);
+
+  // Goes back to the first record
+  void rewind() { position = 0; }
+
+  // Writes every record in the text form read by a martist, three lines each
+  void writeText(std::ostream& out) const;
+
+  // Converts specs in text form, three lines per record with blank lines ignored, into an archive at path. It is
+  // written under a temporary name first, so that no one ever maps it half written. Returns how many records it
+  // holds. Throws std::invalid_argument, telling the line, if any spec is malformed, and std::runtime_error if
+  // the archive cannot be written
+  static std::size_t write(const std::string& path, std::istream& text,
+    const std::vector<char>& variables = { 'x', 'y' });
+
+  // Fingerprint of the expressions currently available, which archives must have been written with
+  static std::uint32_t operatorTable();
+
+private:
+  // The mapped file
+  const char* data = nullptr;
+  std::size_t bytes = 0;
+
+  // Where each record starts, within the mapping
+  const char* offsets = nullptr;
+  std::size_t records = 0;
+
+  // Index of the next record
+  std::size_t position = 0;
+
+  // What the archive's trees are read with
+  std::shared_ptr<GenerationContext> context;
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef __SPEC_CORPUS__
+#define __SPEC_CORPUS__
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "./ExpressionTree.hpp"
+
+// A problem found in a corpus
+struct SpecError {
+  // Line of the offending character, counting from 1
+  std::size_t line;
+  // Column of the offending character, counting from 1
+  std::size_t column;
+  // What is wrong
+  std::string message;
+};
+
+// The three channel trees of a martist, as written by its output operator
+struct SpecRecord {
+  ExpressionTree red;
+  ExpressionTree green;
+  ExpressionTree blue;
+
+  // Line the record starts at, counting from 1
+  std::size_t line = 0;
+};
+
+// A file of martist specs, one record of three lines after the other, mapped into memory and parsed
+// record by record. Blank lines, and blanks around specs, are ignored. Malformed records are skipped and their
+// problems collected
+class SpecCorpus {
+public:
+  // Maps the file into memory. Throws std::runtime_error if it cannot
+  SpecCorpus(const std::string& path);
+
+  ~SpecCorpus();
+
+  SpecCorpus(const SpecCorpus&) = delete;
+  SpecCorpus& operator=(const SpecCorpus&) = delete;
+
+  // Parses the next well formed record into the provided one, reusing its trees' memory.
+  // Returns false once the corpus is over
+  bool next(SpecRecord& record);
+
+  // Goes back to the first record, forgetting the problems found so far
+  void rewind() { position = 0; line = 1; problems.clear(); }
+
+  // Problems found in the records read so far
+  const std::vector<SpecError>& errors() const { return problems; }
+
+private:
+  // Finds the next line with content, without its blanks. Returns false if there is none
+  bool nextLine(const char*& start, std::size_t& length);
+
+  // Parses a line into a tree, collecting any problem found. Returns whether it was well formed
+  bool parseLine(ExpressionTree& tree, const char* start, std::size_t length);
+
+  // The mapped file
+  const char* data = nullptr;
+  std::size_t size = 0;
+
+  // Where the next line starts
+  std::size_t position = 0;
+
+  // Number of the next line
+  std::size_t line = 1;
+
+  // Where the last line found starts, blanks included
+  const char* lineStart = nullptr;
+
+  // Problems found so far
+  std::vector<SpecError> problems;
+};
+
+#endif
@@ -1,79 +1,112 @@
 #ifndef __SPEC_READER__
 #define __SPEC_READER__
 
-#include <map>
 #include <stdexcept>
+#include <vector>
 #include "./ExpressionTree.hpp"
 
-struct NodeStackElement {
-  NodeStackElement(std::unique_ptr<NodeStackElement>& head, std::unique_ptr<ExpressionNode>& node)
-    : next(head.release()), node(node.release()) {
-  }
-
-  // Pointer to next element in stack
-  std::unique_ptr<NodeStackElement> next;
-
-  // Pointer to the created node
-  std::unique_ptr<ExpressionNode> node;
-
-  void print(int layer = 0) {
-    auto nodeRepresentation = node->toString();
-    std::cout << "Layer " << layer << ": " << nodeRepresentation << std::endl;
-    if (next)
-      next->print(layer + 1);
-  }
-};
-
 class SpecReader {
 public:
-  typedef std::function<void()> NodeMaker;
+  // Gets ready to read a new spec into the tree, whose arena will hold the nodes
+  void start(ExpressionTree& tree);
+
+  // What happened to a character pushed to the pile
+  enum Status {
+    // Its node was stacked
+    accepted,
+    // It is not an expression of the tree
+    unknownExpression,
+    // Its expression needs more operands than the pile has
+    missingOperand
+  };
+
+  // Makes the node for an expression and pushes it to the pile, without reporting problems
+  Status push(char expression) {
+    const auto& recipe = recipes[(unsigned char)expression];
+
+    switch (recipe.kind) {
+    case Recipe::leaf:
+      stack.push_back(arena->make<LeafNode>(recipe.expression.variableIndex, expression));
+      return accepted;
+
+    case Recipe::single:
+      if (stack.empty()) return missingOperand;
+      // Create a single node with recovered node as child and stack it on the pile
+      stack.back() = arena->make<SingleNode>(recipe.expression, stack.back());
+      return accepted;
+
+    case Recipe::twofold: {
+      if (stack.size() < 2) return missingOperand;
+      // Create a double node with 2 recovered nodes as children and stack it on the pile. The second child
+      // is the one on top
+      auto child2 = stack.back();
+      stack.pop_back();
+      stack.back() = arena->make<DoubleNode>(recipe.expression, stack.back(), child2);
+      return accepted;
+    }
 
-  SpecReader(ExpressionTree& tree) { makeStackRecipes(tree); stackHead = nullptr; }
+    default:
+      return unknownExpression;
+    }
+  }
 
   // Reads an expression and pushes it to the pile
   void read(char expression) {
-    try { stackRecipeEntries.at(expression)(); }
-    catch (std::out_of_range& error) {
+    switch (push(expression)) {
+    case accepted:
+      break;
+
+    case unknownExpression:
       std::cerr << "ERROR: No such expression '" << expression << "'" << std::endl;
-      throw std::invalid_argument("No such expression " + expression);
+      throw std::invalid_argument(std::string("No such expression ") + expression);
+
+    case missingOperand:
+      syntaxError();
     }
   };
 
-  // Returns assembled tree and empties the stack
-  ExpressionNode* assembleTree() { auto tree = stackHead->node.release(); stackHead.reset(); return tree; }
+  // Returns assembled tree and empties the stack, or nullptr if the pile does not hold exactly one tree
+  ExpressionNode* finish() {
+    auto tree = stack.size() == 1 ? stack.back() : nullptr;
+    stack.clear();
+    return tree;
+  }
 
-private:
-  // Passes through the tree's variables, single and double expressions and populates stackRecipeEntries
-  // with recipes to make each one of them, indexed by their char representations
-  void makeStackRecipes(ExpressionTree& tree);
-
-  // Creates a stack element and puts it on the stack
-  void stack(std::unique_ptr<ExpressionNode>&& node) { stackHead = std::make_unique<NodeStackElement>(stackHead, node); }
-
-  // Pops the head node
-  std::unique_ptr<ExpressionNode> pop() {
-    // Makes sure stack not empty
-    if (!stackHead) {
-      std::cerr << "ERROR: Syntax error in the expressions" << std::endl;
-      throw std::invalid_argument("Bad expression syntax");
-    }
+  // Returns assembled tree and empties the stack
+  ExpressionNode* assembleTree() {
+    auto tree = finish();
 
-    // Take the head node
-    std::unique_ptr<ExpressionNode> child(stackHead->node.release());
+    // A complete spec leaves exactly one node on the pile
+    if (!tree) syntaxError();
 
-    // Pop this node from the stack
-    auto next = stackHead->next.release();
+    return tree;
+  }
 
-    stackHead.reset(next);
+private:
+  // How to make the node for a character
+  struct Recipe {
+    enum Kind { none, leaf, single, twofold } kind = none;
+    Expression expression;
+  };
 
-    return child;
+  // Reports a malformed spec
+  [[noreturn]] void syntaxError() {
+    stack.clear();
+    std::cerr << "ERROR: Syntax error in the expressions" << std::endl;
+    throw std::invalid_argument("Bad expression syntax");
   }
 
-  // Head of the stack of read expressions
-  std::unique_ptr<NodeStackElement> stackHead;
+  // Recipe for each character, indexed by the character itself
+  Recipe recipes[256];
+
+  // Characters that currently have a recipe
+  std::vector<char> known;
+
+  // The nodes read so far that have no parent yet
+  std::vector<ExpressionNode*> stack;
 
-  // Holds functions that can create nodes from their char representations and automatically stack them
-  std::map<char, NodeMaker> stackRecipeEntries;
+  // Where the nodes are created
+  NodeArena* arena = nullptr;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,130 @@
+#ifndef __STATIC_EXPRESSION__
+#define __STATIC_EXPRESSION__
+
+#include <cstddef>
+#include <stdexcept>
+#include <string_view>
+#include "./ExpressionKernels.hpp"
+
+// Declares a type holding a spec known at compile time, to be used with StaticExpression.
+// The spec uses the same reverse polish notation the spec reader accepts
+#define STATIC_SPEC(name, spec) \
+  struct name { static constexpr std::string_view value = spec; }
+
+/////////////////////// PARSING
+
+// How many values an expression character takes from the stack
+constexpr std::size_t staticArity(char expression) {
+  switch (expression) {
+  case 'x': case 'y': return 0;
+  case 's': case 'c': return 1;
+  case '*': case 'a': return 2;
+  default: throw std::invalid_argument("No such expression");
+  }
+}
+
+// Whether the spec leaves exactly one value on the stack, never running out of operands
+constexpr bool staticWellFormed(std::string_view spec) {
+  std::size_t height = 0;
+
+  for (char expression : spec) {
+    std::size_t arity = staticArity(expression);
+    if (height < arity) return false;
+    height = height - arity + 1;
+  }
+
+  return height == 1;
+}
+
+// Position where the subexpression ending at end starts
+constexpr std::size_t staticSubexpressionStart(std::string_view spec, std::size_t end) {
+  // Values the subexpression still has to account for
+  std::size_t missing = 1;
+  std::size_t position = end + 1;
+
+  while (missing > 0) {
+    position--;
+    missing = missing - 1 + staticArity(spec[position]);
+  }
+
+  return position;
+}
+
+/////////////////////// NODES
+
+// Reads one of the variables
+template <std::size_t Index> struct StaticVariable {
+  template <class Lane> static typename Lane::Value evaluate(const double* const* variables, std::size_t index) {
+    return Lane::load(variables[Index] + index);
+  }
+};
+
+// Applies a single expression to its child
+template <char Expression, class Child> struct StaticSingle {
+  template <class Lane> static typename Lane::Value evaluate(const double* const* variables, std::size_t index) {
+    auto value = Child::template evaluate<Lane>(variables, index);
+
+    if constexpr (Expression == 's') return ExpressionKernels<Lane>::sin(value);
+    else return ExpressionKernels<Lane>::cosin(value);
+  }
+};
+
+// Applies a double expression to its children
+template <char Expression, class Child1, class Child2> struct StaticDouble {
+  template <class Lane> static typename Lane::Value evaluate(const double* const* variables, std::size_t index) {
+    auto value1 = Child1::template evaluate<Lane>(variables, index);
+    auto value2 = Child2::template evaluate<Lane>(variables, index);
+
+    if constexpr (Expression == '*') return ExpressionKernels<Lane>::product(value1, value2);
+    else return ExpressionKernels<Lane>::mean(value1, value2);
+  }
+};
+
+// Gives, as type, the node for the subexpression of Spec that ends at position End
+template <class Spec, std::size_t End, char Expression = Spec::value[End]> struct StaticParse;
+
+template <class Spec, std::size_t End> struct StaticParse<Spec, End, 'x'> { typedef StaticVariable<0> type; };
+
+template <class Spec, std::size_t End> struct StaticParse<Spec, End, 'y'> { typedef StaticVariable<1> type; };
+
+template <class Spec, std::size_t End> struct StaticParse<Spec, End, 's'> {
+  typedef StaticSingle<'s', typename StaticParse<Spec, End - 1>::type> type;
+};
+
+template <class Spec, std::size_t End> struct StaticParse<Spec, End, 'c'> {
+  typedef StaticSingle<'c', typename StaticParse<Spec, End - 1>::type> type;
+};
+
+// The second child ends right before its parent, and the first right before the second starts
+template <class Spec, std::size_t End, char Expression> struct StaticParseDouble {
+  static constexpr std::size_t secondStart = staticSubexpressionStart(Spec::value, End - 1);
+
+  typedef StaticDouble<Expression, typename StaticParse<Spec, secondStart - 1>::type,
+    typename StaticParse<Spec, End - 1>::type> type;
+};
+
+template <class Spec, std::size_t End> struct StaticParse<Spec, End, '*'> : StaticParseDouble<Spec, End, '*'> {};
+
+template <class Spec, std::size_t End> struct StaticParse<Spec, End, 'a'> : StaticParseDouble<Spec, End, 'a'> {};
+
+/////////////////////// EXPRESSION
+
+// A spec parsed at compile time into a type whose evaluation the compiler can fully inline and vectorize
+template <class Spec> struct StaticExpression {
+  static_assert(staticWellFormed(Spec::value), "Bad expression syntax");
+
+  // The spec's root node
+  typedef typename StaticParse<Spec, Spec::value.size() - 1>::type Root;
+
+  // Evaluates the spec over spans of values, one span per variable. Works as a ChannelKernel
+  static void run(const double* const* variables, double* output, std::size_t count) {
+    std::size_t index = 0;
+
+    for (; index + WidestLane::width <= count; index += WidestLane::width)
+      WidestLane::store(output + index, Root::template evaluate<WidestLane>(variables, index));
+
+    for (; index < count; index++) output[index] = Root::template evaluate<ScalarLane>(variables, index);
+  }
+};
+
+#endif
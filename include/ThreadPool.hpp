@@ -0,0 +1,76 @@
+#ifndef __THREAD_POOL__
+#define __THREAD_POOL__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that run batches of tasks. Each thread has its own queue of tasks and,
+// once it runs out of them, steals from the back of the other queues, so uneven tasks balance out
+class ThreadPool {
+public:
+  typedef std::function<void()> Task;
+
+  // Creates a pool that runs tasks on threadCount threads, counting the one that calls run
+  ThreadPool(std::size_t threadCount);
+
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Number of threads that run tasks, counting the one that calls run
+  std::size_t size() const { return queues.size(); }
+
+  // Runs all the tasks and returns once they are all done. The calling thread works on them too.
+  // If a task throws, the first exception is rethrown here after the others finish
+  void run(std::vector<Task>& tasks);
+
+private:
+  struct TaskQueue {
+    std::deque<Task> tasks;
+    std::mutex mutex;
+  };
+
+  // Loop of each spawned thread
+  void work(std::size_t index);
+
+  // Runs tasks from the thread's own queue, then stolen ones, until none are left
+  void drain(std::size_t index);
+
+  // Takes the next task from the thread's own queue, or steals one from another queue
+  bool takeTask(std::size_t index, Task& task);
+
+  // Marks a task as done, keeping the first exception thrown
+  void finishTask(std::exception_ptr error);
+
+  // One queue per thread. The calling thread uses the first one
+  std::vector<std::unique_ptr<TaskQueue>> queues;
+
+  // The spawned threads
+  std::vector<std::thread> threads;
+
+  // Guards the fields below
+  std::mutex mutex;
+  // Signals threads that a batch started or that the pool is stopping
+  std::condition_variable wake;
+  // Signals run that the batch is done
+  std::condition_variable done;
+
+  // Tasks of the current batch that are not finished yet
+  std::size_t remainingTasks = 0;
+  // Increases with each batch, so that threads tell new batches apart
+  std::size_t batch = 0;
+  // First exception thrown by a task of the current batch
+  std::exception_ptr firstError;
+  // Whether the threads should quit
+  bool stopping = false;
+};
+
+#endif
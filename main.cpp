@@ -1,18 +1,41 @@
 #include "Martist.hpp"
+#include "include/BatchPipeline.hpp"
+#include "include/RenderCache.hpp"
+#include "include/RenderServer.hpp"
+#include "include/SpecArchive.hpp"
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
+#include <set>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
+// A fixed spec, parsed at compile time
+STATIC_SPEC(RedSpec, "xyc*s");
+STATIC_SPEC(GreenSpec, "yxsa");
+STATIC_SPEC(BlueSpec, "xcyx*a");
 
 void makeImage(uint8_t* buffer, size_t w, size_t h) {
-  std::ofstream file("test_image.ppm");
-
-  file << "P6 " << w << " " << h << " 255\n";
-  for (std::size_t i = 0; i < w * h * 3; ++i)
-    file << buffer[i];
+  writePPM("test_image.ppm", buffer, w, h);
+}
 
-  file.close();
+// Removes a directory of files the tests made
+void removeDirectory(const std::string& path) {
+  if (DIR* directory = opendir(path.c_str())) {
+    while (dirent* entry = readdir(directory))
+      if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0)
+        std::remove((path + "/" + entry->d_name).c_str());
+    closedir(directory);
+  }
+  rmdir(path.c_str());
 }
 
 int main() {
@@ -45,5 +68,513 @@ int main() {
   assert(std::abs(int(buf[9]) - 128) <= 1);
   assert(std::abs(int(buf[10]) - 128) <= 1);
   assert(std::abs(int(buf[11]) - 128) <= 1);
+
+  // Rendering in parallel tiles must yield exactly the serial image
+  constexpr std::size_t SIDE = 150;
+  std::vector<std::uint8_t> serial(SIDE * SIDE * 3), parallel(SIDE * SIDE * 3);
+  Martist artist(serial.data(), SIDE, SIDE, 10, 10, 10);
+  artist.seed(42);
+  artist.paint();
+
+  std::stringstream artistSpec;
+  artistSpec << artist;
+  artist.changeBuffer(parallel.data(), SIDE, SIDE);
+  artist.threadCount(4);
+  artist.tileSize(16);
+  artistSpec >> artist;
+
+  assert(serial == parallel);
+
+  // Evaluating the channels through one shared graph must not change the image either
+  std::vector<std::uint8_t> shared(SIDE * SIDE * 3);
+  artist.shareSubexpressions(true);
+  artist.changeBuffer(shared.data(), SIDE, SIDE);
+  artistSpec.clear();
+  artistSpec.seekg(0);
+  artistSpec >> artist;
+
+  assert(serial == shared);
+  assert(artist.deduplicatedNodes() > 0);
+
+  // So must evaluating subtrees that depend on a single variable once per column or row
+  std::vector<std::uint8_t> hoisted(SIDE * SIDE * 3);
+  artist.hoistSeparable(true);
+  artist.changeBuffer(hoisted.data(), SIDE, SIDE);
+  artistSpec.clear();
+  artistSpec.seekg(0);
+  artistSpec >> artist;
+
+  assert(serial == hoisted);
+
+  // Trees compiled to native code must paint exactly what interpreting them paints. They are cached in a
+  // directory of their own, so that the tests neither leave libraries behind nor load ones left by others
+  std::vector<std::uint8_t> compiled(SIDE * SIDE * 3);
+  char jitDirectory[] = "test_jit_XXXXXX";
+  bool madeJitDirectory = mkdtemp(jitDirectory) != nullptr;
+  assert(madeJitDirectory);
+  artist.compileTrees(true, jitDirectory);
+  artist.changeBuffer(compiled.data(), SIDE, SIDE);
+  artistSpec.clear();
+  artistSpec.seekg(0);
+  artistSpec >> artist;
+
+  assert(artist.renderedNatively() && serial == compiled);
+  artist.compileTrees(false);
+  removeDirectory(jitDirectory);
+
+  // Only the user's own private directories cache libraries, as loading one runs it
+  mkdir("test_jit", 0777);
+  chmod("test_jit", 0777);
+  ExpressionJit sharedJit("test_jit");
+  assert(sharedJit.compile(artist.channelTree(0)) == nullptr && !sharedJit.lastCompileError().empty());
+  rmdir("test_jit");
+
+  // Specs parsed at compile time must paint exactly what reading them at runtime paints
+  std::vector<std::uint8_t> dynamic(SIDE * SIDE * 3), fixed(SIDE * SIDE * 3);
+  Martist styled(dynamic.data(), SIDE, SIDE, 1, 1, 1);
+  std::istringstream styleSpec("xyc*s\nyxsa\nxcyx*a\n");
+  styleSpec >> styled;
+  styled.changeBuffer(fixed.data(), SIDE, SIDE);
+  styled.paintStatic<RedSpec, GreenSpec, BlueSpec>();
+
+  assert(dynamic == fixed);
+
+  // Each artwork of a batch depends only on the seed and its index, however many threads paint the batch
+  std::vector<std::uint8_t> first(SIDE * SIDE * 3), second(SIDE * SIDE * 3), alone(SIDE * SIDE * 3);
+  std::vector<std::string> batchSpecs;
+  Martist batch(first.data(), SIDE, SIDE, 8, 8, 8);
+  batch.threadCount(2);
+  batch.paintBatch(7, { first.data(), second.data() }, &batchSpecs);
+
+  Martist single(alone.data(), SIDE, SIDE, 8, 8, 8);
+  single.paint(7, 1);
+  std::stringstream singleSpec;
+  singleSpec << single;
+
+  assert(alone == second);
+  assert(singleSpec.str() == batchSpecs[1]);
+  assert(batchSpecs[0] != batchSpecs[1]);
+
+  // Rendering into a mapped file must leave the same file that writing the buffer out does
+  {
+    MappedPPM mapped("test_mapped.ppm", SIDE, SIDE);
+    single.changeBuffer(mapped.pixels(), SIDE, SIDE);
+    single.paint(7, 1);
+  }
+  writePPM("test_written.ppm", alone.data(), SIDE, SIDE);
+
+  std::ifstream mappedFile("test_mapped.ppm", std::ios::binary), writtenFile("test_written.ppm", std::ios::binary);
+  std::stringstream mappedBytes, writtenBytes;
+  mappedBytes << mappedFile.rdbuf();
+  writtenBytes << writtenFile.rdbuf();
+
+  assert(mappedBytes.str() == writtenBytes.str());
+  std::remove("test_mapped.ppm");
+  std::remove("test_written.ppm");
+
+  // Streaming the image in strips must hand over exactly its rows, which encode to the same PNG as the whole image
+  std::vector<std::uint8_t> streamed(SIDE * SIDE * 3);
+  std::ostringstream wholePng, stripPng;
+  PngEncoder encoder;
+  encoder.write(wholePng, alone.data(), SIDE, SIDE);
+  encoder.begin(stripPng, SIDE, SIDE);
+
+  single.threadCount(3);
+  single.stream(7, [&](const std::uint8_t* pixels, std::size_t firstRow, std::size_t rows) {
+    std::copy(pixels, pixels + rows * SIDE * 3, streamed.begin() + firstRow * SIDE * 3);
+    encoder.append(pixels, rows);
+  });
+
+  assert(streamed == alone);
+  assert(stripPng.str() == wholePng.str());
+
+  // Filling tiles whose bounds fit a single color must not change the image, random or smooth
+  std::vector<std::uint8_t> culled(SIDE * SIDE * 3);
+  single.threadCount(1);
+  single.cullFlatTiles(true);
+  single.changeBuffer(culled.data(), SIDE, SIDE);
+  singleSpec.clear();
+  singleSpec.seekg(0);
+  singleSpec >> single;
+
+  assert(culled == alone);
+
+  // Smooth images have flat regions worth filling once they are large enough
+  constexpr std::size_t LARGE_SIDE = 4 * SIDE;
+  std::vector<std::uint8_t> smooth(LARGE_SIDE * LARGE_SIDE * 3), culledSmooth(LARGE_SIDE * LARGE_SIDE * 3);
+  std::istringstream smoothSpec("xx*xx**\nyy*yy**\nxx*yy**\n");
+  single.cullFlatTiles(false);
+  single.changeBuffer(smooth.data(), LARGE_SIDE, LARGE_SIDE);
+  smoothSpec >> single;
+
+  single.cullFlatTiles(true);
+  single.changeBuffer(culledSmooth.data(), LARGE_SIDE, LARGE_SIDE);
+  smoothSpec.clear();
+  smoothSpec.seekg(0);
+  smoothSpec >> single;
+
+  assert(culledSmooth == smooth);
+  assert(single.filledPixels() > 0);
+
+  // Each frame of an animation must be what painting its time on its own paints, though only part of it is evaluated
+  std::vector<std::uint8_t> frame(SIDE * SIDE * 3), still(SIDE * SIDE * 3);
+  std::ostringstream video;
+  StreamedY4M y4m(video, SIDE, SIDE);
+  Martist animator(frame.data(), SIDE, SIDE, 8, 8, 8, { 'x', 'y', 't' });
+  animator.seed(11);
+  animator.threadCount(2);
+  animator.paintFrames(3, [&](const std::uint8_t* pixels, std::size_t index) {
+    y4m.append(pixels);
+    if (index == 1) std::copy(pixels, pixels + SIDE * SIDE * 3, still.begin());
+  });
+
+  std::stringstream animatorSpec;
+  animatorSpec << animator;
+  assert(animatorSpec.str().find('t') != std::string::npos);
+
+  animator.time(Martist::frameTime(1, 3));
+  animatorSpec >> animator;
+
+  assert(frame == still);
+  assert(y4m.frames() == 3 && video.str().size() > 3 * SIDE * SIDE * 3);
+
+  // Specs that only differ in the order of commutative operands must hit the same cached image, in memory or on disk
+  assert(RenderCache::canonicalSpec("xyc*s\nyxa\nx\n") == RenderCache::canonicalSpec("ycx*s\nxya\nx\n"));
+
+  std::vector<std::uint8_t> cached(SIDE * SIDE * 3);
+  RenderCache cache(SIDE * SIDE * 3 * 2, "test_cache");
+  Martist cachedArtist(cached.data(), SIDE, SIDE, 1, 1, 1);
+  assert(!cachedArtist.paint("xyc*s\nyxsa\nxcyx*a\n", cache));
+  assert(cached == dynamic);
+
+  std::fill(cached.begin(), cached.end(), 0);
+  assert(cachedArtist.paint("ycx*s\nyxsa\nxcxy*a\n", cache));
+  assert(cached == dynamic);
+
+  RenderCache reopened(SIDE * SIDE * 3 * 2, "test_cache");
+  std::fill(cached.begin(), cached.end(), 0);
+  assert(cachedArtist.paint("xyc*s\nyxsa\nxcyx*a\n", reopened));
+  assert(cached == dynamic);
+  assert(cache.stats().hits == 1 && cache.stats().misses == 1 && reopened.stats().diskHits == 1);
+  std::system("rm -r test_cache");
+
+  // Specs are only keyed if they are made of the martist's variables, in the martist's order
+  {
+    bool refused = false;
+    try { RenderCache::canonicalSpec("q\nx\ny\n"); }
+    catch (const std::invalid_argument&) { refused = true; }
+    assert(refused);
+
+    RenderCache ordered(SIDE * SIDE * 3 * 2);
+    std::vector<std::uint8_t> swapped(SIDE * SIDE * 3);
+    Martist forward(cached.data(), SIDE, SIDE, 1, 1, 1), backward(swapped.data(), SIDE, SIDE, 1, 1, 1, { 'y', 'x' });
+    assert(!forward.paint("xyc*s\nyxsa\nxcyx*a\n", ordered) && !backward.paint("xyc*s\nyxsa\nxcyx*a\n", ordered));
+    assert(cached == dynamic && swapped != dynamic);
+  }
+
+  // An image from the cache is its own phase, and tells that nothing was rendered for it
+  {
+    RenderCache memory(SIDE * SIDE * 3 * 2);
+    Martist hitter(cached.data(), SIDE, SIDE, 1, 1, 1);
+    hitter.collectStats(true);
+    hitter.precision(Precision::fast);
+    hitter.cullFlatTiles(true);
+    assert(!hitter.paint("xyc*s\nyxsa\nxcyx*a\n", memory) && hitter.prepareSeconds() > 0.0);
+    assert(hitter.paint("ycx*s\nyxsa\nxcxy*a\n", memory));
+
+    const RenderStats& hitStats = *hitter.stats();
+    assert(hitStats.phaseCalls(RenderPhase::cached) == 1 && hitStats.phaseCalls(RenderPhase::render) == 1);
+    assert(hitStats.phaseCalls(RenderPhase::parse) == 2 && hitStats.nodes(2).doubles == 2);
+    assert(!hitter.renderedNatively() && hitter.approximatedChannels() == 0 && hitter.filledPixels() == 0);
+    assert(hitter.prepareSeconds() == 0.0 && hitter.renderSeconds() == 0.0);
+  }
+
+  // Animated and fast images are only found again at the same time and precision
+  {
+    RenderCache frames(SIDE * SIDE * 3 * 4);
+    Martist animator(cached.data(), SIDE, SIDE, 1, 1, 1, { 'x', 'y', 't' });
+    const std::string frameSpec = "ts\nxta\nyt*\n";
+
+    animator.time(-0.5);
+    assert(!animator.paint(frameSpec, frames));
+    animator.time(0.5);
+    assert(!animator.paint(frameSpec, frames));
+    animator.time(-0.5);
+    assert(animator.paint(frameSpec, frames));
+    animator.precision(Precision::fast);
+    assert(!animator.paint(frameSpec, frames));
+  }
+
+  // Collecting stats must not change the image, and must see every phase and operator the image went through
+  std::vector<std::uint8_t> profiled(SIDE * SIDE * 3);
+  styled.collectStats(true);
+  styled.changeBuffer(profiled.data(), SIDE, SIDE);
+  styleSpec.clear();
+  styleSpec.str("xyc*s\nyxsa\nxcyx*a\n");
+  styleSpec >> styled;
+
+  const RenderStats& stats = *styled.stats();
+  assert(profiled == dynamic);
+  assert(stats.phaseCalls(RenderPhase::parse) == 1 && stats.phaseCalls(RenderPhase::render) == 1);
+  assert(stats.nodes(0).leaves == 2 && stats.nodes(0).singles == 2 && stats.nodes(0).doubles == 1);
+  assert(stats.evaluatedPixels() == SIDE * SIDE);
+  assert(stats.operatorProfile('s').values > 0 && stats.operatorProfile('a').values > 0);
+  assert(stats.toJson().find("\"cosin\"") != std::string::npos);
+  assert(stats.toPrometheus().find("martist_tree_nodes{channel=\"blue\",type=\"double\"} 2") != std::string::npos);
+
+  // Fast precision changes bytes by at most 1, and only a small share of them for values spread over the range
+  std::vector<std::uint8_t> approximate(SIDE * SIDE * 3);
+  styled.collectStats(false);
+  styled.precision(Precision::fast);
+  styled.changeBuffer(approximate.data(), SIDE, SIDE);
+  styleSpec.clear();
+  styleSpec.seekg(0);
+  styleSpec >> styled;
+
+  std::size_t changedBytes = 0;
+  for (std::size_t index = 0; index < approximate.size(); index++) {
+    assert(std::abs(int(approximate[index]) - int(dynamic[index])) <= 1);
+    changedBytes += approximate[index] != dynamic[index];
+  }
+  assert(styled.approximatedChannels() == 3);
+  assert(changedBytes <= Martist::fastChangedBytes * approximate.size());
+
+  // Sharing subexpressions evaluates the channels together, in double precision, whatever the precision set
+  styled.shareSubexpressions(true);
+  styleSpec.clear();
+  styleSpec.seekg(0);
+  styleSpec >> styled;
+  assert(styled.approximatedChannels() == 0 && approximate == dynamic);
+
+  // Deep trees stay within their node budget, and write out specs that read back into the same tree
+  auto deepContext = std::make_shared<GenerationContext>(std::vector<char>{ 'x', 'y' }, 60);
+  ExpressionTree deep(60, deepContext), deepRead;
+  deep.setNodeBudget(4096);
+  deep.build();
+  assert(deep.size() <= 4096 && deep.size() == deep.getProgram().size());
+
+  std::stringstream deepSpec;
+  deepSpec << deep;
+  assert(deepSpec.str().size() == deep.size());
+  deepSpec >> deepRead;
+  assert(deepRead.size() == deep.size() && deepRead.currentDepth() == deep.currentDepth());
+  assert(deepRead.getDepth() == deep.currentDepth());
+
+  // Right-leaning specs need a value on the stack for each level, however many more than fit on the call stack
+  std::istringstream leaningSpec(std::string(200, 'x') + std::string(199, 'a'));
+  ExpressionTree leaning;
+  leaningSpec >> leaning;
+  double leaningX[] = { 0.5 }, leaningY[] = { 0.0 }, leaningValue;
+  const double* leaningVariables[] = { leaningX, leaningY };
+  std::vector<double> leaningWorkspace;
+  leaning.getProgram().run(leaningVariables, &leaningValue, 1, leaningWorkspace);
+  assert(leaning.size() == 399 && leaning.getProgram().stackSize() == 200);
+  assert(leaningValue == leaning.plugVariables({ 0.5, 0.0 }) && std::abs(leaningValue - 0.5) < 1e-12);
+
+  // Corpora skip malformed records, telling where they went wrong, and ignore blanks around specs
+  {
+    std::ofstream("test_corpus.txt") << "  xya\nxya\t\nxya\n\nxya\n xy+\nxya\nxyc*s\r\nyxsa\nxcyx*a";
+    SpecCorpus corpus("test_corpus.txt");
+    SpecRecord record;
+    std::ostringstream read;
+
+    assert(corpus.next(record) && record.line == 1);
+    read << record.red << record.green << record.blue;
+    assert(corpus.next(record) && record.line == 8 && !corpus.next(record));
+    read << record.red << record.green << record.blue;
+
+    assert(read.str() == "xyaxyaxyaxyc*syxsaxcyx*a");
+    assert(corpus.errors().size() == 1 && corpus.errors()[0].line == 6 && corpus.errors()[0].column == 4);
+  }
+  std::remove("test_corpus.txt");
+
+  // Binary archives hold the same records as their text, and paint the same images
+  std::istringstream archiveText("xyc*s\nyxsa\nxcyx*a\n\nxya\nxya\nxya\n");
+  assert(SpecArchive::write("test_archive.mspb", archiveText) == 2);
+  {
+    SpecArchive archive("test_archive.mspb");
+    std::ostringstream text;
+    archive.writeText(text);
+    assert(archive.size() == 2 && text.str() == "xyc*s\nyxsa\nxcyx*a\nxya\nxya\nxya\n");
+
+    SpecRecord archived;
+    assert(archive.next(archived) && archive.next(archived) && !archive.next(archived));
+    archive.read(0, archived);
+    std::fill(cached.begin(), cached.end(), 0);
+    cachedArtist.paint(archived);
+    assert(cached == dynamic);
+
+    // Archived trees are edited like read ones, and bytes that are no tree leave an empty one
+    std::ostringstream edited;
+    archived.blue.replace(archived.blue.size() - 1, archived.red, 2);
+    edited << archived.blue;
+    assert(edited.str() == "yc" && archived.blue.size() == 2 && archived.blue.currentDepth() == 2);
+    archived.green.replace(0, archived.red, 2);
+    edited << ' ' << archived.green;
+    assert(edited.str() == "yc ycxsa" && archived.green.size() == 5);
+
+    std::string code;
+    archived.red.encode(code);
+    assert(code.size() == 5 && archived.red.decode((const unsigned char*)code.data(), code.size()));
+    const unsigned char malformed[] = { 0x00, 0xC0 };
+    assert(!archived.red.decode(malformed, 2) && archived.red.size() == 1);
+  }
+  std::remove("test_archive.mspb");
+
+  // Searching paints the best of its candidates, whatever the thread count, and single colors score nothing
+  std::vector<std::uint8_t> searched(SIDE * SIDE * 3), threaded(SIDE * SIDE * 3);
+  Martist searcher(searched.data(), SIDE, SIDE, 6, 6, 6);
+  searcher.searchCandidates(4);
+  searcher.paint(3, 0);
+  searcher.threadCount(2);
+  searcher.changeBuffer(threaded.data(), SIDE, SIDE);
+  searcher.paint(3, 0);
+  assert(searched == threaded && searcher.candidateScores().size() == 4);
+
+  std::fill(searched.begin(), searched.end(), 100);
+  assert(Martist::scorePreview(searched.data(), SIDE, SIDE).total == 0.0);
+
+  // A render server paints what a martist would, and says what went wrong with bad requests
+  {
+    RenderServer server("test_socket", 2, 4);
+    std::thread serving(&RenderServer::serve, &server);
+    RenderClient client("test_socket");
+
+    RenderRequest request;
+    request.width = request.height = SIDE;
+    request.format = ImageFormat::ppm;
+    request.spec = "xyc*s\nyxsa\nxcyx*a\n";
+    std::ostringstream image;
+    assert(client.render(request, image) == request.spec);
+    std::string header = "P6\n" + std::to_string(SIDE) + " " + std::to_string(SIDE) + "\n255\n";
+    assert(image.str() == header + std::string(dynamic.begin(), dynamic.end()));
+
+    request.spec = "xy+\nx\ny\n";
+    bool refused = false;
+    try { client.render(request, image); }
+    catch (const std::runtime_error&) { refused = true; }
+    assert(refused);
+    assert(client.metrics().find("martist_server_requests_total 2") != std::string::npos);
+
+    // Clients that come and go leave the server serving the others
+    for (int visit = 0; visit < 4; visit++) RenderClient("test_socket").metrics();
+    request.spec = "xyc*s\nyxsa\nxcyx*a\n";
+    assert(client.render(request, image) == request.spec);
+
+    server.stop();
+    serving.join();
+  }
+
+  // Requests cannot announce specs of any length, and servers only replace sockets
+  {
+    std::size_t specLength;
+    bool refused = false;
+    try { RenderRequest::fromLine("render spec=" + std::to_string(RenderServer::longestSpec + 1), specLength); }
+    catch (const std::invalid_argument&) { refused = true; }
+    assert(refused && RenderRequest::fromLine("render spec=100", specLength).spec.empty() && specLength == 100);
+
+    std::ofstream("test_socket") << "kept";
+    refused = false;
+    try { RenderServer server("test_socket"); }
+    catch (const std::runtime_error&) { refused = true; }
+    std::ifstream kept("test_socket");
+    std::string contents;
+    assert(refused && kept >> contents && contents == "kept");
+    std::remove("test_socket");
+  }
+
+  // Pipelined batches paint what a martist does, whichever image each thread gets
+  BatchPipeline pipeline(SIDE, SIDE, 6, ImageFormat::ppm,
+    [](std::size_t index) { return "test_pipeline_" + std::to_string(index) + ".ppm"; });
+  pipeline.stageThreads(2, 2, 2);
+  pipeline.queueCapacity(1);
+  assert(pipeline.run(5, 4).images == 4);
+
+  Martist sequential(searched.data(), SIDE, SIDE, 6, 6, 6);
+  for (std::size_t index = 0; index < 4; index++) {
+    sequential.paint(5, index);
+    std::string file = "test_pipeline_" + std::to_string(index) + ".ppm";
+    std::ifstream written(file, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(written)), std::istreambuf_iterator<char>());
+    assert(contents.substr(contents.size() - searched.size()) == std::string(searched.begin(), searched.end()));
+    std::remove(file.c_str());
+  }
+
+  // Edited trees render from their cached node planes what reading their spec paints, evaluating only what changed
+  Martist editor(searched.data(), SIDE, SIDE, 8, 8, 8);
+  editor.cacheNodePlanes(std::size_t(1) << 28);
+  editor.paint(9, 0);
+  std::size_t nodeCount = editor.channelTree(0).size() + editor.channelTree(1).size() + editor.channelTree(2).size();
+  assert(editor.evaluatedNodes() > 0);
+
+  editor.channelTree(0).mutate();
+  editor.channelTree(2).crossover(editor.channelTree(1));
+  editor.redraw();
+  assert(editor.evaluatedNodes() < nodeCount);
+
+  // A single mutation evaluates the new subtree and its path to the head, less the nodes already kept. A node is
+  // known by what it computes, which is the spec of its subtree
+  auto subtreeSpecs = [&editor](std::size_t channel) {
+    std::ostringstream spec;
+    spec << editor.channelTree(channel);
+    std::vector<std::string> specs;
+    for (std::size_t node = 0; node < editor.channelTree(channel).size(); node++) {
+      std::size_t size = editor.channelTree(channel).subtreeSize(node);
+      if (size > 1) specs.push_back(spec.str().substr(node + 1 - size, size));
+    }
+    return specs;
+  };
+  for (std::size_t mutation = 0; mutation < 8; mutation++) {
+    std::set<std::string> kept;
+    for (std::size_t channel = 0; channel < 3; channel++)
+      for (const auto& spec : subtreeSpecs(channel)) kept.insert(spec);
+
+    ExpressionTree& mutated = editor.channelTree(0);
+    std::size_t root = mutated.mutate(mutated.size() / 2);
+    std::set<std::string> added;
+    for (const auto& spec : subtreeSpecs(0)) if (!kept.count(spec)) added.insert(spec);
+
+    editor.redraw();
+    assert(editor.evaluatedNodes() == added.size()
+      && added.size() <= mutated.subtreeSize(root) + mutated.level(root));
+  }
+
+  // Nodes edits leave behind never outnumber the tree's
+  for (std::size_t mutation = 0; mutation < 256; mutation++) {
+    editor.channelTree(1).mutate();
+    assert(editor.channelTree(1).heldNodes() <= 2 * editor.channelTree(1).size());
+  }
+  editor.redraw();
+
+  std::stringstream editedSpec;
+  editedSpec << editor;
+  std::vector<std::uint8_t> edited(SIDE * SIDE * 3);
+  Martist reader(edited.data(), SIDE, SIDE, 1, 1, 1);
+  editedSpec >> reader;
+  assert(edited == searched);
+
+  std::istringstream("xyc*s\nyxsa\nxcyx*a\n") >> editor;
+  assert(searched == dynamic);
+
+  // Budgeted trees never cost more than their budget, whatever their draws, even once mutated
+  auto budgetedContext = std::make_shared<GenerationContext>(std::vector<char>{ 'x', 'y' }, 7);
+  ExpressionTree budgeted(16, budgetedContext);
+  budgeted.setCostBudget(12.0);
+  for (int tree = 0; tree < 32; tree++) {
+    budgeted.build();
+    assert(budgeted.cost() <= 12.0 + 1e-9);
+    budgeted.mutate();
+    assert(budgeted.cost() <= 12.0 + 1e-9);
+  }
+  assert(editor.estimatedCost() == editor.channelTree(0).cost() + editor.channelTree(1).cost()
+    + editor.channelTree(2).cost());
+
+  // A martist's budget holds for its three trees together
+  editor.costBudget(6.0);
+  for (std::size_t index = 0; index < 8; index++) {
+    editor.paint(9, index);
+    assert(editor.costBudget() == 6.0 && editor.estimatedCost() <= 6.0 + 1e-9);
+  }
+
   return 0;
 }
@@ -0,0 +1,184 @@
+#include "../include/BatchPipeline.hpp"
+#include "../Martist.hpp"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+BatchPipeline::BatchPipeline(std::size_t width, std::size_t height, std::size_t depth, ImageFormat format,
+  PathMaker path) : width(width), height(height), depth(depth), format(format), path(std::move(path)) {
+  if (width == 0 || height == 0) throw std::domain_error("Images must be at least 1 pixel a side");
+}
+
+void BatchPipeline::stageThreads(std::size_t builders, std::size_t renderers, std::size_t encoders) {
+  if (builders == 0 || renderers == 0 || encoders == 0)
+    throw std::domain_error("Every stage needs at least 1 thread");
+
+  this->builders = builders;
+  this->renderers = renderers;
+  this->encoders = encoders;
+}
+
+void BatchPipeline::queueCapacity(std::size_t capacity) {
+  if (capacity == 0) throw std::domain_error("Queue capacity must be greater than 0");
+  this->capacity = capacity;
+}
+
+PipelineStats BatchPipeline::run(std::uint64_t seed, std::size_t count) {
+  return run(count, [this, seed](std::size_t index, SpecRecord& record) {
+    // Builds the trees the way a martist does, one channel after the other on a context of their own
+    thread_local auto context = std::make_shared<GenerationContext>(std::vector<char>{ 'x', 'y' }, 0);
+    context->randomEngine = SplitMix64::stream(seed, index);
+
+    for (ExpressionTree* tree : { &record.red, &record.green, &record.blue }) {
+      tree->setContext(context);
+      tree->setDepth(depth);
+      tree->build();
+    }
+  });
+}
+
+PipelineStats BatchPipeline::run(const std::vector<std::string>& specs) {
+  return run(specs.size(), [&specs](std::size_t index, SpecRecord& record) {
+    thread_local auto context = std::make_shared<GenerationContext>(std::vector<char>{ 'x', 'y' }, 0);
+    std::istringstream spec(specs[index]);
+
+    for (ExpressionTree* tree : { &record.red, &record.green, &record.blue }) {
+      tree->setContext(context);
+      spec >> *tree;
+    }
+  });
+}
+
+PipelineStats BatchPipeline::run(const SpecArchive& archive) {
+  return run(archive.size(), [&archive](std::size_t index, SpecRecord& record) { archive.read(index, record); });
+}
+
+PipelineStats BatchPipeline::run(std::size_t count, const TreeMaker& make) {
+  // Trees on their way from the builders to the renderers, and pixels on their way to the encoders
+  struct Trees {
+    std::size_t index;
+    SpecRecord* record;
+  };
+  struct Image {
+    std::size_t index;
+    std::vector<std::uint8_t>* pixels;
+  };
+
+  // Enough records and buffers for every queue to be full while every thread holds one
+  std::size_t recordCount = capacity + builders + renderers, bufferCount = capacity + renderers + encoders;
+  std::vector<std::unique_ptr<SpecRecord>> records;
+  std::vector<std::vector<std::uint8_t>> buffers(bufferCount, std::vector<std::uint8_t>(width * height * 3));
+
+  BoundedQueue<SpecRecord*> freeRecords(recordCount);
+  BoundedQueue<std::vector<std::uint8_t>*> freeBuffers(bufferCount);
+  BoundedQueue<Trees> built(capacity);
+  BoundedQueue<Image> rendered(capacity);
+
+  for (std::size_t index = 0; index < recordCount; index++) {
+    records.push_back(std::make_unique<SpecRecord>());
+    freeRecords.push(records.back().get());
+  }
+  for (auto& buffer : buffers) freeBuffers.push(&buffer);
+
+  std::atomic<std::size_t> nextImage{ 0 };
+  std::mutex statsLock;
+  PipelineStats stats;
+
+  // The first error of any stage, after which every queue is closed so that all threads wind down
+  std::exception_ptr error;
+  auto fail = [&]() {
+    std::lock_guard<std::mutex> guard(statsLock);
+    if (!error) error = std::current_exception();
+    freeRecords.close();
+    freeBuffers.close();
+    built.close();
+    rendered.close();
+  };
+
+  // Adds to a stage's busy time
+  auto busy = [&](double PipelineStats::*stage, std::chrono::steady_clock::time_point start) {
+    std::lock_guard<std::mutex> guard(statsLock);
+    stats.*stage += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  auto build = [&]() {
+    try {
+      SpecRecord* record;
+      std::size_t index;
+
+      while ((index = nextImage++) < count && freeRecords.pop(record)) {
+        auto start = std::chrono::steady_clock::now();
+        make(index, *record);
+        busy(&PipelineStats::buildSeconds, start);
+
+        if (!built.push(Trees{ index, record })) break;
+      }
+    }
+    catch (...) { fail(); }
+  };
+
+  auto render = [&]() {
+    try {
+      std::vector<std::uint8_t>* pixels;
+      if (!freeBuffers.pop(pixels)) return;
+      Martist martist(pixels->data(), width, height, depth, depth, depth);
+
+      Trees trees;
+      while (built.pop(trees)) {
+        auto start = std::chrono::steady_clock::now();
+        martist.changeBuffer(pixels->data(), width, height);
+        // Takes the record's trees, leaving the martist's last ones in it to be rebuilt
+        martist.paint(*trees.record);
+        busy(&PipelineStats::renderSeconds, start);
+
+        freeRecords.push(trees.record);
+        if (!rendered.push(Image{ trees.index, pixels }) || !freeBuffers.pop(pixels)) break;
+      }
+    }
+    catch (...) { fail(); }
+  };
+
+  auto encode = [&]() {
+    try {
+      PngEncoder encoder;
+
+      Image image;
+      while (rendered.pop(image)) {
+        auto start = std::chrono::steady_clock::now();
+        std::string file = path(image.index);
+
+        switch (format) {
+        case ImageFormat::ppm: writePPM(file, image.pixels->data(), width, height); break;
+        case ImageFormat::png: encoder.write(file, image.pixels->data(), width, height); break;
+        case ImageFormat::y4m: StreamedY4M(file, width, height).append(image.pixels->data()); break;
+        }
+        busy(&PipelineStats::encodeSeconds, start);
+
+        freeBuffers.push(image.pixels);
+      }
+    }
+    catch (...) { fail(); }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> buildThreads, renderThreads, encodeThreads;
+  for (std::size_t thread = 0; thread < builders; thread++) buildThreads.emplace_back(build);
+  for (std::size_t thread = 0; thread < renderers; thread++) renderThreads.emplace_back(render);
+  for (std::size_t thread = 0; thread < encoders; thread++) encodeThreads.emplace_back(encode);
+
+  // Each stage is over once the one before it is and its queue has run dry
+  for (auto& thread : buildThreads) thread.join();
+  built.close();
+  for (auto& thread : renderThreads) thread.join();
+  rendered.close();
+  for (auto& thread : encodeThreads) thread.join();
+
+  if (error) std::rethrow_exception(error);
+
+  stats.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  stats.images = count;
+  return stats;
+}
@@ -1,20 +1,187 @@
 #include "../include/ExpressionFactory.hpp"
-#include <math.h>
+#include "../include/ExpressionKernels.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 
-#define PI 3.14159265
+// local functions
+
+// Applies a single parameter kernel to a span, using the widest lane available and single values for the rest
+template <class Number, class Kernel> static void mapSpan(const Number* input, Number* output, std::size_t count,
+  Kernel kernel);
+// Applies a two parameter kernel to two spans, using the widest lane available and single values for the rest
+template <class Number, class Kernel> static void mapSpans(const Number* input1, const Number* input2,
+  Number* output, std::size_t count, Kernel kernel);
+// Bounds a function that goes between -1 and 1 with a period of 2 half turns, peaking at the given phase
+static Interval periodicInterval(Interval input, double (*function)(double), double peak);
+// Whether a range of half turns goes through the phase, or the phase plus a whole number of turns
+static bool reaches(double first, double last, double phase);
+
+// Nanoseconds per value a run of a batch function takes, at its fastest out of many runs over the same span
+template <class Run> static double timeSpan(Run run, std::size_t count);
+
+const double ExpressionFactory::trigGain = ExpressionKernels<ScalarLane>::PI;
+const double ExpressionFactory::trigFloatError = ExpressionKernels<ScalarLane>::fastTrigError;
 
 double ExpressionFactory::sin(double input) {
-  return ::sin(PI * input);
+  return ExpressionKernels<ScalarLane>::sin(input);
 }
 
 double ExpressionFactory::cosin(double input) {
-  return cos(PI * input);
+  return ExpressionKernels<ScalarLane>::cosin(input);
 }
 
 double ExpressionFactory::product(double a, double b) {
-  return a * b;
+  return ExpressionKernels<ScalarLane>::product(a, b);
 }
 
 double ExpressionFactory::mean(double a, double b) {
-  return (a + b) / 2.0;
-}
\ No newline at end of file
+  return ExpressionKernels<ScalarLane>::mean(a, b);
+}
+
+void ExpressionFactory::measureCosts(std::vector<Expression>& singleExpressions,
+  std::vector<Expression>& doubleExpressions) {
+  // Spans as long as the ones programs evaluate, going across the whole range
+  constexpr std::size_t count = 256;
+  std::vector<double> first(count), second(count), output(count);
+  for (std::size_t index = 0; index < count; index++) {
+    first[index] = 2.0 * index / count - 1;
+    second[index] = 1 - 1.5 * index / count;
+  }
+
+  for (auto& expression : singleExpressions)
+    expression.cost = timeSpan([&]() { expression.singleBatchFunction(first.data(), output.data(), count); }, count);
+  for (auto& expression : doubleExpressions)
+    expression.cost = timeSpan([&]() {
+      expression.doubleBatchFunction(first.data(), second.data(), output.data(), count);
+    }, count);
+}
+
+/////////////////////// BATCH EXPRESSION FUNCTIONS
+
+void ExpressionFactory::sinBatch(const double* input, double* output, std::size_t count) {
+  mapSpan(input, output, count, [](auto lane, auto value) { return ExpressionKernels<decltype(lane)>::sin(value); });
+}
+
+void ExpressionFactory::cosinBatch(const double* input, double* output, std::size_t count) {
+  mapSpan(input, output, count, [](auto lane, auto value) { return ExpressionKernels<decltype(lane)>::cosin(value); });
+}
+
+void ExpressionFactory::productBatch(const double* a, const double* b, double* output, std::size_t count) {
+  mapSpans(a, b, output, count,
+    [](auto lane, auto a, auto b) { return ExpressionKernels<decltype(lane)>::product(a, b); });
+}
+
+void ExpressionFactory::meanBatch(const double* a, const double* b, double* output, std::size_t count) {
+  mapSpans(a, b, output, count,
+    [](auto lane, auto a, auto b) { return ExpressionKernels<decltype(lane)>::mean(a, b); });
+}
+
+/////////////////////// FLOAT BATCH EXPRESSION FUNCTIONS
+
+void ExpressionFactory::sinFloatBatch(const float* input, float* output, std::size_t count) {
+  mapSpan(input, output, count, [](auto lane, auto value) { return ExpressionKernels<decltype(lane)>::fastSin(value); });
+}
+
+void ExpressionFactory::cosinFloatBatch(const float* input, float* output, std::size_t count) {
+  mapSpan(input, output, count,
+    [](auto lane, auto value) { return ExpressionKernels<decltype(lane)>::fastCosin(value); });
+}
+
+void ExpressionFactory::productFloatBatch(const float* a, const float* b, float* output, std::size_t count) {
+  mapSpans(a, b, output, count,
+    [](auto lane, auto a, auto b) { return ExpressionKernels<decltype(lane)>::product(a, b); });
+}
+
+void ExpressionFactory::meanFloatBatch(const float* a, const float* b, float* output, std::size_t count) {
+  mapSpans(a, b, output, count,
+    [](auto lane, auto a, auto b) { return ExpressionKernels<decltype(lane)>::mean(a, b); });
+}
+
+/////////////////////// INTERVAL EXPRESSION FUNCTIONS
+
+Interval ExpressionFactory::sinInterval(Interval input) {
+  // Peaks at half a half turn, and bottoms a half turn later
+  return periodicInterval(input, &sin, 0.5);
+}
+
+Interval ExpressionFactory::cosinInterval(Interval input) {
+  return periodicInterval(input, &cosin, 0.0);
+}
+
+// Rounding is monotonic, so the rounded products at the corners still bound every rounded product within
+Interval ExpressionFactory::productInterval(Interval a, Interval b) {
+  double corners[] = { product(a.lower, b.lower), product(a.lower, b.upper), product(a.upper, b.lower),
+    product(a.upper, b.upper) };
+
+  return { *std::min_element(corners, corners + 4), *std::max_element(corners, corners + 4) };
+}
+
+Interval ExpressionFactory::meanInterval(Interval a, Interval b) {
+  return { mean(a.lower, b.lower), mean(a.upper, b.upper) };
+}
+
+/////////////////////////////// LOCAL FUNCTIONS
+
+static Interval periodicInterval(Interval input, double (*function)(double), double peak) {
+  // The polynomials are only within a few ulps of the true curve, which is not quite monotonic, so
+  // the bounds are widened by far more than that
+  constexpr double slack = 1e-12;
+
+  // Where the range starts and ends, in actual half turns
+  double first = input.lower * (ExpressionKernels<ScalarLane>::PI / M_PI);
+  double last = input.upper * (ExpressionKernels<ScalarLane>::PI / M_PI);
+  if (last - first >= 2.0) return { -1.0 - slack, 1.0 + slack };
+
+  double atFirst = function(input.lower), atLast = function(input.upper);
+  Interval result = { std::min(atFirst, atLast), std::max(atFirst, atLast) };
+
+  // Between the ends the function only turns at its peaks and troughs, a whole turn apart
+  if (reaches(first, last, peak)) result.upper = 1.0;
+  if (reaches(first, last, peak + 1.0)) result.lower = -1.0;
+
+  return { result.lower - slack, result.upper + slack };
+}
+
+static bool reaches(double first, double last, double phase) {
+  return phase + 2.0 * std::ceil((first - phase) / 2.0) <= last;
+}
+
+template <class Number, class Kernel> static void mapSpan(const Number* input, Number* output, std::size_t count,
+  Kernel kernel) {
+  typedef typename LanesOf<Number>::Widest Widest;
+  std::size_t index = 0;
+
+  for (; index + Widest::width <= count; index += Widest::width)
+    Widest::store(output + index, kernel(Widest(), Widest::load(input + index)));
+
+  for (; index < count; index++)
+    output[index] = kernel(typename LanesOf<Number>::Single(), input[index]);
+}
+
+template <class Number, class Kernel> static void mapSpans(const Number* input1, const Number* input2,
+  Number* output, std::size_t count, Kernel kernel) {
+  typedef typename LanesOf<Number>::Widest Widest;
+  std::size_t index = 0;
+
+  for (; index + Widest::width <= count; index += Widest::width)
+    Widest::store(output + index, kernel(Widest(), Widest::load(input1 + index), Widest::load(input2 + index)));
+
+  for (; index < count; index++)
+    output[index] = kernel(typename LanesOf<Number>::Single(), input1[index], input2[index]);
+}
+
+template <class Run> static double timeSpan(Run run, std::size_t count) {
+  // The first rounds warm up the caches and the clock, so only the fastest round counts
+  constexpr std::size_t rounds = 50, runsPerRound = 100;
+  double fastest = INFINITY;
+
+  for (std::size_t round = 0; round < rounds; round++) {
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t repeat = 0; repeat < runsPerRound; repeat++) run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fastest = std::min(fastest, seconds);
+  }
+
+  return fastest / runsPerRound / count * 1e9;
+}
@@ -0,0 +1,359 @@
+#include "../include/ExpressionGraph.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+// Marks nodes that are not used by any other, and the planes of nodes that have none
+static constexpr std::size_t none = std::size_t(-1);
+
+void ExpressionGraph::build(const std::vector<const ExpressionProgram*>& programs, bool merge) {
+  nodes.clear();
+  outputs.clear();
+  instructionCount = 0;
+
+  // Finds each subexpression's node by its key
+  std::unordered_map<NodeKey, std::size_t, NodeKeyHash> existingNodes;
+
+  // Nodes of the values on the program's stack
+  std::vector<std::size_t> stack;
+
+  for (auto program : programs) {
+    stack.clear();
+
+    for (const auto& instruction : program->instructions()) {
+      NodeKey key{ instruction.code, instruction.expression.characterRepresentation, 0, { none, none } };
+
+      switch (instruction.code) {
+      case OpCode::pushVariable:
+        key.value = instruction.expression.variableIndex;
+        break;
+
+      case OpCode::pushConstant:
+        std::memcpy(&key.value, &instruction.constant, sizeof(double));
+        break;
+
+      case OpCode::applySingle:
+        key.operands[0] = stack.back();
+        stack.pop_back();
+        break;
+
+      case OpCode::applyDouble:
+        key.operands[1] = stack.back();
+        stack.pop_back();
+        key.operands[0] = stack.back();
+        stack.pop_back();
+        break;
+      }
+
+      // Reuses the node if this subexpression was already seen
+      auto existing = merge ? existingNodes.find(key) : existingNodes.end();
+      if (existing != existingNodes.end()) {
+        stack.push_back(existing->second);
+        continue;
+      }
+
+      // A node depends on its own variable or on whatever its operands depend on
+      std::uint32_t dependencies = 0;
+      if (instruction.code == OpCode::pushVariable) dependencies = std::uint32_t(1) << key.value;
+      for (auto operand : key.operands)
+        if (operand != none) dependencies |= nodes[operand].dependencies;
+
+      nodes.push_back(GraphNode{ instruction.code, instruction.expression, instruction.constant,
+        { key.operands[0], key.operands[1] }, dependencies });
+      if (merge) existingNodes.emplace(key, nodes.size() - 1);
+      stack.push_back(nodes.size() - 1);
+    }
+
+    instructionCount += program->size();
+    outputs.push_back(stack.back());
+  }
+
+  // Variables are read in place
+  planeCount = assignPlanes(planes, [this](std::size_t index) { return nodes[index].code != OpCode::pushVariable; });
+
+  classify();
+}
+
+template <class NeedsPlane>
+std::size_t ExpressionGraph::assignPlanes(std::vector<std::size_t>& assignment, NeedsPlane needsPlane) const {
+  // Finds the last node to use each node's value. Outputs are used until the end
+  std::vector<std::size_t> lastUse(nodes.size(), none);
+  for (std::size_t index = 0; index < nodes.size(); index++)
+    for (auto operand : nodes[index].operands)
+      if (operand != none) lastUse[operand] = index;
+  for (auto output : outputs) lastUse[output] = nodes.size();
+
+  assignment.assign(nodes.size(), none);
+  std::size_t count = 0;
+
+  // Planes no longer in use
+  std::vector<std::size_t> freePlanes;
+
+  for (std::size_t index = 0; index < nodes.size(); index++) {
+    auto& node = nodes[index];
+
+    // Frees the planes of operands used for the last time. Kernels work element by element,
+    // so a node may write over the plane it reads from
+    for (std::size_t operand = 0; operand < 2; operand++) {
+      auto operandIndex = node.operands[operand];
+      if (operandIndex == none || lastUse[operandIndex] != index || assignment[operandIndex] == none) continue;
+      // The same node may be both operands
+      if (operand == 1 && node.operands[0] == operandIndex) continue;
+      freePlanes.push_back(assignment[operandIndex]);
+    }
+
+    if (!needsPlane(index)) continue;
+
+    if (freePlanes.empty()) assignment[index] = count++;
+    else {
+      assignment[index] = freePlanes.back();
+      freePlanes.pop_back();
+    }
+  }
+
+  return count;
+}
+
+//////////////////////////////// EVALUATION
+
+void ExpressionGraph::run(const double* const* variables, double* const* outputValues, std::size_t count,
+  std::vector<double>& workspace) const {
+  constexpr std::size_t batchSize = ExpressionProgram::batchSize;
+
+  workspace.resize(planeCount * batchSize);
+
+  // Where each node's values for the current batch are
+  std::vector<const double*> values(nodes.size());
+
+  for (std::size_t offset = 0; offset < count; offset += batchSize) {
+    std::size_t span = std::min(batchSize, count - offset);
+
+    for (std::size_t index = 0; index < nodes.size(); index++) {
+      const auto& node = nodes[index];
+      double* plane = planes[index] == none ? nullptr : workspace.data() + planes[index] * batchSize;
+
+      switch (node.code) {
+      case OpCode::pushVariable:
+        values[index] = variables[node.expression.variableIndex] + offset;
+        continue;
+
+      case OpCode::pushConstant:
+        std::fill(plane, plane + span, node.constant);
+        break;
+
+      case OpCode::applySingle:
+        node.expression.singleBatchFunction(values[node.operands[0]], plane, span);
+        break;
+
+      case OpCode::applyDouble:
+        node.expression.doubleBatchFunction(values[node.operands[0]], values[node.operands[1]], plane, span);
+        break;
+      }
+
+      values[index] = plane;
+    }
+
+    for (std::size_t output = 0; output < outputs.size(); output++)
+      std::memcpy(outputValues[output] + offset, values[outputs[output]], span * sizeof(double));
+  }
+}
+
+//////////////////////////////// GRID EVALUATION
+
+void ExpressionGraph::classify() {
+  // The first variable runs along columns, the second along rows, and any other is fixed over the grid
+  constexpr std::uint32_t columnVariable = 1 << 0, rowVariable = 1 << 1;
+
+  variations.resize(nodes.size());
+  for (std::size_t index = 0; index < nodes.size(); index++) {
+    auto dependencies = nodes[index].dependencies & (columnVariable | rowVariable);
+
+    if (dependencies == 0) variations[index] = Variation::constant;
+    else if (dependencies == columnVariable) variations[index] = Variation::perColumn;
+    else if (dependencies == rowVariable) variations[index] = Variation::perRow;
+    else variations[index] = Variation::perPixel;
+  }
+
+  // Row values are spread over a plane when a per pixel node or an output reads them
+  std::vector<bool> readPerPixel(nodes.size(), false);
+  for (std::size_t index = 0; index < nodes.size(); index++)
+    if (variations[index] == Variation::perPixel)
+      for (auto operand : nodes[index].operands)
+        if (operand != none) readPerPixel[operand] = true;
+  for (auto output : outputs) readPerPixel[output] = true;
+
+  gridPlaneCount = assignPlanes(gridPlanes, [this, &readPerPixel](std::size_t index) {
+    return variations[index] == Variation::perPixel || (variations[index] == Variation::perRow && readPerPixel[index]);
+  });
+}
+
+std::size_t ExpressionGraph::perPixelNodes() const {
+  return std::count(variations.begin(), variations.end(), Variation::perPixel);
+}
+
+GridTables ExpressionGraph::tabulate(const std::vector<double>& columnValues, const std::vector<double>& rowValues,
+  const std::vector<double>& fixedVariables) const {
+  constexpr std::size_t batchSize = ExpressionProgram::batchSize;
+
+  GridTables tables;
+  tables.values.resize(nodes.size());
+
+  // Operands that are constant over the grid, spread over as many values as the node needs
+  std::vector<double> spread[2];
+
+  for (std::size_t index = 0; index < nodes.size(); index++) {
+    const auto& node = nodes[index];
+    auto& values = tables.values[index];
+
+    if (variations[index] == Variation::perPixel) continue;
+
+    if (variations[index] == Variation::constant) {
+      double value = 0.0;
+
+      switch (node.code) {
+      case OpCode::pushVariable: value = fixedVariables.at(node.expression.variableIndex); break;
+      case OpCode::pushConstant: value = node.constant; break;
+      case OpCode::applySingle: value = node.expression.singleFunction(tables.values[node.operands[0]][0]); break;
+      case OpCode::applyDouble:
+        value = node.expression.doubleFunction(tables.values[node.operands[0]][0], tables.values[node.operands[1]][0]);
+        break;
+      }
+
+      values.assign(batchSize, value);
+      continue;
+    }
+
+    // Per column and per row nodes are evaluated once for each of their columns or rows
+    const auto& axis = variations[index] == Variation::perColumn ? columnValues : rowValues;
+
+    // Finds a span of axis length for each operand
+    const double* operands[2];
+    for (std::size_t operand = 0; operand < 2; operand++) {
+      auto operandIndex = node.operands[operand];
+      if (operandIndex == none) continue;
+
+      if (variations[operandIndex] == Variation::constant) {
+        spread[operand].assign(axis.size(), tables.values[operandIndex][0]);
+        operands[operand] = spread[operand].data();
+      }
+      else operands[operand] = tables.values[operandIndex].data();
+    }
+
+    switch (node.code) {
+    case OpCode::pushVariable: values = axis; break;
+    case OpCode::pushConstant: break;
+    case OpCode::applySingle:
+      values.resize(axis.size());
+      node.expression.singleBatchFunction(operands[0], values.data(), axis.size());
+      break;
+    case OpCode::applyDouble:
+      values.resize(axis.size());
+      node.expression.doubleBatchFunction(operands[0], operands[1], values.data(), axis.size());
+      break;
+    }
+  }
+
+  return tables;
+}
+
+void ExpressionGraph::run(const GridTables& tables, std::size_t row, std::size_t firstColumn,
+  double* const* outputValues, std::size_t count, std::vector<double>& workspace) const {
+  runGrid(tables, nullptr, nullptr, row, firstColumn, outputValues, count, workspace);
+}
+
+void ExpressionGraph::run(const GridTables& tables, const GridPlanes& planes, std::size_t row,
+  std::size_t firstColumn, double* const* outputValues, std::size_t count, std::vector<double>& workspace) const {
+  runGrid(tables, &planes, nullptr, row, firstColumn, outputValues, count, workspace);
+}
+
+//////////////////////////////// CACHED GRID EVALUATION
+
+GridPlanes ExpressionGraph::planesWithout(std::size_t variable, std::size_t rows, std::size_t columns) const {
+  GridPlanes planes;
+  planes.variable = std::uint32_t(1) << variable;
+  planes.columns = columns;
+  planes.values.resize(nodes.size());
+
+  // Keeps the per pixel nodes that do not depend on the variable but are read by some that do, or are outputs
+  auto unchanging = [this, &planes](std::size_t index) {
+    return variations[index] == Variation::perPixel && !(nodes[index].dependencies & planes.variable);
+  };
+
+  std::vector<bool> kept(nodes.size(), false);
+  for (std::size_t index = 0; index < nodes.size(); index++)
+    if (variations[index] == Variation::perPixel && !unchanging(index))
+      for (auto operand : nodes[index].operands)
+        if (operand != none && unchanging(operand)) kept[operand] = true;
+  for (auto output : outputs)
+    if (unchanging(output)) kept[output] = true;
+
+  for (std::size_t index = 0; index < nodes.size(); index++)
+    if (kept[index]) planes.values[index].resize(rows * columns);
+
+  return planes;
+}
+
+void ExpressionGraph::cache(const GridTables& tables, GridPlanes& planes, std::size_t row,
+  std::vector<double>& workspace) const {
+  runGrid(tables, nullptr, &planes, row, 0, nullptr, planes.columns, workspace);
+}
+
+void ExpressionGraph::runGrid(const GridTables& tables, const GridPlanes* planes, GridPlanes* filling,
+  std::size_t row, std::size_t firstColumn, double* const* outputValues, std::size_t count,
+  std::vector<double>& workspace) const {
+  constexpr std::size_t batchSize = ExpressionProgram::batchSize;
+
+  workspace.resize(gridPlaneCount * batchSize);
+
+  // Where each node's values for the current batch are
+  std::vector<const double*> values(nodes.size());
+
+  for (std::size_t offset = 0; offset < count; offset += batchSize) {
+    std::size_t span = std::min(batchSize, count - offset);
+
+    for (std::size_t index = 0; index < nodes.size(); index++) {
+      const auto& node = nodes[index];
+      double* plane = gridPlanes[index] == none ? nullptr : workspace.data() + gridPlanes[index] * batchSize;
+
+      switch (variations[index]) {
+      case Variation::constant:
+        values[index] = tables.values[index].data();
+        break;
+
+      case Variation::perColumn:
+        values[index] = tables.values[index].data() + firstColumn + offset;
+        break;
+
+      case Variation::perRow:
+        if (plane) std::fill(plane, plane + span, tables.values[index][row]);
+        values[index] = plane;
+        break;
+
+      case Variation::perPixel:
+        if (planes && !(node.dependencies & planes->variable)) {
+          // Nodes the planes do not hold are only read by others that do not depend on the variable either
+          if (!planes->values[index].empty())
+            values[index] = planes->values[index].data() + row * planes->columns + firstColumn + offset;
+          continue;
+        }
+
+        if (filling && (node.dependencies & filling->variable)) continue;
+
+        if (node.code == OpCode::applySingle)
+          node.expression.singleBatchFunction(values[node.operands[0]], plane, span);
+        else
+          node.expression.doubleBatchFunction(values[node.operands[0]], values[node.operands[1]], plane, span);
+        values[index] = plane;
+
+        if (filling && !filling->values[index].empty())
+          std::copy(plane, plane + span, filling->values[index].data() + row * filling->columns + firstColumn + offset);
+        break;
+      }
+    }
+
+    if (outputValues)
+      for (std::size_t output = 0; output < outputs.size(); output++)
+        std::memcpy(outputValues[output] + offset, values[outputs[output]], span * sizeof(double));
+  }
+}
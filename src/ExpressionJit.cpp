@@ -0,0 +1,224 @@
+#include "../include/ExpressionJit.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Changes whenever the generated code changes, so that stale libraries are not reused
+static constexpr int generatorVersion = 1;
+
+// local functions
+
+// FNV-1a hash of a string
+static std::uint64_t hashString(const std::string& text);
+
+// Whether a path is a file or directory, as wanted, that only the current user may write to. Links are not followed
+static bool privatePath(const std::string& path, bool directory);
+
+// Makes a new empty file named after pattern, whose XXXXXX before the suffix is replaced. Returns its path, or an
+// empty string if it could not be made
+static std::string makeTemporary(const std::string& pattern, int suffixLength);
+
+ExpressionJit::ExpressionJit(std::string cacheDirectory, std::string compiler)
+  : directory(cacheDirectory.empty() ? defaultDirectory() : cacheDirectory), compilerCommand(compiler) {
+  if (directory.empty()) directoryError = "No JIT cache directory, as neither XDG_CACHE_HOME nor HOME is set";
+  else {
+    // The default directory's parent may not exist yet either. Neither is changed if it does
+    std::size_t slash = directory.find_last_of('/');
+    if (slash != std::string::npos && slash > 0) mkdir(directory.substr(0, slash).c_str(), 0700);
+    mkdir(directory.c_str(), 0700);
+
+    if (!privatePath(directory, true))
+      directoryError = "JIT cache directory " + directory + " is missing, not the user's own or writable by others";
+  }
+
+  std::ifstream header(MARTIST_INCLUDE_DIR "/ExpressionKernels.hpp", std::ios::binary);
+  kernelHash = hashString(std::string(std::istreambuf_iterator<char>(header), std::istreambuf_iterator<char>()));
+}
+
+ExpressionJit::~ExpressionJit() {
+  for (auto& library : libraries) dlclose(library.second);
+}
+
+ChannelKernel ExpressionJit::compile(const ExpressionTree& tree) {
+  auto start = std::chrono::steady_clock::now();
+
+  std::ostringstream specStream;
+  specStream << tree;
+  std::string spec = specStream.str();
+
+  void* library = nullptr;
+  lastCached = true;
+  lastError.clear();
+
+  // Looks for the library among the loaded ones, then on disk, and builds it last
+  auto loaded = libraries.find(spec);
+  if (loaded != libraries.end()) library = loaded->second;
+  else if (!directoryError.empty()) {
+    lastCached = false;
+    lastError = directoryError;
+  }
+  else {
+    char key[64];
+    std::snprintf(key, sizeof(key), "%016llx-%016llx-%d", (unsigned long long)hashString(spec),
+      (unsigned long long)kernelHash, generatorVersion);
+    std::string base = directory + "/" + key;
+
+    library = load(base + ".so", spec);
+
+    if (!library) {
+      lastCached = false;
+
+      // Builds under names of its own, so that processes building the same spec never write over each other's
+      // files, nor load a half written library
+      std::string sourcePath = makeTemporary(base + "-XXXXXX.cpp", 4);
+      std::string libraryPath = makeTemporary(base + "-XXXXXX.so", 3);
+      std::string logPath = makeTemporary(base + "-XXXXXX.log", 4);
+
+      if (sourcePath.empty() || libraryPath.empty() || logPath.empty())
+        lastError = "Cannot create files in JIT cache directory " + directory;
+      else {
+        std::ofstream source(sourcePath);
+        source << generateSource(tree, spec);
+        source.close();
+
+        std::string command = compilerCommand + " -std=c++17 -O2 -march=native -shared -fPIC -I\"" MARTIST_INCLUDE_DIR
+          "\" -o \"" + libraryPath + "\" \"" + sourcePath + "\" 2>\"" + logPath + "\"";
+
+        if (!source) lastError = "Cannot write " + sourcePath;
+        else if (std::system(command.c_str()) != 0) {
+          std::ifstream log(logPath);
+          lastError = "Cannot compile " + spec + ":\n"
+            + std::string(std::istreambuf_iterator<char>(log), std::istreambuf_iterator<char>());
+        }
+        else if (std::rename(libraryPath.c_str(), (base + ".so").c_str()) != 0)
+          lastError = "Cannot move the library into " + base + ".so";
+        else library = load(base + ".so", spec);
+
+        if (lastError.empty() && !library) lastError = "Cannot load " + base + ".so";
+      }
+
+      for (const auto& path : { sourcePath, libraryPath, logPath })
+        if (!path.empty()) std::remove(path.c_str());
+    }
+
+    if (library) libraries[spec] = library;
+  }
+
+  lastSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  return library ? (ChannelKernel)dlsym(library, "martistKernel") : nullptr;
+}
+
+void* ExpressionJit::load(const std::string& path, const std::string& spec) {
+  // Opening a library runs its code, so only the user's own are opened
+  if (!privatePath(path, false)) return nullptr;
+
+  void* library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!library) return nullptr;
+
+  // Guards against hash collisions
+  auto librarySpec = (const char*)dlsym(library, "martistSpec");
+  if (!librarySpec || spec != librarySpec || !dlsym(library, "martistKernel")) {
+    dlclose(library);
+    return nullptr;
+  }
+
+  return library;
+}
+
+std::string ExpressionJit::defaultDirectory() {
+  const char* cache = std::getenv("XDG_CACHE_HOME");
+  if (cache && cache[0] == '/') return std::string(cache) + "/martist-jit";
+
+  const char* home = std::getenv("HOME");
+  if (home && home[0] == '/') return std::string(home) + "/.cache/martist-jit";
+
+  return "";
+}
+
+std::string ExpressionJit::generateSource(const ExpressionTree& tree, const std::string& spec) {
+  std::ostringstream source;
+
+  source << "// Generated from spec " << spec << "\n"
+    << "#include \"ExpressionKernels.hpp\"\n\n"
+    << "extern \"C\" const char martistSpec[] = \"" << spec << "\";\n\n"
+    << "template <class Lane> static inline typename Lane::Value evaluate(const double* const* variables, std::size_t index) {\n"
+    << "  typedef ExpressionKernels<Lane> Kernels;\n";
+
+  // Each instruction gets its own value, named after its position. The stack holds those names
+  std::vector<std::size_t> stack;
+  std::size_t value = 0;
+
+  for (const auto& instruction : tree.getProgram().instructions()) {
+    source << "  typename Lane::Value v" << value << " = ";
+
+    switch (instruction.code) {
+    case OpCode::pushVariable:
+      source << "Lane::load(variables[" << instruction.expression.variableIndex << "] + index);\n";
+      break;
+
+    case OpCode::pushConstant: {
+      char constant[64];
+      std::snprintf(constant, sizeof(constant), "%a", instruction.constant);
+      source << "Lane::broadcast(" << constant << ");\n";
+      break;
+    }
+
+    case OpCode::applySingle:
+      source << "Kernels::" << instruction.expression.kernelName << "(v" << stack.back() << ");\n";
+      stack.pop_back();
+      break;
+
+    case OpCode::applyDouble: {
+      auto second = stack.back();
+      stack.pop_back();
+      source << "Kernels::" << instruction.expression.kernelName << "(v" << stack.back() << ", v" << second << ");\n";
+      stack.pop_back();
+      break;
+    }
+    }
+
+    stack.push_back(value++);
+  }
+
+  source << "  return v" << stack.back() << ";\n}\n\n"
+    << "extern \"C\" void martistKernel(const double* const* variables, double* output, std::size_t count) {\n"
+    << "  std::size_t index = 0;\n"
+    << "  for (; index + WidestLane::width <= count; index += WidestLane::width)\n"
+    << "    WidestLane::store(output + index, evaluate<WidestLane>(variables, index));\n"
+    << "  for (; index < count; index++) output[index] = evaluate<ScalarLane>(variables, index);\n"
+    << "}\n";
+
+  return source.str();
+}
+
+/////////////////////////////// LOCAL FUNCTIONS
+
+static std::uint64_t hashString(const std::string& text) {
+  std::uint64_t hash = 14695981039346656037ull;
+  for (unsigned char character : text) hash = (hash ^ character) * 1099511628211ull;
+  return hash;
+}
+
+static bool privatePath(const std::string& path, bool directory) {
+  struct stat status;
+  if (lstat(path.c_str(), &status) != 0) return false;
+  if (directory ? !S_ISDIR(status.st_mode) : !S_ISREG(status.st_mode)) return false;
+
+  return status.st_uid == geteuid() && (status.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+static std::string makeTemporary(const std::string& pattern, int suffixLength) {
+  std::string path = pattern;
+  int file = mkstemps(&path[0], suffixLength);
+  if (file < 0) return "";
+
+  close(file);
+  return path;
+}
@@ -0,0 +1,198 @@
+#include "../include/ExpressionProgram.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+void ExpressionProgram::emit(Instruction instruction, int stackEffect) {
+  // Makes sure the instruction has the operands it needs
+  if (stackEffect <= 0 && stackHeight < std::size_t(1 - stackEffect))
+    throw std::invalid_argument("Bad expression syntax");
+
+  stackHeight += stackEffect;
+  requiredStack = std::max(requiredStack, stackHeight);
+
+  code.push_back(instruction);
+}
+
+double ExpressionProgram::run(const double* variables) const {
+  double localStack[maxStackSize];
+  std::vector<double> heapStack;
+  double* stack = stackFor(localStack, heapStack);
+
+  // Points to the top value of the stack
+  double* top = stack - 1;
+
+  for (const auto& instruction : code) {
+    switch (instruction.code) {
+    case OpCode::pushVariable:
+      *++top = variables[instruction.expression.variableIndex];
+      break;
+
+    case OpCode::pushConstant:
+      *++top = instruction.constant;
+      break;
+
+    case OpCode::applySingle:
+      *top = instruction.expression.singleFunction(*top);
+      break;
+
+    case OpCode::applyDouble:
+      // The second operand is on top, the first right below it
+      top[-1] = instruction.expression.doubleFunction(top[-1], top[0]);
+      top--;
+      break;
+    }
+  }
+
+  return *top;
+}
+
+double ExpressionProgram::cost() const {
+  double total = 0.0;
+  for (const auto& instruction : code) total += cost(instruction);
+  return total;
+}
+
+Interval ExpressionProgram::bound(const Interval* variables) const {
+  Interval localStack[maxStackSize];
+  std::vector<Interval> heapStack;
+  Interval* stack = stackFor(localStack, heapStack);
+
+  // Points to the top range of the stack
+  Interval* top = stack - 1;
+
+  for (const auto& instruction : code) {
+    switch (instruction.code) {
+    case OpCode::pushVariable:
+      *++top = variables[instruction.expression.variableIndex];
+      break;
+
+    case OpCode::pushConstant:
+      *++top = Interval{ instruction.constant, instruction.constant };
+      break;
+
+    case OpCode::applySingle:
+      *top = instruction.expression.singleIntervalFunction(*top);
+      break;
+
+    case OpCode::applyDouble:
+      top[-1] = instruction.expression.doubleIntervalFunction(top[-1], top[0]);
+      top--;
+      break;
+    }
+  }
+
+  return *top;
+}
+
+void ExpressionProgram::run(const double* const* variables, double* output, std::size_t count,
+  std::vector<double>& workspace) const {
+  runSpans(variables, output, count, workspace);
+}
+
+void ExpressionProgram::run(const float* const* variables, float* output, std::size_t count,
+  std::vector<float>& workspace) const {
+  runSpans(variables, output, count, workspace);
+}
+
+double ExpressionProgram::singlePrecisionError() const {
+  double localStack[maxStackSize];
+  std::vector<double> heapStack;
+  double* stack = stackFor(localStack, heapStack);
+  double* top = stack - 1;
+
+  for (const auto& instruction : code) {
+    switch (instruction.code) {
+    case OpCode::pushVariable:
+    case OpCode::pushConstant:
+      // Values within -1,1 are rounded to the nearest float
+      *++top = ExpressionFactory::floatRounding;
+      break;
+
+    case OpCode::applySingle:
+      *top = instruction.expression.errorGain * *top + instruction.expression.floatError;
+      break;
+
+    case OpCode::applyDouble:
+      // The operands' errors may compound as well as add up
+      top[-1] = instruction.expression.errorGain * (top[-1] + top[0] + top[-1] * top[0])
+        + instruction.expression.floatError;
+      top--;
+      break;
+    }
+  }
+
+  return *top;
+}
+
+template <class Number, bool timed> void ExpressionProgram::runSpans(const Number* const* variables,
+  Number* output, std::size_t count, std::vector<Number>& workspace, OperatorProfile* profiles) const {
+  // One plane of batchSize values for each stack position
+  workspace.resize(requiredStack * batchSize);
+
+  // Each stack entry points either to a variable's span or to its own plane in the workspace
+  const Number* localStack[maxStackSize];
+  std::vector<const Number*> heapStack;
+  const Number** stack = stackFor(localStack, heapStack);
+
+  for (std::size_t offset = 0; offset < count; offset += batchSize) {
+    std::size_t span = std::min(batchSize, count - offset);
+
+    // Position of the top value in the stack
+    std::size_t top = -1;
+
+    for (const auto& instruction : code) {
+      std::chrono::steady_clock::time_point start;
+      if constexpr (timed) start = std::chrono::steady_clock::now();
+
+      switch (instruction.code) {
+      case OpCode::pushVariable:
+        // Variables are read in place
+        stack[++top] = variables[instruction.expression.variableIndex] + offset;
+        break;
+
+      case OpCode::pushConstant: {
+        Number* plane = workspace.data() + ++top * batchSize;
+        std::fill(plane, plane + span, Number(instruction.constant));
+        stack[top] = plane;
+        break;
+      }
+
+      case OpCode::applySingle: {
+        Number* plane = workspace.data() + top * batchSize;
+        if constexpr (std::is_same<Number, float>::value)
+          instruction.expression.singleFloatBatchFunction(stack[top], plane, span);
+        else
+          instruction.expression.singleBatchFunction(stack[top], plane, span);
+        stack[top] = plane;
+        break;
+      }
+
+      case OpCode::applyDouble: {
+        Number* plane = workspace.data() + --top * batchSize;
+        if constexpr (std::is_same<Number, float>::value)
+          instruction.expression.doubleFloatBatchFunction(stack[top], stack[top + 1], plane, span);
+        else
+          instruction.expression.doubleBatchFunction(stack[top], stack[top + 1], plane, span);
+        stack[top] = plane;
+        break;
+      }
+      }
+
+      if constexpr (timed) {
+        auto& profile = profiles[std::uint8_t(instruction.expression.characterRepresentation)];
+        profile.values += span;
+        profile.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      }
+    }
+
+    std::memcpy(output + offset, stack[top], span * sizeof(Number));
+  }
+}
+
+void ExpressionProgram::profile(const double* const* variables, double* output, std::size_t count,
+  std::vector<double>& workspace, OperatorProfile* profiles) const {
+  runSpans<double, true>(variables, output, count, workspace, profiles);
+}
@@ -5,133 +5,506 @@
 #include <vector>
 #include <algorithm>
 #include <functional>
-#include <random>
 
 // Used when constructing nodes
 struct WeightedMaker {
-  ExpressionTree::nodeMaker maker;
+  ExpressionTree::NodeKind maker;
   double weight;
-  WeightedMaker(ExpressionTree::nodeMaker maker, double weight) : maker(maker), weight(weight) {}
+  WeightedMaker(ExpressionTree::NodeKind maker, double weight) : maker(maker), weight(weight) {}
+};
+
+// A node being grown
+struct GrowingNode {
+  // Depth left below it
+  std::size_t remainingDepth;
+  // Its kind, once drawn
+  ExpressionTree::NodeKind kind;
+  // Whether its kind has been drawn yet
+  bool drawn;
+  // Children yet to be grown
+  std::size_t childrenLeft;
+};
+
+// A node being compiled, along with how many of its children already were
+struct CompilingNode {
+  ExpressionNode* node;
+  std::size_t childrenDone;
 };
 
 // local functions
 
-// Randomly selects one of the nodeMaker attributes from the struct in the vector, weighted by the struct's weight
-static ExpressionTree::nodeMaker randomWeightedMaker(std::vector<WeightedMaker>, std::default_random_engine&);
+// Randomly selects one of the node kinds from the struct in the vector, weighted by the struct's weight
+static ExpressionTree::NodeKind randomWeightedMaker(std::vector<WeightedMaker>, SplitMix64&);
 // Simply returns a random index that is valid for the provided vector
-template <class T> static int randomIndex(std::vector<T>& container, std::default_random_engine& engine);
+template <class T> static int randomIndex(std::vector<T>& container, SplitMix64& engine);
 
 void ExpressionTree::init(std::vector<char> variables, unsigned int seed) {
-  setVariables(variables);
-  setSeed(seed);
-  ExpressionFactory::populateExpressions(singleExpressions, doubleExpressions);
+  GenerationContext& context = *GenerationContext::standard();
+  context.variables = variables;
+  context.randomEngine.seed(seed);
 }
 
 //////////////////////////////// TREE BUILDING
 
 void ExpressionTree::build() {
+  // Releases the previous tree's nodes all at once
+  arena.clear();
+
   if (depth > 0) head = grow(depth - 1);
   else {
     // Creates a node that always evaluates to 0
-    head = std::make_unique<NullNode>();
-  }
-}
-
-std::unique_ptr<ExpressionNode> ExpressionTree::grow(std::size_t remainingDepth) {
-  // DEBUG
-  // std::cout << "Growing layer " << remainingDepth << std::endl;
-  // If this is the bottom of the tree, always makes a leaf node
-  if (remainingDepth == 0) return makeLeafExpression(remainingDepth);
-  // Gets random node maker, weighted by node type probabilities for current depth
-  auto maker = randomWeightedMaker({
-    WeightedMaker(&ExpressionTree::makeLeafExpression, leafLikelihood(remainingDepth)),
-    WeightedMaker(&ExpressionTree::makeSingleExpression, singleBranchLikelihood(remainingDepth)),
-    WeightedMaker(&ExpressionTree::makeDoubleExpression, doubleBranchLikelihood(remainingDepth))
-    },
-    randomEngine
-  );
+    head = arena.make<NullNode>();
+  }
+
+  compile();
+}
+
+ExpressionNode* ExpressionTree::grow(std::size_t remainingDepth, std::size_t keptNodes, double keptCost) {
+  // Reused by every build on this thread, so that they are only allocated once
+  thread_local std::vector<GrowingNode> growing;
+  thread_local std::vector<ExpressionNode*> grown;
+  growing.clear();
+  grown.clear();
+
+  // Nodes made or waiting to be, which only ever underestimates the final size
+  std::size_t committed = keptNodes + 1;
+
+  // Cost of the nodes made or waiting to be, which are counted as leaves until drawn otherwise and then as their
+  // kind's dearest expression, so that it only ever overestimates the final cost
+  double leafCost = ExpressionProgram::instructionCost, singleCost = 0.0, doubleCost = 0.0;
+  for (const auto& expression : context->singleExpressions) singleCost = std::max(singleCost, expression.cost);
+  for (const auto& expression : context->doubleExpressions) doubleCost = std::max(doubleCost, expression.cost);
+  double committedCost = keptCost + leafCost;
+  growing.push_back({ remainingDepth, NodeKind::leaf, false, 0 });
+
+  while (!growing.empty()) {
+    GrowingNode& node = growing.back();
+
+    if (!node.drawn) {
+      node.drawn = true;
+
+      // The bottom of the tree is always made of leaf nodes. Elsewhere gets a random kind, weighted by node type
+      // probabilities for current depth
+      if (node.remainingDepth > 0) {
+        node.kind = randomWeightedMaker({
+          WeightedMaker(NodeKind::leaf, leafLikelihood(node.remainingDepth)),
+          WeightedMaker(NodeKind::singleBranch, singleBranchLikelihood(node.remainingDepth)),
+          WeightedMaker(NodeKind::doubleBranch, doubleBranchLikelihood(node.remainingDepth))
+          },
+          context->randomEngine
+        );
+      }
+
+      // Nodes get fewer children than drawn when there is no budget left for them
+      if (node.kind == NodeKind::doubleBranch
+        && (committed + 2 > nodeBudget || committedCost + doubleCost + 2 * leafCost > costBudget))
+        node.kind = NodeKind::singleBranch;
+      if (node.kind == NodeKind::singleBranch
+        && (committed + 1 > nodeBudget || committedCost + singleCost + leafCost > costBudget))
+        node.kind = NodeKind::leaf;
+
+      node.childrenLeft = node.kind == NodeKind::doubleBranch ? 2 : node.kind == NodeKind::singleBranch ? 1 : 0;
+      committed += node.childrenLeft;
+      committedCost += node.childrenLeft * leafCost
+        + (node.kind == NodeKind::doubleBranch ? doubleCost : node.kind == NodeKind::singleBranch ? singleCost : 0.0);
+    }
+
+    // Children are grown one at a time, each before the next one is drawn
+    if (node.childrenLeft > 0) {
+      node.childrenLeft--;
+      std::size_t childDepth = node.remainingDepth - 1;
+      growing.push_back({ childDepth, NodeKind::leaf, false, 0 });
+      continue;
+    }
+
+    // Every child is done, so the node's expression is drawn and the node made out of them
+    if (node.kind == NodeKind::leaf) grown.push_back(arena.make<LeafNode>(context->variables, context->randomEngine));
+    else if (node.kind == NodeKind::singleBranch) {
+      ExpressionNode* child = grown.back();
+      grown.back() = arena.make<SingleNode>(context->singleExpressions, context->randomEngine, child);
+    }
+    else {
+      ExpressionNode* child2 = grown.back();
+      grown.pop_back();
+      ExpressionNode* child1 = grown.back();
+      grown.back() = arena.make<DoubleNode>(context->doubleExpressions, context->randomEngine, child1, child2);
+    }
+
+    growing.pop_back();
+  }
+
+  return grown.back();
+}
+
+void ExpressionTree::compile() {
+  thread_local std::vector<CompilingNode> compiling;
+  compiling.clear();
+  program.clear();
+  nodes.clear();
+
+  compiling.push_back({ head, 0 });
+  while (!compiling.empty()) {
+    CompilingNode& current = compiling.back();
+
+    if (current.childrenDone < current.node->childCount()) {
+      compiling.push_back({ current.node->childAt(current.childrenDone++), 0 });
+      continue;
+    }
+
+    current.node->emit(program);
+    nodes.push_back(current.node);
+    compiling.pop_back();
+  }
+
+  measure();
+}
+
+void ExpressionTree::measure() {
+  // Measures the tree from its program, where each value stands for the node that gave it, along with its depth
+  thread_local std::vector<std::size_t> values, depths;
+  values.clear();
+  depths.clear();
+
+  nodeCount = program.size();
+  parents.resize(nodeCount);
+  subtreeSizes.resize(nodeCount);
+  levels.resize(nodeCount);
+
+  for (std::size_t node = 0; node < nodeCount; node++) {
+    const auto& instruction = program.instructions()[node];
+    subtreeSizes[node] = 1;
+
+    switch (instruction.code) {
+    case OpCode::pushVariable: depths.push_back(1); break;
+    // Constants only stand for empty trees
+    case OpCode::pushConstant: depths.push_back(0); break;
+    case OpCode::applySingle:
+      depths.back()++;
+      parents[values.back()] = node;
+      subtreeSizes[node] += subtreeSizes[values.back()];
+      values.pop_back();
+      break;
+    case OpCode::applyDouble: {
+      std::size_t second = depths.back();
+      depths.pop_back();
+      depths.back() = 1 + std::max(depths.back(), second);
+
+      for (int operand = 0; operand < 2; operand++) {
+        parents[values.back()] = node;
+        subtreeSizes[node] += subtreeSizes[values.back()];
+        values.pop_back();
+      }
+      break;
+    }
+    }
+
+    values.push_back(node);
+  }
+
+  treeDepth = depths.back();
+
+  // Parents come after their children, so levels are worked out from the head down
+  parents[nodeCount - 1] = nodeCount - 1;
+  for (std::size_t node = nodeCount; node-- > 0;) levels[node] = node + 1 == nodeCount ? 0 : levels[parents[node]] + 1;
+}
+
+//////////////////////////////// TREE EDITING
+
+std::size_t ExpressionTree::replace(std::size_t node, const ExpressionTree& donor, std::size_t donorNode) {
+  if (node >= nodeCount || donorNode >= donor.nodeCount) throw std::domain_error("No such node");
+
+  // Copies the donor's subtree from its program, where it is the instructions that end at its node
+  return graft(node, makeNodes(donor.program, donorNode + 1 - donor.subtreeSizes[donorNode], donorNode));
+}
+
+std::size_t ExpressionTree::mutate(std::size_t node) {
+  if (node >= nodeCount) throw std::domain_error("No such node");
+
+  // Grows as much as building the tree would have left below the node
+  std::size_t remainingDepth = depth > levels[node] + 1 ? depth - 1 - levels[node] : 0;
+
+  // The nodes outside of the subtree stay, and so does their cost
+  double keptCost = program.cost();
+  for (std::size_t index = node + 1 - subtreeSizes[node]; index <= node; index++)
+    keptCost -= ExpressionProgram::cost(program.instructions()[index]);
+
+  return graft(node, grow(remainingDepth, nodeCount - subtreeSizes[node], keptCost));
+}
+
+std::size_t ExpressionTree::mutate() { return mutate(context->randomEngine.index(nodeCount)); }
+
+std::size_t ExpressionTree::crossover(const ExpressionTree& donor) {
+  std::size_t node = context->randomEngine.index(nodeCount);
+  return replace(node, donor, context->randomEngine.index(donor.nodeCount));
+}
+
+std::size_t ExpressionTree::graft(std::size_t node, ExpressionNode* subtree) {
+  // Materializing keeps the program, so the node numbers stay the same
+  materialize();
+
+  // Nodes before the replaced subtree keep their numbers, so the new one starts where the old one did
+  std::size_t first = node + 1 - subtreeSizes[node];
+
+  if (node + 1 == nodeCount) head = subtree;
+  else {
+    ExpressionNode* parent = nodes[parents[node]];
+    parent->setChild(parent->childAt(0) == nodes[node] ? 0 : 1, subtree);
+  }
+
+  compile();
+
+  while (nodes[first] != subtree) first++;
 
-  // Calls the randomly selected maker and returns its resulting node
-  return (this->*maker)(remainingDepth);
+  // Once the nodes left behind outnumber the tree's, the arena is refilled with the tree's alone. The program is
+  // the same, and so are the node numbers
+  if (arena.size() > 2 * nodeCount) {
+    arena.clear();
+    head = nullptr;
+    materialize();
+  }
+
+  return first;
+}
+
+ExpressionNode* ExpressionTree::makeNodes(const ExpressionProgram& source, std::size_t first, std::size_t last) {
+  thread_local std::vector<ExpressionNode*> made;
+  made.clear();
+  const auto& instructions = source.instructions();
+
+  for (std::size_t index = first; index <= last; index++) {
+    const Instruction& instruction = instructions[index];
+
+    switch (instruction.code) {
+    case OpCode::pushVariable:
+      made.push_back(arena.make<LeafNode>(instruction.expression.variableIndex,
+        instruction.expression.characterRepresentation));
+      break;
+    case OpCode::pushConstant: made.push_back(arena.make<NullNode>()); break;
+    case OpCode::applySingle: made.back() = arena.make<SingleNode>(instruction.expression, made.back()); break;
+    case OpCode::applyDouble: {
+      ExpressionNode* child2 = made.back();
+      made.pop_back();
+      made.back() = arena.make<DoubleNode>(instruction.expression, made.back(), child2);
+      break;
+    }
+    }
+  }
+
+  return made.back();
+}
+
+void ExpressionTree::materialize() {
+  if (head) return;
+
+  head = makeNodes(program, 0, nodeCount - 1);
+  compile();
 }
 
 /////////////////////////////// TREE EVALUATING
 
 double ExpressionTree::plugVariables(std::vector<double> variables) const {
-  return head->evaluate(variables);
+  return program.run(variables.data());
 }
 
 std::ostream& operator<<(std::ostream& out, const ExpressionTree& tree) {
-  out << tree.head->toString();
+  // The program already holds the spec's characters in order, so they are gathered a chunk at a time
+  char chunk[4096];
+  std::size_t filled = 0;
+
+  for (const auto& instruction : tree.program.instructions()) {
+    if (filled == sizeof(chunk)) {
+      out.write(chunk, filled);
+      filled = 0;
+    }
+    chunk[filled++] = instruction.code == OpCode::pushConstant ? '0' : instruction.expression.characterRepresentation;
+  }
 
+  out.write(chunk, filled);
   return out;
 }
 
 std::istream& operator>>(std::istream& in, ExpressionTree& tree) {
+  // Reused by every read on this thread, so that its stack is only allocated once
+  thread_local SpecReader reader;
+
   char expression;
 
   // Discard empty spaces
   while (in.get(expression) && isspace(expression));
 
+  // Releases the previous tree's nodes, as the new ones go into the same arena
+  tree.arena.clear();
+
   // If there's still content left
   if (in) {
-    // Structure that builds the tree from the characters read
-    SpecReader reader(tree);
-
-    do {
-      // std::cout << expression << std::endl;
-      reader.read(expression);
-    } while (in.get(expression) && !isspace(expression));
-
-    // If read a whitespace, puts it back in
-    if (in) in.unget();
-
-    // Updates the tree to read spec
-    tree.head.reset(reader.assembleTree());
+    try {
+      // Builds the tree from the characters read
+      reader.start(tree);
+
+      do {
+        // std::cout << expression << std::endl;
+        reader.read(expression);
+      } while (in.get(expression) && !isspace(expression));
+
+      // If read a whitespace, puts it back in
+      if (in) in.unget();
+
+      // Updates the tree to read spec
+      tree.head = reader.assembleTree();
+    }
+    catch (...) {
+      // A spec that cannot be read leaves an empty tree behind
+      tree.arena.clear();
+      tree.head = tree.arena.make<NullNode>();
+      tree.compile();
+      throw;
+    }
+
+    tree.compile();
 
     // Updates tree's depth
     tree.adjustDepth();
   }
   else {
     // If spec is empty, so shall be the tree
-    tree.head = std::make_unique<NullNode>();
+    tree.head = tree.arena.make<NullNode>();
+    tree.compile();
   }
 
   return in;
 }
 
+bool ExpressionTree::read(const char* spec, std::size_t length, std::size_t& errorPosition, const char*& error) {
+  thread_local SpecReader reader;
+
+  arena.clear();
+  reader.start(*this);
+  error = nullptr;
+
+  for (std::size_t position = 0; position < length; position++) {
+    auto status = reader.push(spec[position]);
+    if (status == SpecReader::accepted) continue;
+
+    errorPosition = position;
+    error = status == SpecReader::unknownExpression ? "No such expression" : "Expression is missing operands";
+    break;
+  }
+
+  // Takes the tree, unless the spec was already found wrong
+  head = reader.finish();
+  if (error) head = nullptr;
+  else if (!head) {
+    errorPosition = length;
+    error = length == 0 ? "Empty spec" : "Spec leaves more than one expression";
+  }
+
+  if (!head) {
+    arena.clear();
+    head = arena.make<NullNode>();
+    compile();
+    return false;
+  }
+
+  compile();
+  adjustDepth();
+  return true;
+}
+
+void ExpressionTree::encode(std::string& code) const {
+  for (const auto& instruction : program.instructions()) {
+    std::size_t index = 0;
+
+    if (instruction.code == OpCode::pushVariable) index = instruction.expression.variableIndex;
+    else if (instruction.code != OpCode::pushConstant) {
+      const auto& expressions = instruction.code == OpCode::applySingle ? context->singleExpressions
+        : context->doubleExpressions;
+      while (expressions[index].characterRepresentation != instruction.expression.characterRepresentation) index++;
+    }
+
+    if (index >= 64) throw std::length_error("Too many expressions to encode");
+    code.push_back(char(std::uint8_t(instruction.code) << 6 | index));
+  }
+}
+
+bool ExpressionTree::decode(const unsigned char* code, std::size_t count) {
+  arena.clear();
+  program.clear();
+  nodes.clear();
+  head = nullptr;
+
+  const GenerationContext& tables = *context;
+  std::size_t height = 0;
+  bool valid = count > 0;
+
+  for (std::size_t position = 0; position < count && valid; position++) {
+    std::size_t index = code[position] & 63;
+
+    switch (OpCode(code[position] >> 6)) {
+    case OpCode::pushVariable:
+      valid = index < tables.variables.size();
+      if (valid) program.emitVariable(Expression(tables.variables[index], int(index)));
+      height++;
+      break;
+    // Constants only stand for empty trees
+    case OpCode::pushConstant:
+      valid = index == 0 && count == 1;
+      if (valid) program.emitConstant(-1);
+      height++;
+      break;
+    case OpCode::applySingle:
+      valid = index < tables.singleExpressions.size() && height >= 1;
+      if (valid) program.emitSingle(tables.singleExpressions[index]);
+      break;
+    case OpCode::applyDouble:
+      valid = index < tables.doubleExpressions.size() && height >= 2;
+      if (valid) program.emitDouble(tables.doubleExpressions[index]);
+      height--;
+      break;
+    }
+  }
+
+  if (!valid || height != 1) {
+    program.clear();
+    program.emitConstant(-1);
+    measure();
+    return false;
+  }
+
+  measure();
+  adjustDepth();
+  return true;
+}
+
 /////////////////////////////// PROBABILITY STUFF
 
 bool ExpressionTree::likelihood(double chance) {
-  // Gets a random number between 0 and 100
-  std::uniform_real_distribution<double> continuousCoin(0, 1);
-
-  return continuousCoin(randomEngine) < chance;
+  // Gets a random number between 0 and 1
+  return context->randomEngine.uniform() < chance;
 }
 
 //////////////////////////////// NODE INITIALIZERS
 
-LeafNode::LeafNode(std::vector<char>& variableRepresentations, std::default_random_engine& engine) {
+LeafNode::LeafNode(std::vector<char>& variableRepresentations, SplitMix64& engine) {
   // Grabs a random index from the vector
   int variableIndex = randomIndex<char>(variableRepresentations, engine);
   expression = Expression(variableRepresentations[variableIndex], variableIndex);
 }
 
-SingleNode::SingleNode(std::vector<Expression>& availableExpressions, std::default_random_engine& engine,
-  std::unique_ptr<ExpressionNode> child
-) : child(child.release()) {
+SingleNode::SingleNode(std::vector<Expression>& availableExpressions, SplitMix64& engine,
+  ExpressionNode* child
+) : child(child) {
   expression = availableExpressions[randomIndex<Expression>(availableExpressions, engine)];
 }
 
-DoubleNode::DoubleNode(std::vector<Expression>& availableExpressions, std::default_random_engine& engine,
-  std::unique_ptr<ExpressionNode> child1, std::unique_ptr<ExpressionNode> child2
-) : child1(child1.release()), child2(child2.release()) {
+DoubleNode::DoubleNode(std::vector<Expression>& availableExpressions, SplitMix64& engine,
+  ExpressionNode* child1, ExpressionNode* child2
+) : child1(child1), child2(child2) {
   expression = availableExpressions[randomIndex<Expression>(availableExpressions, engine)];
 }
 
 /////////////////////////////// LOCAL FUNCTIONS
 
-static ExpressionTree::nodeMaker randomWeightedMaker(std::vector<WeightedMaker> makers, std::default_random_engine& engine) {
+static ExpressionTree::NodeKind randomWeightedMaker(std::vector<WeightedMaker> makers, SplitMix64& engine) {
   // Gets total sum of weights
   double totalWeight = 0.0;
   for (auto maker : makers) totalWeight += maker.weight;
@@ -142,8 +515,7 @@ static ExpressionTree::nodeMaker randomWeightedMaker(std::vector<WeightedMaker>
   );
 
   // Gets random value in [0, totalWeight) range
-  std::uniform_real_distribution<double> randomPoint(0, totalWeight);
-  double pointInWeightRange = randomPoint(engine);
+  double pointInWeightRange = engine.uniform() * totalWeight;
 
   // Finds out which maker got picked
   auto makerIterator = makers.begin();
@@ -153,8 +525,7 @@ static ExpressionTree::nodeMaker randomWeightedMaker(std::vector<WeightedMaker>
   return makerIterator->maker;
 }
 
-template <class T> static int randomIndex(std::vector<T>& container, std::default_random_engine& engine) {
+template <class T> static int randomIndex(std::vector<T>& container, SplitMix64& engine) {
   // Gets a random index
-  std::uniform_int_distribution<int> index(0, container.size() - 1);
-  return index(engine);
+  return int(engine.index(container.size()));
 }
\ No newline at end of file
@@ -0,0 +1,404 @@
+#include "../include/ImageWriter.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// local functions
+
+// The PPM header for an image of the given size
+static std::string ppmHeader(std::size_t width, std::size_t height);
+
+// Writes a PNG chunk: its length, type, data and checksum
+static void writeChunk(std::ostream& out, const char* type, const std::uint8_t* data, std::size_t length);
+
+// Writes a 32 bit number, most significant byte first
+static void writeNumber(std::ostream& out, std::uint32_t number);
+
+/////////////////////// PPM
+
+void writePPM(const std::string& path, const std::uint8_t* pixels, std::size_t width, std::size_t height) {
+  int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file < 0) throw std::runtime_error("Cannot open image " + path);
+
+  std::string header = ppmHeader(width, height);
+  iovec parts[] = { { (void*)header.data(), header.size() }, { (void*)pixels, width * height * 3 } };
+
+  // The system may take fewer bytes than asked, in which case the rest is handed over again
+  while (parts[1].iov_len > 0) {
+    ssize_t written = writev(file, parts[0].iov_len > 0 ? parts : parts + 1, parts[0].iov_len > 0 ? 2 : 1);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      close(file);
+      throw std::runtime_error("Cannot write image " + path);
+    }
+
+    for (auto& part : parts) {
+      std::size_t taken = std::min(part.iov_len, std::size_t(written));
+      part.iov_base = (std::uint8_t*)part.iov_base + taken;
+      part.iov_len -= taken;
+      written -= taken;
+    }
+  }
+
+  close(file);
+}
+
+StreamedPPM::StreamedPPM(const std::string& path, std::size_t width, std::size_t height)
+  : file(path, std::ios::binary), columns(width), remaining(height) {
+  if (!file) throw std::runtime_error("Cannot open image " + path);
+
+  std::string header = ppmHeader(width, height);
+  file.write(header.data(), header.size());
+}
+
+void StreamedPPM::append(const std::uint8_t* pixels, std::size_t rows) {
+  if (rows > remaining) throw std::length_error("More rows than the image has");
+  remaining -= rows;
+
+  file.write((const char*)pixels, rows * columns * 3);
+  if (remaining == 0) file.close();
+  if (!file) throw std::runtime_error("Cannot write image");
+}
+
+MappedPPM::MappedPPM(const std::string& path, std::size_t width, std::size_t height)
+  : columns(width), rows(height) {
+  if (width == 0 || height == 0) throw std::domain_error("Width and height must be greater than 0");
+
+  std::string header = ppmHeader(width, height);
+  headerSize = header.size();
+  size = headerSize + width * height * 3;
+
+  int file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (file < 0) throw std::runtime_error("Cannot open image " + path);
+
+  if (ftruncate(file, size) != 0) {
+    close(file);
+    throw std::runtime_error("Cannot size image " + path);
+  }
+
+  void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+  close(file);
+  if (mapping == MAP_FAILED) throw std::runtime_error("Cannot map image " + path);
+
+  data = (std::uint8_t*)mapping;
+  std::memcpy(data, header.data(), headerSize);
+}
+
+MappedPPM::~MappedPPM() {
+  munmap(data, size);
+}
+
+void MappedPPM::flush() {
+  if (msync(data, size, MS_SYNC) != 0) throw std::runtime_error("Cannot write image out");
+}
+
+/////////////////////// Y4M
+
+StreamedY4M::StreamedY4M(std::ostream& out, std::size_t width, std::size_t height, std::size_t framesPerSecond)
+  : out(&out), columns(width), rows(height) {
+  begin(framesPerSecond);
+}
+
+StreamedY4M::StreamedY4M(const std::string& path, std::size_t width, std::size_t height,
+  std::size_t framesPerSecond)
+  : out(&file), file(path, std::ios::binary), columns(width), rows(height) {
+  if (!file) throw std::runtime_error("Cannot open video " + path);
+  begin(framesPerSecond);
+}
+
+void StreamedY4M::begin(std::size_t framesPerSecond) {
+  if (columns == 0 || rows == 0) throw std::domain_error("Width and height must be greater than 0");
+  if (framesPerSecond == 0) throw std::domain_error("Frame rate must be greater than 0");
+
+  *out << "YUV4MPEG2 W" << columns << " H" << rows << " F" << framesPerSecond << ":1 Ip A1:1 C444\n";
+  planes.resize(columns * rows * 3);
+}
+
+void StreamedY4M::append(const std::uint8_t* pixels) {
+  std::size_t size = columns * rows;
+  std::uint8_t* luma = planes.data();
+  std::uint8_t* blue = luma + size;
+  std::uint8_t* red = blue + size;
+
+  // BT.601 in studio range, in 8 bit fixed point
+  for (std::size_t pixel = 0; pixel < size; pixel++) {
+    int r = pixels[pixel * 3], g = pixels[pixel * 3 + 1], b = pixels[pixel * 3 + 2];
+    luma[pixel] = std::uint8_t(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    blue[pixel] = std::uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+    red[pixel] = std::uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+  }
+
+  out->write("FRAME\n", 6);
+  out->write((const char*)planes.data(), planes.size());
+  out->flush();
+  if (!*out) throw std::runtime_error("Cannot write video");
+
+  frameCount++;
+}
+
+/////////////////////// PNG
+
+PngEncoder::PngEncoder(int level, std::size_t threadCount) : level(level) {
+  if (level < 0 || level > 9) throw std::domain_error("Compression level must be between 0 and 9");
+  this->threadCount(threadCount);
+}
+
+void PngEncoder::threadCount(std::size_t count) {
+  if (count == 0) throw std::domain_error("Thread count must be greater than 0");
+
+  if (count > 1) pool = std::make_unique<ThreadPool>(count);
+  else pool.reset();
+}
+
+void PngEncoder::begin(const std::string& path, std::size_t width, std::size_t height) {
+  file = std::ofstream(path, std::ios::binary);
+  if (!file) throw std::runtime_error("Cannot open image " + path);
+
+  begin(file, width, height);
+}
+
+void PngEncoder::begin(std::ostream& out, std::size_t width, std::size_t height) {
+  if (width == 0 || height == 0) throw std::domain_error("Width and height must be greater than 0");
+
+  this->out = &out;
+  columns = width;
+  rows = height;
+  rowsGiven = rowsEncoded = pendingRows = 0;
+  pending.resize(threadCount() * blockRows * width * 3);
+  lastRow.clear();
+  blocks.resize(threadCount());
+  dictionary.clear();
+
+  static const std::uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  out.write((const char*)signature, sizeof(signature));
+
+  // 8 bits per channel, RGB, no interlacing
+  std::uint8_t header[13] = {};
+  for (int byte = 0; byte < 4; byte++) {
+    header[byte] = std::uint8_t(width >> (24 - 8 * byte));
+    header[4 + byte] = std::uint8_t(height >> (24 - 8 * byte));
+  }
+  header[8] = 8;
+  header[9] = 2;
+  writeChunk(out, "IHDR", header, sizeof(header));
+
+  // The blocks' raw deflate streams are wrapped into a single zlib stream: a header, then the streams one
+  // after the other, then the checksum of everything they hold
+  static const std::uint8_t streamHeader[] = { 0x78, 0x01 };
+  writeChunk(out, "IDAT", streamHeader, sizeof(streamHeader));
+  checksum = adler32(0, nullptr, 0);
+}
+
+void PngEncoder::append(const std::uint8_t* pixels, std::size_t count) {
+  if (!out) throw std::logic_error("No image was begun");
+  if (count > rows - rowsGiven) throw std::length_error("More rows than the image has");
+  rowsGiven += count;
+
+  std::size_t length = columns * 3, waveRows = blocks.size() * blockRows;
+
+  while (count > 0) {
+    // Whole waves of blocks are encoded straight from the given rows
+    if (pendingRows == 0 && count >= waveRows) {
+      encode(pixels, waveRows);
+      pixels += waveRows * length;
+      count -= waveRows;
+      continue;
+    }
+
+    // Anything less waits until there are enough rows, or the image is over
+    std::size_t taken = std::min(count, waveRows - pendingRows);
+    std::memcpy(pending.data() + pendingRows * length, pixels, taken * length);
+    pendingRows += taken;
+    pixels += taken * length;
+    count -= taken;
+
+    if (pendingRows == waveRows) {
+      encode(pending.data(), pendingRows);
+      pendingRows = 0;
+    }
+  }
+
+  if (rowsGiven == rows && pendingRows > 0) {
+    encode(pending.data(), pendingRows);
+    pendingRows = 0;
+  }
+}
+
+void PngEncoder::encode(const std::uint8_t* pixels, std::size_t count) {
+  std::size_t length = columns * 3, rowSize = 1 + length;
+  std::size_t blockCount = (count + blockRows - 1) / blockRows;
+  bool finishing = rowsEncoded + count == rows;
+
+  // Rows are filtered from the unfiltered row above them, so any block can be filtered on its own
+  std::vector<ThreadPool::Task> tasks;
+  for (std::size_t slot = 0; slot < blockCount; slot++)
+    tasks.push_back([this, pixels, count, length, rowSize, slot]() {
+      std::size_t firstRow = slot * blockRows, blockLength = std::min(blockRows, count - firstRow);
+      const std::uint8_t* first = pixels + firstRow * length;
+      const std::uint8_t* above = slot > 0 ? first - length : lastRow.empty() ? nullptr : lastRow.data();
+      Block& block = blocks[slot];
+
+      block.filtered.resize(blockLength * rowSize);
+      filterRows(first, above, columns, blockLength, block.filtered.data());
+      block.checksum = adler32(adler32(0, nullptr, 0), block.filtered.data(), block.filtered.size());
+    });
+  run(tasks);
+
+  // Each block is primed with the end of the block before it, which the first one takes from the last encode
+  tasks.clear();
+  for (std::size_t slot = 0; slot < blockCount; slot++)
+    tasks.push_back([this, blockCount, finishing, slot]() {
+      const std::vector<std::uint8_t>& before = slot > 0 ? blocks[slot - 1].filtered : dictionary;
+      std::size_t primed = std::min(before.size(), windowSize);
+
+      compressBlock(blocks[slot], before.data() + before.size() - primed, primed, finishing && slot + 1 == blockCount);
+    });
+  run(tasks);
+
+  for (std::size_t slot = 0; slot < blockCount; slot++) {
+    const Block& block = blocks[slot];
+    writeChunk(*out, "IDAT", block.compressed.data(), block.compressed.size());
+    checksum = adler32_combine(checksum, block.checksum, block.filtered.size());
+  }
+
+  const std::vector<std::uint8_t>& last = blocks[blockCount - 1].filtered;
+  dictionary.assign(last.end() - std::min(last.size(), windowSize), last.end());
+  lastRow.assign(pixels + (count - 1) * length, pixels + count * length);
+  rowsEncoded += count;
+
+  if (!finishing) {
+    if (!*out) throw std::runtime_error("Cannot write image");
+    return;
+  }
+
+  std::uint8_t trailer[] = {
+    std::uint8_t(checksum >> 24), std::uint8_t(checksum >> 16), std::uint8_t(checksum >> 8), std::uint8_t(checksum)
+  };
+  writeChunk(*out, "IDAT", trailer, sizeof(trailer));
+  writeChunk(*out, "IEND", nullptr, 0);
+
+  bool written = bool(*out);
+  if (file.is_open()) {
+    file.close();
+    written = written && bool(file);
+  }
+  out = nullptr;
+
+  if (!written) throw std::runtime_error("Cannot write image");
+}
+
+void PngEncoder::compressBlock(Block& block, const std::uint8_t* dictionary, std::size_t dictionarySize,
+  bool last) const {
+  z_stream stream = {};
+  // Negative window bits make a raw deflate stream, with no header or checksum of its own
+  if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::runtime_error("Cannot start compressing image");
+
+  if (dictionarySize > 0) deflateSetDictionary(&stream, dictionary, dictionarySize);
+
+  // Room for the worst case, plus the empty block that ends a sync flush
+  block.compressed.resize(deflateBound(&stream, block.filtered.size()) + 16);
+  stream.next_in = block.filtered.data();
+  stream.avail_in = block.filtered.size();
+  stream.next_out = block.compressed.data();
+  stream.avail_out = block.compressed.size();
+
+  // Only the last block finishes the stream. The others end on a byte boundary, so the next can follow them
+  int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+  bool complete = last ? status == Z_STREAM_END : status == Z_OK && stream.avail_in == 0;
+
+  block.compressed.resize(block.compressed.size() - stream.avail_out);
+  deflateEnd(&stream);
+
+  if (!complete) throw std::runtime_error("Cannot compress image");
+}
+
+void PngEncoder::run(std::vector<ThreadPool::Task>& tasks) {
+  if (pool) pool->run(tasks);
+  else for (auto& task : tasks) task();
+}
+
+void PngEncoder::filterRows(const std::uint8_t* pixels, const std::uint8_t* above, std::size_t width, std::size_t rows,
+  std::uint8_t* filtered) {
+  std::size_t length = width * 3;
+  // The row being filtered and the one above it, each behind a pixel of zeros, so that every byte has a left
+  // and an upper left neighbor and the loops below need no special case
+  std::vector<std::uint8_t> padded(2 * (length + 3), 0);
+  std::uint8_t* current = padded.data() + 3;
+  std::uint8_t* previous = padded.data() + length + 6;
+  // Each candidate filter's output for the current row
+  std::vector<std::uint8_t> candidates(5 * length);
+
+  for (std::size_t row = 0; row < rows; row++, filtered += 1 + length) {
+    std::memcpy(current, pixels + row * length, length);
+    if (row > 0) std::memcpy(previous, pixels + (row - 1) * length, length);
+    else if (above) std::memcpy(previous, above, length);
+
+    // Tries all five filters
+    std::uint8_t* none = candidates.data();
+    std::uint8_t* sub = none + length;
+    std::uint8_t* up = sub + length;
+    std::uint8_t* average = up + length;
+    std::uint8_t* paeth = average + length;
+
+    for (std::size_t index = 0; index < length; index++) {
+      int left = current[index - 3], upper = previous[index], upperLeft = previous[index - 3];
+
+      // Paeth picks whichever of left, upper and upper left is closest to left + upper - upperLeft
+      int toLeft = std::abs(upper - upperLeft), toUpper = std::abs(left - upperLeft);
+      int toUpperLeft = std::abs(left + upper - 2 * upperLeft);
+      int predicted = toLeft <= toUpper && toLeft <= toUpperLeft ? left : toUpper <= toUpperLeft ? upper : upperLeft;
+
+      none[index] = current[index];
+      sub[index] = std::uint8_t(current[index] - left);
+      up[index] = std::uint8_t(current[index] - upper);
+      average[index] = std::uint8_t(current[index] - (left + upper) / 2);
+      paeth[index] = std::uint8_t(current[index] - predicted);
+    }
+
+    // Keeps the filter whose output, read as signed bytes, is smallest, which tends to deflate best
+    std::size_t best = 0, bestCost = SIZE_MAX;
+    for (std::size_t filter = 0; filter < 5; filter++) {
+      const std::int8_t* output = (const std::int8_t*)candidates.data() + filter * length;
+      std::size_t cost = 0;
+      for (std::size_t index = 0; index < length; index++) cost += std::abs(int(output[index]));
+
+      if (cost < bestCost) {
+        best = filter;
+        bestCost = cost;
+      }
+    }
+
+    filtered[0] = std::uint8_t(best);
+    std::memcpy(filtered + 1, candidates.data() + best * length, length);
+  }
+}
+
+/////////////////////////////// LOCAL FUNCTIONS
+
+static std::string ppmHeader(std::size_t width, std::size_t height) {
+  return "P6 " + std::to_string(width) + " " + std::to_string(height) + " 255\n";
+}
+
+static void writeChunk(std::ostream& out, const char* type, const std::uint8_t* data, std::size_t length) {
+  writeNumber(out, std::uint32_t(length));
+  out.write(type, 4);
+  if (length > 0) out.write((const char*)data, length);
+
+  // The checksum covers the type and the data
+  uLong checksum = crc32(0, (const Bytef*)type, 4);
+  if (length > 0) checksum = crc32(checksum, data, length);
+  writeNumber(out, std::uint32_t(checksum));
+}
+
+static void writeNumber(std::ostream& out, std::uint32_t number) {
+  char bytes[] = { char(number >> 24), char(number >> 16), char(number >> 8), char(number) };
+  out.write(bytes, 4);
+}
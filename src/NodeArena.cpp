@@ -0,0 +1,27 @@
+#include "../include/NodeArena.hpp"
+#include <algorithm>
+
+std::size_t NodeArena::capacity() const {
+  std::size_t total = 0;
+  for (const auto& block : blocks) total += block.size;
+  return total;
+}
+
+void* NodeArena::allocateInNextBlock(std::size_t size) {
+  // Skips the current block unless nothing was ever allocated
+  if (currentBlock < blocks.size()) currentBlock++;
+
+  // Skips kept blocks that are too small for the object
+  while (currentBlock < blocks.size() && blocks[currentBlock].size < size) currentBlock++;
+
+  if (currentBlock == blocks.size()) {
+    std::size_t blockSize = blocks.empty() ? firstBlockSize : blocks.back().size * 2;
+    blockSize = std::max(blockSize, size);
+
+    // new char[] memory is aligned for any fundamental type, which covers every node
+    blocks.push_back(Block{ std::unique_ptr<char[]>(new char[blockSize]), blockSize });
+  }
+
+  offset = size;
+  return blocks[currentBlock].memory.get();
+}
@@ -0,0 +1,182 @@
+#include "../include/PlaneCache.hpp"
+#include <algorithm>
+#include <cstring>
+
+// Marks the operands nodes do not have
+static constexpr std::size_t none = std::size_t(-1);
+
+std::size_t PlaneCache::run(const std::vector<const ExpressionProgram*>& programs, const double* const* variables,
+  double* const* outputs, std::size_t count, ThreadPool* pool) {
+  if (count != values) {
+    clear();
+    values = count;
+  }
+
+  for (auto& node : nodes) node.second.used = false;
+
+  // The entry of each instruction of each program
+  std::vector<std::vector<Entry*>> entries(programs.size());
+  std::size_t stackSize = 0;
+  for (std::size_t index = 0; index < programs.size(); index++) {
+    identify(*programs[index], entries[index]);
+    stackSize = std::max(stackSize, programs[index]->stackSize());
+  }
+
+  // Nodes no program has any longer make room for the new ones. Their parents are gone as well, so no key is left
+  // with the id of a node dropped
+  for (auto node = nodes.begin(); node != nodes.end();) {
+    if (node->second.used) node++;
+    else {
+      if (!node->second.values.empty()) planes--;
+      node = nodes.erase(node);
+    }
+  }
+
+  scratch.resize(stackSize * count);
+  std::size_t evaluated = 0;
+
+  for (std::size_t index = 0; index < programs.size(); index++) {
+    const auto& code = programs[index]->instructions();
+    const auto& programEntries = entries[index];
+
+    // Walks back from the head to find which nodes must be evaluated: those whose values are needed but not kept.
+    // Backwards, a node comes right before its second operand's subtree, which comes before its first one's
+    std::vector<char> needed(code.size()), evaluate(code.size());
+    std::vector<char> pending{ true };
+
+    for (std::size_t instruction = code.size(); instruction-- > 0;) {
+      needed[instruction] = pending.back();
+      pending.pop_back();
+
+      bool kept = code[instruction].code == OpCode::pushVariable || !programEntries[instruction]->values.empty();
+      evaluate[instruction] = needed[instruction] && !kept;
+
+      std::size_t operands = code[instruction].code == OpCode::applyDouble ? 2
+        : code[instruction].code == OpCode::applySingle ? 1 : 0;
+      for (std::size_t operand = 0; operand < operands; operand++) pending.push_back(evaluate[instruction]);
+    }
+
+    // Runs the program over whole planes, skipping the subtrees of kept nodes
+    std::vector<const double*> stack(std::max<std::size_t>(programs[index]->stackSize(), 1));
+    std::size_t top = -1;
+
+    for (std::size_t instruction = 0; instruction < code.size(); instruction++) {
+      if (!needed[instruction]) continue;
+
+      const Instruction& current = code[instruction];
+      Entry* entry = programEntries[instruction];
+
+      if (!evaluate[instruction]) {
+        stack[++top] = current.code == OpCode::pushVariable ? variables[current.expression.variableIndex]
+          : entry->values.data();
+        continue;
+      }
+
+      const double* first = nullptr;
+      const double* second = nullptr;
+      if (current.code == OpCode::applyDouble) second = stack[top--];
+      if (current.code != OpCode::pushConstant) first = stack[top--];
+
+      // A node met earlier in the same program was kept after its operands here were already evaluated
+      if (!entry->values.empty()) {
+        stack[++top] = entry->values.data();
+        continue;
+      }
+
+      double* plane;
+      if (bytes() + count * sizeof(double) <= budget) {
+        entry->values.resize(count);
+        planes++;
+        plane = entry->values.data();
+      }
+      // Over the budget, the node takes its stack position's scratch plane, which its first operand may be in
+      else plane = scratch.data() + (top + 1) * count;
+
+      apply(current, first, second, plane, pool);
+      evaluated++;
+      stack[++top] = plane;
+    }
+
+    if (code.size() > 0) std::memmove(outputs[index], stack[0], count * sizeof(double));
+  }
+
+  return evaluated;
+}
+
+void PlaneCache::clear() {
+  nodes.clear();
+  planes = 0;
+}
+
+void PlaneCache::identify(const ExpressionProgram& program, std::vector<Entry*>& entries) {
+  entries.clear();
+
+  // Ids of the values on the program's stack
+  std::vector<std::size_t> stack;
+
+  for (const auto& instruction : program.instructions()) {
+    NodeKey key{ instruction.code, instruction.expression.characterRepresentation, 0, { none, none } };
+
+    switch (instruction.code) {
+    case OpCode::pushVariable:
+      entries.push_back(nullptr);
+      stack.push_back(instruction.expression.variableIndex);
+      continue;
+
+    case OpCode::pushConstant:
+      std::memcpy(&key.value, &instruction.constant, sizeof(double));
+      break;
+
+    case OpCode::applySingle:
+      key.operands[0] = stack.back();
+      stack.pop_back();
+      break;
+
+    case OpCode::applyDouble:
+      key.operands[1] = stack.back();
+      stack.pop_back();
+      key.operands[0] = stack.back();
+      stack.pop_back();
+      break;
+    }
+
+    auto node = nodes.find(key);
+    if (node == nodes.end()) node = nodes.emplace(key, Entry{ nextId++, {}, false }).first;
+
+    node->second.used = true;
+    entries.push_back(&node->second);
+    stack.push_back(node->second.id);
+  }
+}
+
+void PlaneCache::apply(const Instruction& instruction, const double* first, const double* second, double* output,
+  ThreadPool* pool) const {
+  auto chunk = [&instruction, first, second, output](std::size_t offset, std::size_t count) {
+    switch (instruction.code) {
+    case OpCode::pushConstant:
+      std::fill(output + offset, output + offset + count, instruction.constant);
+      break;
+
+    case OpCode::applySingle:
+      instruction.expression.singleBatchFunction(first + offset, output + offset, count);
+      break;
+
+    case OpCode::applyDouble:
+      instruction.expression.doubleBatchFunction(first + offset, second + offset, output + offset, count);
+      break;
+
+    case OpCode::pushVariable:
+      break;
+    }
+  };
+
+  if (!pool || pool->size() == 1 || values <= chunkSize) {
+    chunk(0, values);
+    return;
+  }
+
+  std::vector<ThreadPool::Task> tasks;
+  for (std::size_t offset = 0; offset < values; offset += chunkSize)
+    tasks.push_back([&chunk, offset, this]() { chunk(offset, std::min(chunkSize, values - offset)); });
+  pool->run(tasks);
+}
@@ -0,0 +1,225 @@
+#include "../include/RenderCache.hpp"
+#include "../include/GenerationContext.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+
+// Expressions whose operands can be swapped without changing a single bit of their value
+static constexpr char commutativeExpressions[] = "*a";
+
+// local functions
+
+// FNV-1a hash of a string
+static std::uint64_t hashString(const std::string& text);
+
+// How many operands the expression a character represents takes, or -1 if it represents no expression
+static int operandCount(char representation);
+
+RenderCache::RenderCache(std::size_t byteBudget, std::string directory)
+  : budget(byteBudget), directory(directory) {
+  if (!directory.empty()) mkdir(directory.c_str(), 0755);
+}
+
+bool RenderCache::find(const std::string& spec, std::size_t width, std::size_t height, std::uint8_t* pixels,
+  const std::string& variant, const std::vector<char>& variables) {
+  std::string key = makeKey(spec, width, height, variant, variables);
+  std::uint64_t hash = hashString(key);
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  auto found = index.find(hash);
+  if (found != index.end() && found->second->key == key) {
+    // Moves the entry to the front, as the most recently used
+    entries.splice(entries.begin(), entries, found->second);
+    std::copy(found->second->pixels.begin(), found->second->pixels.end(), pixels);
+    counters.hits++;
+    return true;
+  }
+
+  Entry entry{ key, {} };
+  if (!directory.empty() && load(hash, entry, width, height)) {
+    std::copy(entry.pixels.begin(), entry.pixels.end(), pixels);
+    store(hash, std::move(entry));
+    counters.diskHits++;
+    return true;
+  }
+
+  counters.misses++;
+  return false;
+}
+
+void RenderCache::insert(const std::string& spec, std::size_t width, std::size_t height,
+  const std::uint8_t* pixels, const std::string& variant, const std::vector<char>& variables) {
+  Entry entry{ makeKey(spec, width, height, variant, variables),
+    std::vector<std::uint8_t>(pixels, pixels + width * height * 3) };
+  std::uint64_t hash = hashString(entry.key);
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  if (!directory.empty()) save(hash, entry, width, height);
+  store(hash, std::move(entry));
+}
+
+void RenderCache::clear() {
+  std::lock_guard<std::mutex> guard(lock);
+
+  entries.clear();
+  index.clear();
+  counters.entries = 0;
+  counters.bytes = 0;
+}
+
+void RenderCache::byteBudget(std::size_t budget) {
+  std::lock_guard<std::mutex> guard(lock);
+
+  this->budget = budget;
+  evict();
+}
+
+RenderCacheStats RenderCache::stats() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return counters;
+}
+
+void RenderCache::store(std::uint64_t hash, Entry entry) {
+  // Replaces whatever was held under the same hash, be it the same key or a colliding one
+  auto found = index.find(hash);
+  if (found != index.end()) {
+    counters.bytes -= entrySize(*found->second);
+    counters.entries--;
+    entries.erase(found->second);
+    index.erase(found);
+  }
+
+  // Images larger than the whole budget would only push everything else out and then go themselves
+  if (entrySize(entry) > budget) return;
+
+  counters.bytes += entrySize(entry);
+  counters.entries++;
+  entries.push_front(std::move(entry));
+  index[hash] = entries.begin();
+
+  evict();
+}
+
+void RenderCache::evict() {
+  while (counters.bytes > budget) {
+    auto& last = entries.back();
+    counters.bytes -= entrySize(last);
+    counters.entries--;
+    counters.evictions++;
+    index.erase(hashString(last.key));
+    entries.pop_back();
+  }
+}
+
+//////////////////////////////// DISK STORE
+
+// Images are stored as binary PPM files, with their key as a comment so that colliding hashes are told apart
+
+std::string RenderCache::path(std::uint64_t hash) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.ppm", (unsigned long long)hash);
+  return directory + "/" + name;
+}
+
+bool RenderCache::load(std::uint64_t hash, Entry& entry, std::size_t width, std::size_t height) const {
+  std::ifstream file(path(hash), std::ios::binary);
+  if (!file) return false;
+
+  std::string magic, comment;
+  std::size_t fileWidth = 0, fileHeight = 0, maximum = 0;
+  std::getline(file, magic);
+  std::getline(file, comment);
+  file >> fileWidth >> fileHeight >> maximum;
+  file.get();
+
+  if (!file || magic != "P6" || comment != "# " + entry.key || fileWidth != width || fileHeight != height
+    || maximum != 255)
+    return false;
+
+  entry.pixels.resize(width * height * 3);
+  file.read((char*)entry.pixels.data(), entry.pixels.size());
+  return bool(file);
+}
+
+void RenderCache::save(std::uint64_t hash, const Entry& entry, std::size_t width, std::size_t height) const {
+  std::string target = path(hash), temporary = target + ".tmp";
+
+  std::ofstream file(temporary, std::ios::binary);
+  file << "P6\n# " << entry.key << "\n" << width << " " << height << "\n255\n";
+  file.write((const char*)entry.pixels.data(), entry.pixels.size());
+  file.close();
+
+  // A cache that cannot write to disk still works from memory
+  if (!file || std::rename(temporary.c_str(), target.c_str()) != 0) std::remove(temporary.c_str());
+}
+
+//////////////////////////////// CANONICAL SPECS
+
+std::string RenderCache::makeKey(const std::string& spec, std::size_t width, std::size_t height,
+  const std::string& variant, const std::vector<char>& variables) {
+  std::string key = canonicalSpec(spec, variables);
+  std::replace(key.begin(), key.end(), '\n', ' ');
+  key += std::to_string(width) + "x" + std::to_string(height) + " " + std::string(variables.begin(), variables.end());
+  return variant.empty() ? key : key + " " + variant;
+}
+
+std::string RenderCache::canonicalSpec(const std::string& spec, const std::vector<char>& variables) {
+  std::istringstream lines(spec);
+  std::string line, canonical;
+
+  // The canonical form of each subtree on the line so far, in postfix like the spec
+  std::vector<std::string> stack;
+
+  while (lines >> line) {
+    stack.clear();
+
+    for (char representation : line) {
+      int operands = operandCount(representation);
+      if (operands < 0 && std::find(variables.begin(), variables.end(), representation) != variables.end())
+        operands = 0;
+      if (operands < 0) throw std::invalid_argument(std::string("No such expression or variable ") + representation);
+      if (stack.size() < std::size_t(operands)) throw std::invalid_argument("Bad spec syntax");
+
+      if (operands == 0) stack.emplace_back(1, representation);
+      else if (operands == 1) stack.back() += representation;
+      else {
+        std::string second = std::move(stack.back());
+        stack.pop_back();
+        std::string& first = stack.back();
+
+        if (std::strchr(commutativeExpressions, representation) && second < first) std::swap(first, second);
+        first += second;
+        first += representation;
+      }
+    }
+
+    if (stack.size() != 1) throw std::invalid_argument("Bad spec syntax");
+    canonical += stack.back() + "\n";
+  }
+
+  return canonical;
+}
+
+/////////////////////////////// LOCAL FUNCTIONS
+
+static std::uint64_t hashString(const std::string& text) {
+  std::uint64_t hash = 14695981039346656037ull;
+  for (unsigned char character : text) hash = (hash ^ character) * 1099511628211ull;
+  return hash;
+}
+
+static int operandCount(char representation) {
+  const auto& context = *GenerationContext::standard();
+
+  for (const auto& expression : context.singleExpressions)
+    if (expression.characterRepresentation == representation) return 1;
+  for (const auto& expression : context.doubleExpressions)
+    if (expression.characterRepresentation == representation) return 2;
+  return -1;
+}
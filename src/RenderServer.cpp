@@ -0,0 +1,535 @@
+#include "../include/RenderServer.hpp"
+#include "../Martist.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+constexpr double RenderServer::latencyBuckets[];
+
+// Names of the image formats, as requests give them
+static const char* formatNames[] = { "ppm", "png", "y4m" };
+
+// Reads and writes a socket through a buffer each way
+class SocketBuffer : public std::streambuf {
+public:
+  SocketBuffer(int socket) : socket(socket) {
+    setg(input, input, input);
+    setp(output, output + sizeof(output));
+  }
+
+  ~SocketBuffer() { sync(); }
+
+protected:
+  int_type underflow() override {
+    ssize_t received;
+    do received = recv(socket, input, sizeof(input), 0);
+    while (received < 0 && errno == EINTR);
+
+    if (received <= 0) return traits_type::eof();
+    setg(input, input, input + received);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  int_type overflow(int_type character) override {
+    if (sync() != 0) return traits_type::eof();
+    if (!traits_type::eq_int_type(character, traits_type::eof())) sputc(traits_type::to_char_type(character));
+    return traits_type::not_eof(character);
+  }
+
+  int sync() override {
+    const char* next = pbase();
+
+    while (next < pptr()) {
+      // A peer that went away is reported as a failed write rather than by a signal
+      ssize_t sent = send(socket, next, pptr() - next, MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR) continue;
+      if (sent <= 0) {
+        setp(output, output + sizeof(output));
+        return -1;
+      }
+      next += sent;
+    }
+
+    setp(output, output + sizeof(output));
+    return 0;
+  }
+
+private:
+  int socket;
+  char input[1 << 16];
+  char output[1 << 16];
+};
+
+// Writes to a stream in chunks, each one its length in hexadecimal and a newline followed by its bytes
+class ChunkBuffer : public std::streambuf {
+public:
+  ChunkBuffer(std::ostream& out) : out(out) { setp(chunk, chunk + sizeof(chunk)); }
+
+  // Writes what is left and the empty chunk that ends them
+  void finish() {
+    sync();
+    out << "0\n";
+    out.flush();
+  }
+
+protected:
+  int_type overflow(int_type character) override {
+    writeChunk();
+    if (!traits_type::eq_int_type(character, traits_type::eof())) sputc(traits_type::to_char_type(character));
+    return out ? traits_type::not_eof(character) : traits_type::eof();
+  }
+
+  int sync() override {
+    writeChunk();
+    out.flush();
+    return out ? 0 : -1;
+  }
+
+private:
+  void writeChunk() {
+    if (pptr() == pbase()) return;
+
+    char length[24];
+    std::snprintf(length, sizeof(length), "%zx\n", std::size_t(pptr() - pbase()));
+    out << length;
+    out.write(pbase(), pptr() - pbase());
+    setp(chunk, chunk + sizeof(chunk));
+  }
+
+  std::ostream& out;
+  char chunk[1 << 16];
+};
+
+// local functions
+
+// Opens a Unix domain socket with its address set to path. Throws std::runtime_error if it cannot
+static int openSocket(const std::string& path, sockaddr_un& address);
+
+//////////////////////////////// REQUESTS
+
+std::string RenderRequest::toLine() const {
+  std::ostringstream line;
+  line << "render width=" << width << " height=" << height << " format=" << formatNames[std::size_t(format)];
+
+  if (spec.empty()) line << " depth=" << depth << " seed=" << seed << " index=" << index;
+  else line << " spec=" << spec.size();
+
+  return line.str();
+}
+
+RenderRequest RenderRequest::fromLine(const std::string& line, std::size_t& specLength) {
+  std::istringstream fields(line);
+  std::string field;
+  RenderRequest request;
+  specLength = 0;
+
+  if (!(fields >> field) || field != "render") throw std::invalid_argument("Unknown request " + field);
+
+  while (fields >> field) {
+    auto equals = field.find('=');
+    if (equals == std::string::npos) throw std::invalid_argument("Field " + field + " has no value");
+    std::string name = field.substr(0, equals), value = field.substr(equals + 1);
+
+    if (name == "format") {
+      std::size_t format = 0;
+      while (format < 3 && value != formatNames[format]) format++;
+      if (format == 3) throw std::invalid_argument("No such format " + value);
+      request.format = ImageFormat(format);
+      continue;
+    }
+
+    // Every other field is a number
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+      throw std::invalid_argument("Field " + name + " must be a number");
+    std::uint64_t number = std::stoull(value);
+
+    if (name == "width") request.width = number;
+    else if (name == "height") request.height = number;
+    else if (name == "depth") request.depth = number;
+    else if (name == "seed") request.seed = number;
+    else if (name == "index") request.index = number;
+    else if (name == "spec") specLength = number;
+    else throw std::invalid_argument("No such field " + name);
+  }
+
+  if (specLength > RenderServer::longestSpec)
+    throw std::invalid_argument("Specs must be at most " + std::to_string(RenderServer::longestSpec) + " bytes");
+
+  if (request.width == 0 || request.height == 0 || request.width > RenderServer::largestSide
+    || request.height > RenderServer::largestSide)
+    throw std::invalid_argument("Images must be 1 to " + std::to_string(RenderServer::largestSide) + " pixels a side");
+  if (request.depth > RenderServer::deepestTree)
+    throw std::invalid_argument("Trees must be at most " + std::to_string(RenderServer::deepestTree) + " deep");
+  if (request.format == ImageFormat::y4m && (request.width % 2 || request.height % 2))
+    throw std::invalid_argument("Y4M images must have an even width and height");
+
+  return request;
+}
+
+//////////////////////////////// SERVER
+
+RenderServer::RenderServer(const std::string& socketPath, std::size_t threadCount, std::size_t batchSize)
+  : socketPath(socketPath), batchSize(std::max<std::size_t>(batchSize, 1)), pool(threadCount) {
+  sockaddr_un address;
+  listener = openSocket(socketPath, address);
+
+  // A socket left behind by a server that did not stop cleanly would keep this one from binding. Anything else
+  // there is left alone
+  struct stat status;
+  if (lstat(socketPath.c_str(), &status) == 0) {
+    if (!S_ISSOCK(status.st_mode)) {
+      close(listener);
+      throw std::runtime_error("Cannot listen at " + socketPath + ": it is not a socket");
+    }
+    unlink(socketPath.c_str());
+  }
+
+  if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+    close(listener);
+    throw std::runtime_error("Cannot listen at " + socketPath + ": " + std::strerror(errno));
+  }
+}
+
+RenderServer::~RenderServer() {
+  close(listener);
+  unlink(socketPath.c_str());
+}
+
+void RenderServer::serve() {
+  std::thread dispatcher(&RenderServer::dispatch, this);
+
+  while (!stopping) {
+    int connection = accept(listener, nullptr, nullptr);
+    if (connection < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+
+    timeval timeout{ sendTimeout, 0 };
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::lock_guard<std::mutex> guard(connectionLock);
+    if (stopping) {
+      close(connection);
+      break;
+    }
+
+    // Conversations that are over are only left to return, so joining them does not wait
+    for (auto id : finished) {
+      auto conversation = std::find_if(conversations.begin(), conversations.end(),
+        [id](const std::thread& thread) { return thread.get_id() == id; });
+      conversation->join();
+      *conversation = std::move(conversations.back());
+      conversations.pop_back();
+    }
+    finished.clear();
+
+    connections.insert(connection);
+    conversations.emplace_back(&RenderServer::converse, this, connection);
+  }
+
+  // Wakes the conversations up from reading their next request, and waits for them to answer what they had
+  {
+    std::lock_guard<std::mutex> guard(connectionLock);
+    for (int connection : connections) shutdown(connection, SHUT_RD);
+  }
+  for (auto& conversation : conversations) conversation.join();
+  conversations.clear();
+  finished.clear();
+
+  {
+    std::lock_guard<std::mutex> guard(queueLock);
+    drained = true;
+  }
+  queued.notify_all();
+  dispatcher.join();
+}
+
+void RenderServer::stop() {
+  if (stopping.exchange(true)) return;
+
+  // Wakes serve up from accepting
+  shutdown(listener, SHUT_RDWR);
+}
+
+std::size_t RenderServer::queueDepth() const {
+  std::lock_guard<std::mutex> guard(queueLock);
+  return queue.size();
+}
+
+void RenderServer::converse(int connection) {
+  {
+    SocketBuffer socket(connection);
+    std::istream in(&socket);
+    std::ostream out(&socket);
+    std::string line;
+
+    while (std::getline(in, line)) {
+      auto start = std::chrono::steady_clock::now();
+
+      if (line == "metrics") {
+        out << "OK 0\n";
+        ChunkBuffer chunks(out);
+        std::ostream text(&chunks);
+        text << metrics();
+        chunks.finish();
+        continue;
+      }
+
+      Job job;
+      job.out = &out;
+      job.queued = start;
+
+      try {
+        std::size_t specLength;
+        job.request = RenderRequest::fromLine(line, specLength);
+
+        job.request.spec.resize(specLength);
+        if (!in.read(&job.request.spec[0], specLength)) break;
+      }
+      catch (const std::exception& error) {
+        out << "ERROR " << error.what() << "\n";
+        out.flush();
+        recordLatency(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), true);
+        continue;
+      }
+
+      auto done = job.done.get_future();
+      {
+        std::lock_guard<std::mutex> guard(queueLock);
+        queue.push_back(&job);
+      }
+      queued.notify_one();
+
+      // The worker writes the response, so the connection waits for it before reading on
+      done.wait();
+      if (!out) break;
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(connectionLock);
+  connections.erase(connection);
+  close(connection);
+  finished.push_back(std::this_thread::get_id());
+}
+
+void RenderServer::dispatch() {
+  std::vector<Job*> batch;
+  std::vector<ThreadPool::Task> tasks;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> guard(queueLock);
+      queued.wait(guard, [this]() { return !queue.empty() || drained; });
+      if (queue.empty()) return;
+
+      // Takes whatever is waiting, up to a batch
+      batch.clear();
+      while (!queue.empty() && batch.size() < batchSize) {
+        batch.push_back(queue.front());
+        queue.pop_front();
+      }
+    }
+
+    tasks.clear();
+    for (Job* job : batch) tasks.push_back([this, job]() { paint(*job); });
+    pool.run(tasks);
+
+    std::lock_guard<std::mutex> guard(metricLock);
+    batches++;
+  }
+}
+
+void RenderServer::paint(Job& job) {
+  // Each worker keeps its martist and buffer, which are sized for the largest image it painted so far
+  thread_local std::vector<std::uint8_t> pixels;
+  thread_local std::unique_ptr<Martist> martist;
+  thread_local PngEncoder encoder;
+
+  const RenderRequest& request = job.request;
+  std::ostream& out = *job.out;
+  std::string spec;
+
+  try {
+    pixels.resize(request.width * request.height * 3);
+    if (!martist) martist = std::make_unique<Martist>(pixels.data(), request.width, request.height, 1, 1, 1);
+    else martist->changeBuffer(pixels.data(), request.width, request.height);
+
+    if (request.spec.empty()) {
+      martist->redDepth(request.depth);
+      martist->greenDepth(request.depth);
+      martist->blueDepth(request.depth);
+      martist->paint(request.seed, request.index);
+    }
+    else {
+      std::istringstream specStream(request.spec);
+      specStream >> *martist;
+    }
+
+    std::ostringstream painted;
+    painted << *martist;
+    spec = painted.str();
+  }
+  catch (const std::exception& error) {
+    out << "ERROR " << error.what() << "\n";
+    out.flush();
+    recordLatency(std::chrono::duration<double>(std::chrono::steady_clock::now() - job.queued).count(), true);
+    job.done.set_value();
+    return;
+  }
+
+  out << "OK " << spec.size() << "\n" << spec;
+
+  ChunkBuffer chunks(out);
+  std::ostream image(&chunks);
+
+  try {
+    switch (request.format) {
+    case ImageFormat::ppm:
+      image << "P6\n" << request.width << " " << request.height << "\n255\n";
+      image.write((const char*)pixels.data(), pixels.size());
+      break;
+
+    case ImageFormat::png:
+      encoder.write(image, pixels.data(), request.width, request.height);
+      break;
+
+    case ImageFormat::y4m: {
+      StreamedY4M video(image, request.width, request.height);
+      video.append(pixels.data());
+      break;
+    }
+    }
+
+    chunks.finish();
+  }
+  catch (const std::exception&) {
+    // Half of the image is already out, so all that is left to do is to drop the connection
+    out.setstate(std::ios::badbit);
+  }
+
+  recordLatency(std::chrono::duration<double>(std::chrono::steady_clock::now() - job.queued).count(), !out);
+  job.done.set_value();
+}
+
+void RenderServer::recordLatency(double seconds, bool failure) {
+  std::lock_guard<std::mutex> guard(metricLock);
+
+  answered++;
+  failed += failure;
+  latencySum += seconds;
+  for (std::size_t bucket = 0; bucket < latencyBucketCount; bucket++)
+    if (seconds <= latencyBuckets[bucket]) latencyCounts[bucket]++;
+}
+
+std::string RenderServer::metrics() const {
+  std::ostringstream out;
+  out.precision(9);
+
+  // Writes the help and type lines of a metric
+  auto declare = [&out](const char* name, const char* type, const char* help) {
+    out << "# HELP martist_" << name << " " << help << "\n# TYPE martist_" << name << " " << type << "\n";
+  };
+
+  declare("server_queue_depth", "gauge", "Requests waiting to be painted.");
+  out << "martist_server_queue_depth " << queueDepth() << "\n";
+
+  std::lock_guard<std::mutex> guard(metricLock);
+  declare("server_requests_total", "counter", "Requests answered, with an image or an error.");
+  out << "martist_server_requests_total " << answered << "\n";
+  declare("server_errors_total", "counter", "Requests answered with an error.");
+  out << "martist_server_errors_total " << failed << "\n";
+  declare("server_batches_total", "counter", "Batches of requests painted.");
+  out << "martist_server_batches_total " << batches << "\n";
+
+  declare("server_latency_seconds", "histogram", "Seconds from reading a request to answering it.");
+  for (std::size_t bucket = 0; bucket < latencyBucketCount; bucket++)
+    out << "martist_server_latency_seconds_bucket{le=\"" << latencyBuckets[bucket] << "\"} " << latencyCounts[bucket]
+      << "\n";
+  out << "martist_server_latency_seconds_bucket{le=\"+Inf\"} " << answered << "\n"
+    << "martist_server_latency_seconds_sum " << latencySum << "\n"
+    << "martist_server_latency_seconds_count " << answered << "\n";
+
+  return out.str();
+}
+
+//////////////////////////////// CLIENT
+
+RenderClient::RenderClient(const std::string& socketPath) : responses(nullptr), requests(nullptr) {
+  sockaddr_un address;
+  connection = openSocket(socketPath, address);
+
+  if (connect(connection, (sockaddr*)&address, sizeof(address)) != 0) {
+    close(connection);
+    throw std::runtime_error("Cannot connect to " + socketPath + ": " + std::strerror(errno));
+  }
+
+  socket = std::make_unique<SocketBuffer>(connection);
+  responses.rdbuf(socket.get());
+  requests.rdbuf(socket.get());
+}
+
+RenderClient::~RenderClient() {
+  socket.reset();
+  close(connection);
+}
+
+std::string RenderClient::render(const RenderRequest& request, std::ostream& out) {
+  requests << request.toLine() << "\n" << request.spec;
+  requests.flush();
+  return receive(out);
+}
+
+std::string RenderClient::metrics() {
+  requests << "metrics\n";
+  requests.flush();
+
+  std::ostringstream text;
+  receive(text);
+  return text.str();
+}
+
+std::string RenderClient::receive(std::ostream& out) {
+  std::string status;
+  if (!std::getline(responses, status)) throw std::runtime_error("The server closed the connection");
+
+  if (status.compare(0, 6, "ERROR ") == 0) throw std::runtime_error(status.substr(6));
+  if (status.compare(0, 3, "OK ") != 0) throw std::runtime_error("Unexpected response " + status);
+
+  std::string spec(std::stoull(status.substr(3)), '\0');
+  responses.read(&spec[0], spec.size());
+
+  std::vector<char> chunk;
+  std::string length;
+  while (std::getline(responses, length)) {
+    std::size_t size = std::stoull(length, nullptr, 16);
+    if (size == 0) return spec;
+
+    chunk.resize(size);
+    if (!responses.read(chunk.data(), size)) break;
+    out.write(chunk.data(), size);
+  }
+
+  throw std::runtime_error("The server closed the connection");
+}
+
+/////////////////////////////// LOCAL FUNCTIONS
+
+static int openSocket(const std::string& path, sockaddr_un& address) {
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) throw std::runtime_error("Socket path is too long: " + path);
+  std::strcpy(address.sun_path, path.c_str());
+
+  int socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket < 0) throw std::runtime_error(std::string("Cannot open a socket: ") + std::strerror(errno));
+  return socket;
+}
@@ -0,0 +1,151 @@
+#include "../include/RenderStats.hpp"
+#include "../include/GenerationContext.hpp"
+#include <sstream>
+
+// Names of the red, green and blue channels
+static const char* channelNames[] = { "red", "green", "blue" };
+
+void RenderStats::record(RenderPhase phase, double seconds) {
+  auto& time = phases[std::size_t(phase)];
+  time.seconds += seconds;
+  time.calls++;
+}
+
+void RenderStats::countNodes(std::size_t channel, const ExpressionProgram& program) {
+  NodeCounts counts;
+
+  for (const auto& instruction : program.instructions()) {
+    switch (instruction.code) {
+    case OpCode::pushVariable:
+    case OpCode::pushConstant: counts.leaves++; break;
+    case OpCode::applySingle: counts.singles++; break;
+    case OpCode::applyDouble: counts.doubles++; break;
+    }
+  }
+
+  channels[channel] = counts;
+}
+
+void RenderStats::addProfile(const OperatorProfile* profiles) {
+  std::lock_guard<std::mutex> guard(operatorLock);
+
+  for (std::size_t representation = 0; representation < 256; representation++) {
+    operators[representation].values += profiles[representation].values;
+    operators[representation].seconds += profiles[representation].seconds;
+  }
+}
+
+void RenderStats::reset() {
+  for (auto& phase : phases) phase = PhaseTime();
+  for (auto& channel : channels) channel = NodeCounts();
+  evaluated = 0;
+  filled = 0;
+
+  std::lock_guard<std::mutex> guard(operatorLock);
+  for (auto& profile : operators) profile = OperatorProfile();
+}
+
+OperatorProfile RenderStats::operatorProfile(char representation) const {
+  std::lock_guard<std::mutex> guard(operatorLock);
+  return operators[std::uint8_t(representation)];
+}
+
+//////////////////////////////// EXPORT
+
+std::string RenderStats::toJson() const {
+  std::ostringstream out;
+  out.precision(9);
+
+  out << "{\n  \"phases\": {";
+  for (std::size_t phase = 0; phase < phaseCount; phase++)
+    out << (phase ? "," : "") << "\n    \"" << phaseName(RenderPhase(phase)) << "\": { \"seconds\": "
+      << phases[phase].seconds << ", \"calls\": " << phases[phase].calls << " }";
+
+  out << "\n  },\n  \"nodes\": {";
+  for (std::size_t channel = 0; channel < 3; channel++)
+    out << (channel ? "," : "") << "\n    \"" << channelNames[channel] << "\": { \"leaves\": "
+      << channels[channel].leaves << ", \"singles\": " << channels[channel].singles << ", \"doubles\": "
+      << channels[channel].doubles << " }";
+
+  out << "\n  },\n  \"pixels\": { \"evaluated\": " << evaluated << ", \"filled\": " << filled << " },\n";
+
+  out << "  \"operators\": {";
+  std::lock_guard<std::mutex> guard(operatorLock);
+  bool first = true;
+  for (std::size_t representation = 0; representation < 256; representation++) {
+    const auto& profile = operators[representation];
+    if (profile.values == 0) continue;
+
+    out << (first ? "" : ",") << "\n    \"" << operatorName(char(representation)) << "\": { \"values\": "
+      << profile.values << ", \"seconds\": " << profile.seconds << ", \"nsPerValue\": "
+      << profile.seconds * 1e9 / profile.values << " }";
+    first = false;
+  }
+  out << "\n  }\n}\n";
+
+  return out.str();
+}
+
+std::string RenderStats::toPrometheus() const {
+  std::ostringstream out;
+  out.precision(9);
+
+  // Writes the help and type lines of a metric
+  auto declare = [&out](const char* name, const char* type, const char* help) {
+    out << "# HELP martist_" << name << " " << help << "\n# TYPE martist_" << name << " " << type << "\n";
+  };
+
+  declare("phase_seconds_total", "counter", "Seconds spent in each phase.");
+  for (std::size_t phase = 0; phase < phaseCount; phase++)
+    out << "martist_phase_seconds_total{phase=\"" << phaseName(RenderPhase(phase)) << "\"} "
+      << phases[phase].seconds << "\n";
+
+  declare("phase_calls_total", "counter", "Times each phase was gone through.");
+  for (std::size_t phase = 0; phase < phaseCount; phase++)
+    out << "martist_phase_calls_total{phase=\"" << phaseName(RenderPhase(phase)) << "\"} " << phases[phase].calls
+      << "\n";
+
+  declare("tree_nodes", "gauge", "Nodes of each kind in the last trees rendered.");
+  for (std::size_t channel = 0; channel < 3; channel++) {
+    const char* name = channelNames[channel];
+    out << "martist_tree_nodes{channel=\"" << name << "\",type=\"leaf\"} " << channels[channel].leaves << "\n"
+      << "martist_tree_nodes{channel=\"" << name << "\",type=\"single\"} " << channels[channel].singles << "\n"
+      << "martist_tree_nodes{channel=\"" << name << "\",type=\"double\"} " << channels[channel].doubles << "\n";
+  }
+
+  declare("pixels_evaluated_total", "counter", "Pixels whose trees were evaluated.");
+  out << "martist_pixels_evaluated_total " << evaluated << "\n";
+  declare("pixels_filled_total", "counter", "Pixels filled from their tile's bounds without evaluating them.");
+  out << "martist_pixels_filled_total " << filled << "\n";
+
+  std::lock_guard<std::mutex> guard(operatorLock);
+  declare("operator_values_total", "counter", "Values computed by each kind of expression in sampled rows.");
+  for (std::size_t representation = 0; representation < 256; representation++)
+    if (operators[representation].values)
+      out << "martist_operator_values_total{operator=\"" << operatorName(char(representation)) << "\"} "
+        << operators[representation].values << "\n";
+
+  declare("operator_seconds_total", "counter", "Seconds spent by each kind of expression in sampled rows.");
+  for (std::size_t representation = 0; representation < 256; representation++)
+    if (operators[representation].values)
+      out << "martist_operator_seconds_total{operator=\"" << operatorName(char(representation)) << "\"} "
+        << operators[representation].seconds << "\n";
+
+  return out.str();
+}
+
+const char* RenderStats::phaseName(RenderPhase phase) {
+  static const char* names[] = { "build", "parse", "prepare", "render", "output", "cached" };
+  return names[std::size_t(phase)];
+}
+
+std::string RenderStats::operatorName(char representation) {
+  if (representation == 0) return "constant";
+
+  const auto& context = *GenerationContext::standard();
+  for (const auto* expressions : { &context.singleExpressions, &context.doubleExpressions })
+    for (const auto& expression : *expressions)
+      if (expression.characterRepresentation == representation) return expression.kernelName;
+
+  return std::string("variable_") + representation;
+}
@@ -0,0 +1,232 @@
+#include "../include/SpecArchive.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bytes before the nodes of a record: the node count of each channel's tree
+static constexpr std::size_t recordHeaderSize = 3 * sizeof(std::uint32_t);
+
+// local functions
+
+// FNV-1a hash of a run of bytes
+static std::uint64_t hashBytes(const char* bytes, std::size_t count);
+
+// Reads a number stored at any alignment
+template <class Number> static Number readNumber(const char* bytes);
+
+SpecArchive::SpecArchive(const std::string& path) {
+  int file = open(path.c_str(), O_RDONLY);
+  if (file < 0) throw std::runtime_error("Cannot open spec archive " + path);
+
+  struct stat status;
+  if (fstat(file, &status) != 0) {
+    close(file);
+    throw std::runtime_error("Cannot read spec archive " + path);
+  }
+  bytes = status.st_size;
+
+  if (bytes < sizeof(SpecArchiveHeader)) {
+    close(file);
+    throw std::runtime_error("Not a spec archive: " + path);
+  }
+
+  void* mapping = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (mapping == MAP_FAILED) throw std::runtime_error("Cannot map spec archive " + path);
+  data = (const char*)mapping;
+
+  // Leaves nothing mapped behind when the archive turns out to be unusable
+  auto reject = [this](const std::string& problem) {
+    munmap((void*)data, bytes);
+    data = nullptr;
+    throw std::runtime_error(problem);
+  };
+
+  SpecArchiveHeader header;
+  std::memcpy(&header, data, sizeof(header));
+
+  if (std::memcmp(header.magic, "MSPB", 4) != 0 || header.variableCount == 0 || header.variableCount > 4)
+    reject("Not a spec archive: " + path);
+  if (header.version != formatVersion)
+    reject("Spec archive " + path + " has layout version " + std::to_string(header.version));
+  if (header.operatorTable != operatorTable())
+    reject("Spec archive " + path + " was written with other expressions");
+
+  std::size_t bodySize = bytes - sizeof(header);
+  if (header.recordCount > bodySize / (sizeof(std::uint64_t) + recordHeaderSize))
+    reject("Spec archive " + path + " is truncated");
+  if (hashBytes(data + sizeof(header), bodySize) != header.checksum)
+    reject("Spec archive " + path + " is corrupted");
+
+  records = header.recordCount;
+  offsets = data + sizeof(header);
+
+  // Every record must lie within the file, so that reading one never needs checking again
+  for (std::size_t record = 0; record < records; record++) {
+    std::uint64_t offset = readNumber<std::uint64_t>(offsets + record * sizeof(std::uint64_t));
+    if (offset > bytes || bytes - offset < recordHeaderSize) reject("Spec archive " + path + " is truncated");
+
+    std::uint64_t length = 0;
+    for (std::size_t channel = 0; channel < 3; channel++)
+      length += readNumber<std::uint32_t>(data + offset + channel * sizeof(std::uint32_t));
+    if (length > bytes - offset - recordHeaderSize) reject("Spec archive " + path + " is truncated");
+  }
+
+  context = std::make_shared<GenerationContext>(
+    std::vector<char>(header.variables, header.variables + header.variableCount), 0);
+
+  // Records are mostly read in order
+  madvise(mapping, bytes, MADV_SEQUENTIAL);
+}
+
+SpecArchive::~SpecArchive() {
+  if (data) munmap((void*)data, bytes);
+}
+
+const unsigned char* SpecArchive::channel(std::size_t record, std::size_t channel, std::size_t& length) const {
+  const char* start = data + readNumber<std::uint64_t>(offsets + record * sizeof(std::uint64_t));
+  const char* code = start + recordHeaderSize;
+
+  for (std::size_t previous = 0; previous < channel; previous++)
+    code += readNumber<std::uint32_t>(start + previous * sizeof(std::uint32_t));
+
+  length = readNumber<std::uint32_t>(start + channel * sizeof(std::uint32_t));
+  return (const unsigned char*)code;
+}
+
+void SpecArchive::read(std::size_t record, SpecRecord& into) const {
+  ExpressionTree* trees[] = { &into.red, &into.green, &into.blue };
+
+  for (std::size_t index = 0; index < 3; index++) {
+    std::size_t length;
+    const unsigned char* code = channel(record, index, length);
+
+    trees[index]->setContext(context);
+    // Only an archive crafted by hand, with a valid checksum, can hold a malformed tree
+    if (!trees[index]->decode(code, length))
+      throw std::runtime_error("Spec archive holds a malformed tree in record " + std::to_string(record));
+  }
+
+  // The line the record would start at in text form
+  into.line = record * 3 + 1;
+}
+
+bool SpecArchive::next(SpecRecord& record) {
+  if (position >= records) return false;
+
+  read(position++, record);
+  return true;
+}
+
+void SpecArchive::writeText(std::ostream& out) const {
+  SpecRecord record;
+
+  for (std::size_t index = 0; index < records; index++) {
+    read(index, record);
+    out << record.red << '\n' << record.green << '\n' << record.blue << '\n';
+  }
+}
+
+std::size_t SpecArchive::write(const std::string& path, std::istream& text, const std::vector<char>& variables) {
+  if (variables.empty() || variables.size() > 4)
+    throw std::invalid_argument("Spec archives hold trees of 1 to 4 variables");
+
+  auto context = std::make_shared<GenerationContext>(variables, 0);
+  ExpressionTree tree(0, context);
+
+  // Each tree's encoded nodes, three per record
+  std::vector<std::string> specs;
+  std::string line;
+  std::size_t lineNumber = 0;
+
+  while (std::getline(text, line)) {
+    lineNumber++;
+
+    // Ignores carriage returns and blanks at either end, as corpora do
+    std::size_t first = 0, length = line.size();
+    while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t')) length--;
+    while (first < length && (line[first] == ' ' || line[first] == '\t')) first++;
+    if (first == length) continue;
+
+    std::size_t errorPosition;
+    const char* error;
+    if (!tree.read(line.data() + first, length - first, errorPosition, error))
+      throw std::invalid_argument("Line " + std::to_string(lineNumber) + ", column " +
+        std::to_string(first + errorPosition + 1) + ": " + error);
+
+    specs.emplace_back();
+    tree.encode(specs.back());
+  }
+
+  if (specs.size() % 3 != 0) throw std::invalid_argument("Record is missing channels");
+  std::size_t records = specs.size() / 3;
+
+  // Lays out the offsets and records after the header
+  std::string body(records * sizeof(std::uint64_t), '\0');
+  std::uint64_t offset = sizeof(SpecArchiveHeader) + body.size();
+
+  for (std::size_t record = 0; record < records; record++) {
+    std::memcpy(&body[record * sizeof(std::uint64_t)], &offset, sizeof(offset));
+
+    for (std::size_t index = 0; index < 3; index++) {
+      std::uint32_t length = std::uint32_t(specs[record * 3 + index].size());
+      body.append((const char*)&length, sizeof(length));
+    }
+    for (std::size_t index = 0; index < 3; index++) body += specs[record * 3 + index];
+
+    offset = sizeof(SpecArchiveHeader) + body.size();
+  }
+
+  SpecArchiveHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, "MSPB", 4);
+  header.version = formatVersion;
+  header.variableCount = std::uint16_t(variables.size());
+  std::copy(variables.begin(), variables.end(), header.variables);
+  header.operatorTable = operatorTable();
+  header.recordCount = records;
+  header.checksum = hashBytes(body.data(), body.size());
+
+  std::string temporary = path + ".tmp";
+  std::ofstream file(temporary, std::ios::binary);
+  file.write((const char*)&header, sizeof(header));
+  file.write(body.data(), body.size());
+  file.close();
+
+  if (!file || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    throw std::runtime_error("Cannot write spec archive " + path);
+  }
+
+  return records;
+}
+
+std::uint32_t SpecArchive::operatorTable() {
+  // Each expression's character, preceded by how many operands it takes
+  std::string table;
+  const auto& context = *GenerationContext::standard();
+  for (const auto& expression : context.singleExpressions) table += std::string("1") + expression.characterRepresentation;
+  for (const auto& expression : context.doubleExpressions) table += std::string("2") + expression.characterRepresentation;
+
+  std::uint64_t hash = hashBytes(table.data(), table.size());
+  return std::uint32_t(hash ^ (hash >> 32));
+}
+
+/////////////////////////////// LOCAL FUNCTIONS
+
+static std::uint64_t hashBytes(const char* bytes, std::size_t count) {
+  std::uint64_t hash = 14695981039346656037ull;
+  for (std::size_t index = 0; index < count; index++) hash = (hash ^ (unsigned char)bytes[index]) * 1099511628211ull;
+  return hash;
+}
+
+template <class Number> static Number readNumber(const char* bytes) {
+  Number number;
+  std::memcpy(&number, bytes, sizeof(number));
+  return number;
+}
@@ -0,0 +1,98 @@
+#include "../include/SpecCorpus.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SpecCorpus::SpecCorpus(const std::string& path) {
+  int file = open(path.c_str(), O_RDONLY);
+  if (file < 0) throw std::runtime_error("Cannot open spec corpus " + path);
+
+  struct stat status;
+  if (fstat(file, &status) != 0) {
+    close(file);
+    throw std::runtime_error("Cannot read spec corpus " + path);
+  }
+  size = status.st_size;
+
+  // Empty files cannot be mapped, and have no records anyway
+  if (size > 0) {
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (mapping == MAP_FAILED) {
+      close(file);
+      throw std::runtime_error("Cannot map spec corpus " + path);
+    }
+
+    // The corpus is read once from start to end
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    data = (const char*)mapping;
+  }
+
+  close(file);
+}
+
+SpecCorpus::~SpecCorpus() {
+  if (data) munmap((void*)data, size);
+}
+
+bool SpecCorpus::next(SpecRecord& record) {
+  ExpressionTree* channels[] = { &record.red, &record.green, &record.blue };
+
+  while (true) {
+    bool wellFormed = true;
+
+    for (std::size_t channel = 0; channel < 3; channel++) {
+      const char* start;
+      std::size_t length;
+
+      if (!nextLine(start, length)) {
+        // A record cut short at the end of the file
+        if (channel > 0) problems.push_back(SpecError{ line, 1, "Record is missing channels" });
+        return false;
+      }
+
+      if (channel == 0) record.line = line - 1;
+
+      // Keeps going through the record's lines even after a problem, so that the next record starts where it should
+      wellFormed = parseLine(*channels[channel], start, length) && wellFormed;
+    }
+
+    if (wellFormed) return true;
+  }
+}
+
+bool SpecCorpus::nextLine(const char*& start, std::size_t& length) {
+  while (position < size) {
+    start = data + position;
+
+    auto end = (const char*)std::memchr(start, '\n', size - position);
+    length = end ? end - start : size - position;
+    position += length + 1;
+    line++;
+
+    // Ignores carriage returns and blanks at either end
+    lineStart = start;
+    while (length > 0 && (start[length - 1] == '\r' || start[length - 1] == ' ' || start[length - 1] == '\t')) length--;
+    while (length > 0 && (start[0] == ' ' || start[0] == '\t')) {
+      start++;
+      length--;
+    }
+
+    if (length > 0) return true;
+  }
+
+  return false;
+}
+
+bool SpecCorpus::parseLine(ExpressionTree& tree, const char* start, std::size_t length) {
+  std::size_t errorPosition;
+  const char* error;
+
+  if (tree.read(start, length, errorPosition, error)) return true;
+
+  // The line counter already moved past this line, and columns count the blanks the line started with
+  problems.push_back(SpecError{ line - 1, std::size_t(start - lineStart) + errorPosition + 1, error });
+  return false;
+}
@@ -1,53 +1,34 @@
 #include "../include/SpecReader.hpp"
 #include "../include/ExpressionTree.hpp"
-#include <functional>
 #include <iostream>
 
-void SpecReader::makeStackRecipes(ExpressionTree& tree) {
-  // std::cout << "Making recipes..." << std::endl;
-  // std::cout << "For variables: ";
-  // Get recipes for leaf nodes
-  for (std::size_t index = 0; index < tree.variables.size(); index++) {
-    char representation = tree.variables[index];
-    // std::cout << representation << " ";
+void SpecReader::start(ExpressionTree& tree) {
+  arena = &tree.arena;
+  stack.clear();
 
-    // A function that makes the leaf node corresponding to this variable
-    stackRecipeEntries[representation] = [index, representation, this]() {
-      // std::cout << "Making variable " << representation << ". . . ";
-      // Creates the leaf node and stacks it on the pile
-      stack(std::make_unique<LeafNode>(index, representation));
-      // std::cout << "DONE" << std::endl;
-    };
-  }
+  // Forgets the recipes of the last read
+  for (char representation : known) recipes[(unsigned char)representation] = Recipe();
+  known.clear();
 
-  // std::cout << std::endl << "For single expressions: ";
-  // Get recipes for single nodes
-  for (std::size_t index = 0; index < tree.singleExpressions.size(); index++) {
-    auto expression = tree.singleExpressions[index];
-    // std::cout << expression.characterRepresentation << " ";
+  // Passes through the tree's variables, single and double expressions and makes a recipe for each one of them,
+  // indexed by their char representations
+  auto addRecipe = [this](char representation, Recipe::Kind kind, Expression expression) {
+    recipes[(unsigned char)representation].kind = kind;
+    recipes[(unsigned char)representation].expression = expression;
+    known.push_back(representation);
+  };
 
-    // A function that makes the single node corresponding to this character
-    stackRecipeEntries[expression.characterRepresentation] = [expression, this]() {
-      // std::cout << "Making single expression " << expression.characterRepresentation << ". . . ";
-      // Create a single node with recovered node as child and stack it on the pile
-      stack(std::make_unique<SingleNode>(expression, pop()));
-      // std::cout << "DONE" << std::endl;
-    };
-  }
+  const GenerationContext& context = *tree.context;
 
-  // std::cout << std::endl << "For double expressions: ";
-  // Get recipes for double nodes
-  for (std::size_t index = 0; index < tree.doubleExpressions.size(); index++) {
-    auto expression = tree.doubleExpressions[index];
-    // std::cout << expression.characterRepresentation << " ";
+  // Get recipes for leaf nodes
+  for (std::size_t index = 0; index < context.variables.size(); index++)
+    addRecipe(context.variables[index], Recipe::leaf, Expression(context.variables[index], int(index)));
 
-    // A function that makes the double node corresponding to this character
-    stackRecipeEntries[expression.characterRepresentation] = [expression, this]() {
-      // std::cout << "Making double expression " << expression.characterRepresentation << ". . . ";
-      // Create a double node with 2 recovered nodes as children and stack it on the pile
-      stack(std::make_unique<DoubleNode>(expression, pop(), pop()));
-      // std::cout << "DONE" << std::endl;
-    };
-  }
-  // std::cout << std::endl;
-}
\ No newline at end of file
+  // Get recipes for single nodes
+  for (const auto& expression : context.singleExpressions)
+    addRecipe(expression.characterRepresentation, Recipe::single, expression);
+
+  // Get recipes for double nodes
+  for (const auto& expression : context.doubleExpressions)
+    addRecipe(expression.characterRepresentation, Recipe::twofold, expression);
+}
@@ -0,0 +1,110 @@
+#include "../include/ThreadPool.hpp"
+
+ThreadPool::ThreadPool(std::size_t threadCount) {
+  if (threadCount == 0) threadCount = 1;
+
+  for (std::size_t index = 0; index < threadCount; index++) queues.push_back(std::make_unique<TaskQueue>());
+
+  // The first queue belongs to whoever calls run
+  for (std::size_t index = 1; index < threadCount; index++) threads.emplace_back(&ThreadPool::work, this, index);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  for (auto& thread : threads) thread.join();
+}
+
+void ThreadPool::run(std::vector<Task>& tasks) {
+  if (tasks.empty()) return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    remainingTasks = tasks.size();
+    firstError = nullptr;
+
+    // Deals the tasks evenly, keeping neighbouring tasks on the same thread
+    std::size_t perQueue = (tasks.size() + queues.size() - 1) / queues.size();
+    for (std::size_t index = 0; index < tasks.size(); index++) {
+      auto& queue = *queues[index / perQueue];
+      std::lock_guard<std::mutex> queueLock(queue.mutex);
+      queue.tasks.push_back(std::move(tasks[index]));
+    }
+
+    batch++;
+  }
+  wake.notify_all();
+
+  drain(0);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this]() { return remainingTasks == 0; });
+
+  if (firstError) std::rethrow_exception(firstError);
+}
+
+void ThreadPool::work(std::size_t index) {
+  std::size_t lastBatch = 0;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [this, lastBatch]() { return stopping || batch != lastBatch; });
+      if (stopping) return;
+      lastBatch = batch;
+    }
+
+    drain(index);
+  }
+}
+
+void ThreadPool::drain(std::size_t index) {
+  Task task;
+
+  while (takeTask(index, task)) {
+    std::exception_ptr error;
+
+    try { task(); }
+    catch (...) { error = std::current_exception(); }
+
+    finishTask(error);
+  }
+}
+
+bool ThreadPool::takeTask(std::size_t index, Task& task) {
+  // Own tasks are taken from the front
+  {
+    auto& queue = *queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      return true;
+    }
+  }
+
+  // Other threads' tasks are stolen from the back, away from where their owners work
+  for (std::size_t offset = 1; offset < queues.size(); offset++) {
+    auto& queue = *queues[(index + offset) % queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ThreadPool::finishTask(std::exception_ptr error) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (error && !firstError) firstError = error;
+
+  if (--remainingTasks == 0) done.notify_all();
+}
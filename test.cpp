@@ -11,13 +11,7 @@
 using namespace std;
 
 void makeImage(std::unique_ptr<uint8_t[]>& buffer, size_t w, size_t h) {
-  ofstream file("test_image.ppm");
-
-  file << "P6 " << w << " " << h << " 255\n";
-  for (std::size_t i = 0; i < width * height * 3; ++i)
-    file << buffer[i];
-
-  file.close();
+  writePPM("test_image.ppm", buffer.get(), w, h);
 }
 
 int main() {